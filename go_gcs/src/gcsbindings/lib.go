@@ -1,170 +1,395 @@
 package main
 
 import (
+	"code.google.com/p/go-uuid/uuid"
 	"fmt"
-	"io/ioutil"
-	"os"
-	"syscall"
-	"math/rand"
-	"time"
-	"sync"
 	"golang.org/x/net/context"
 	"golang.org/x/oauth2"
 	"golang.org/x/oauth2/google"
 	"google.golang.org/cloud"
 	"google.golang.org/cloud/storage"
-    "code.google.com/p/go-uuid/uuid"
+	"io"
+	"io/ioutil"
+	"math/rand"
+	"net"
+	"net/http"
+	"os"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
 )
 
 //#cgo CFLAGS: -fPIC
+//#include <stdlib.h>
 import "C"
 
 var projectID = "visualdb-1017"
 
-func getContext (keyPath string) context.Context {
+// Keep-alive connections kept per GCS host. Bounds the idle pool while
+// letting every IO processor hold a warm connection.
+const maxIdleConnsPerHost = 16
+
+// Contexts are cached per key path so the JSON key is parsed once and the
+// OAuth token and TLS connections are reused across calls.
+var ctx_cache = struct {
+	sync.Mutex
+	m map[string]context.Context
+}{m: make(map[string]context.Context)}
+
+func newTransport() *http.Transport {
+	return &http.Transport{
+		Proxy: http.ProxyFromEnvironment,
+		Dial: (&net.Dialer{
+			Timeout:   30 * time.Second,
+			KeepAlive: 30 * time.Second,
+		}).Dial,
+		TLSHandshakeTimeout: 10 * time.Second,
+		MaxIdleConnsPerHost: maxIdleConnsPerHost,
+	}
+}
+
+// Strings passed in from C point into memory the caller frees as soon as the
+// call returns. Exported functions copy them with ownString before starting
+// goroutines or keeping them anywhere that outlives the call.
+func ownString(s string) string {
+	return string([]byte(s))
+}
+
+func getContext(keyPath string) context.Context {
+	ctx_cache.Lock()
+	defer ctx_cache.Unlock()
+	if ctx, ok := ctx_cache.m[keyPath]; ok {
+		return ctx
+	}
+
 	jsonKey, err := ioutil.ReadFile(keyPath)
-	if err != nil { panic(err) }
+	if err != nil {
+		panic(err)
+	}
 	conf, err := google.JWTConfigFromJSON(jsonKey, storage.ScopeFullControl)
-	if err != nil { panic(err ) }
-	return cloud.NewContext(projectID, conf.Client(oauth2.NoContext))
+	if err != nil {
+		panic(err)
+	}
+	// The oauth2 client wraps the base client handed in through the context,
+	// so all requests share one pooled transport.
+	base := &http.Client{Transport: newTransport()}
+	authCtx := context.WithValue(oauth2.NoContext, oauth2.HTTPClient, base)
+	client := conf.Client(authCtx)
+	ctx := cloud.NewContext(projectID, client)
+	// Reads issue their own requests with the same client, so that an
+	// attempt's deadline can cancel them
+	ctx = context.WithValue(ctx, httpClientKey{}, client)
+	ctx_cache.m[ownString(keyPath)] = ctx
+	return ctx
 }
 
-func newFifo () string {
+func newFifo() string {
 	rand.Seed(time.Now().UnixNano())
 	fifo := fmt.Sprintf("/var/tmp/visualdb-%s", uuid.New())
 	err := syscall.Mkfifo(fifo, 0666)
-	if err != nil { panic(err) }
+	if err != nil {
+		panic(err)
+	}
 	return fifo
 }
 
-var wg_map = struct{
-        sync.RWMutex
-        m map[string]*sync.WaitGroup
+var wg_map = struct {
+	sync.RWMutex
+	m map[string]*sync.WaitGroup
 }{m: make(map[string]*sync.WaitGroup)}
 
-//export gcs_read
-func gcs_read (key string, storageBucket string, path string) []byte {
+// Initial capacity of the C buffer handed back by gcs_read_buffer. Frames are
+// ~20-40 KB so most reads never grow it.
+const readBufferSize = 64 * 1024
+
+// Reads r into a C-allocated buffer until EOF or until limit bytes have been
+// read; a negative limit reads to EOF. On success the caller owns the returned
+// memory and must release it with free().
+func readStream(r io.Reader, limit int) (unsafe.Pointer, int, error) {
+	// Read straight into C memory so the bytes are copied exactly once
+	capacity := readBufferSize
+	if limit >= 0 && capacity > limit {
+		capacity = limit
+	}
+	if capacity < 1 {
+		capacity = 1
+	}
+	buf := C.malloc(C.size_t(capacity))
+	if buf == nil {
+		panic("readStream: out of memory")
+	}
+	n := 0
+	for limit < 0 || n < limit {
+		if n == capacity {
+			capacity *= 2
+			if limit >= 0 && capacity > limit {
+				capacity = limit
+			}
+			buf = C.realloc(buf, C.size_t(capacity))
+			if buf == nil {
+				panic("readStream: out of memory")
+			}
+		}
+		dst := (*[1 << 30]byte)(buf)[n:capacity:capacity]
+		m, err := r.Read(dst)
+		n += m
+		if err == io.EOF {
+			break
+		}
+		if err != nil {
+			C.free(buf)
+			return nil, 0, err
+		}
+	}
+	return buf, n, nil
+}
+
+// Makes a single attempt at reading the whole object into a C-allocated
+// buffer. On success the caller owns the returned memory and must release it
+// with free(). Retries, deadlines and hedging are layered on by readObject.
+func readAttempt(ctx context.Context, storageBucket string,
+	path string) (unsafe.Pointer, int, error) {
+	threshold, parts := rangeSettings()
+
+	if threshold > 0 {
+		return readRanged(ctx, storageBucket, path, threshold, parts)
+	}
+
+	resp, err := getObject(ctx, storageBucket, path, "")
+	if err != nil {
+		return nil, 0, err
+	}
+	defer resp.Body.Close()
+	switch resp.StatusCode {
+	case http.StatusOK:
+		return readStream(resp.Body, -1)
+	case http.StatusNotFound:
+		return nil, 0, storage.ErrObjectNotExist
+	default:
+		return nil, 0, fmt.Errorf("GET %s: %s", path, resp.Status)
+	}
+}
+
+// Reads the whole object into a C-allocated buffer and stores its length in
+// size. The caller owns the returned memory and must release it with free().
+// Returns NULL if the object could not be read under the current read policy.
+//
+//export gcs_read_buffer
+func gcs_read_buffer(key string, storageBucket string, path string,
+	size *C.size_t) unsafe.Pointer {
 	ctx := getContext(key)
-	fifo := newFifo()
+	// Abandoned hedged and timed out attempts wind down after this returns
+	storageBucket, path = ownString(storageBucket), ownString(path)
 
-	rc, err := storage.NewReader(ctx, storageBucket, path)
-    // Loop three times to retry because storage api does not provide error
-    // code
-    i := 0
-    for {
-        if err != nil {
-            if i == 3 {
-                panic(err)
-            }
-            fmt.Print(err.Error() + "\n")
-            fmt.Printf("Retrying %d time...\n", i)
-            time.Sleep(1e9)
-    	    rc, err = storage.NewReader(ctx, storageBucket, path)
-            i = i + 1
-            continue
-        }
-        break
-    }
-
-	contents, err := ioutil.ReadAll(rc)
-	if err != nil { panic(err) }
-
-	go func () {
-		fd, err := syscall.Open(fifo, syscall.O_WRONLY, 0)
-		if err != nil { panic(err) }
+	buf, n, err := readObject(ctx, storageBucket, path)
+	if err != nil {
+		fmt.Printf("Failed to read %s: %s\n", path, err.Error())
+		*size = 0
+		return nil
+	}
 
-		f := os.NewFile(uintptr(fd), "foobar")
-		defer f.Close()
-		_, err = f.Write(contents)
-		if err != nil { panic(err) }
-	} ()
+	*size = C.size_t(n)
+	return buf
+}
+
+// Reads count objects concurrently with at most workers requests in flight.
+// paths, buffers, sizes and status are C arrays of length count. For every
+// object that was read, buffers[i] holds a malloc'd copy of sizes[i] bytes
+// owned by the caller and status[i] is 0; failed reads leave buffers[i] NULL
+// and status[i] -1. Returns the number of failed reads.
+//
+//export gcs_read_many
+func gcs_read_many(key string, storageBucket string,
+	paths **C.char, count C.int, workers C.int,
+	buffers *unsafe.Pointer, sizes *C.size_t,
+	status *C.int) C.int {
+	ctx := getContext(key)
+	storageBucket = ownString(storageBucket)
+
+	n := int(count)
+	pathArr := (*[1 << 28]*C.char)(unsafe.Pointer(paths))[:n:n]
+	bufArr := (*[1 << 28]unsafe.Pointer)(unsafe.Pointer(buffers))[:n:n]
+	sizeArr := (*[1 << 28]C.size_t)(unsafe.Pointer(sizes))[:n:n]
+	statusArr := (*[1 << 28]C.int)(unsafe.Pointer(status))[:n:n]
+
+	// Copy the paths before handing them to goroutines
+	names := make([]string, n)
+	for i := 0; i < n; i++ {
+		names[i] = C.GoString(pathArr[i])
+	}
+
+	return readConcurrently(n, int(workers), names, bufArr, sizeArr, statusArr,
+		func(i int) (unsafe.Pointer, int, error) {
+			return readObject(ctx, storageBucket, names[i])
+		})
+}
+
+// Runs read(i) for every i in [0, n) with at most workers calls in flight and
+// stores the results in bufs, sizes and status as gcs_read_many describes.
+// names are only used to report failures. Returns the number of failed reads.
+func readConcurrently(n int, workers int, names []string,
+	bufs []unsafe.Pointer, sizes []C.size_t, status []C.int,
+	read func(i int) (unsafe.Pointer, int, error)) C.int {
+	if workers < 1 {
+		workers = 1
+	}
+	if workers > n {
+		workers = n
+	}
 
-	return []byte(fifo)
+	var failed int32
+	var wg sync.WaitGroup
+	work := make(chan int, n)
+	for i := 0; i < n; i++ {
+		work <- i
+	}
+	close(work)
+	for w := 0; w < workers; w++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for i := range work {
+				buf, size, err := read(i)
+				if err != nil {
+					fmt.Printf("Failed to read %s: %s\n", names[i], err.Error())
+					bufs[i] = nil
+					sizes[i] = 0
+					status[i] = -1
+					atomic.AddInt32(&failed, 1)
+					continue
+				}
+				bufs[i] = buf
+				sizes[i] = C.size_t(size)
+				status[i] = 0
+			}
+		}()
+	}
+	wg.Wait()
+
+	return C.int(failed)
 }
 
 //export gcs_write
-func gcs_write (key string, storageBucket string, path string) []byte {
+func gcs_write(key string, storageBucket string, path string) []byte {
 	ctx := getContext(key)
 	fifo := newFifo()
 
-    // To make sure the path name is still valid memory
-    // If passed in by a C program, it might be on the stack or cleaned up
-    // Probably overkill
-    x := []byte(string(path));
-    s := string(x);
-	wc := storage.NewWriter(ctx, storageBucket, s)
-
-    wg_map.Lock()
-    _, ok := wg_map.m[s]
-    if !ok {
-	    wg_map.m[s] = &sync.WaitGroup{}
-    }
-    wg_map.Unlock()
-    wg_map.RLock()
-    (*wg_map.m[s]).Add(1)
-    wg_map.RUnlock()
-	go func () {
+	// The upload finishes in a goroutine after this returns
+	s := ownString(path)
+	wc := storage.NewWriter(ctx, ownString(storageBucket), s)
+
+	wg_map.Lock()
+	_, ok := wg_map.m[s]
+	if !ok {
+		wg_map.m[s] = &sync.WaitGroup{}
+	}
+	wg_map.Unlock()
+	wg_map.RLock()
+	(*wg_map.m[s]).Add(1)
+	wg_map.RUnlock()
+	go func() {
 		defer func() {
-            wg_map.RLock()
-            (*wg_map.m[s]).Done()
-            wg_map.RUnlock()
-        }()
+			wg_map.RLock()
+			(*wg_map.m[s]).Done()
+			wg_map.RUnlock()
+		}()
 		fd, err := syscall.Open(fifo, syscall.O_RDONLY, 0)
-		if err != nil { panic(err) }
+		if err != nil {
+			panic(err)
+		}
 
 		f := os.NewFile(uintptr(fd), "foobar")
 		defer f.Close()
 
-		contents, err := ioutil.ReadAll(f)
-		if err != nil { panic(err) }
-
-		_, err = wc.Write(contents[:len(contents)])
-		if err != nil { panic(err) }
-
-		err = wc.Close()
-        i := 0
-        for {
-            if err != nil {
-                if i == 3 {
-                    panic(err)
-                }
-                fmt.Print(err.Error() + "\n")
-                fmt.Printf("Retrying %d time...\n", i)
-                time.Sleep(1e9)
-    	        err = wc.Close()
-                i = i + 1
-                continue
-            }
-            break
-        }
-	} ()
-
-	return []byte(fifo)
+		// Forward each chunk as soon as the producer writes it so the
+		// upload overlaps with computation and memory stays bounded
+		buf := make([]byte, writeChunkSize)
+		_, err = io.CopyBuffer(wc, f, buf)
+		if err != nil {
+			panic(err)
+		}
+
+		closeWriter(wc)
+	}()
+
+	// NUL-terminated so C can fopen the returned name directly
+	return []byte(fifo + "\x00")
+}
+
+// Size of the chunks streamed into the storage writer
+const writeChunkSize = 1 << 20
+
+func closeWriter(wc *storage.Writer) {
+	err := wc.Close()
+	i := 0
+	for {
+		if err != nil {
+			if i == 3 {
+				panic(err)
+			}
+			fmt.Print(err.Error() + "\n")
+			fmt.Printf("Retrying %d time...\n", i)
+			time.Sleep(1e9)
+			err = wc.Close()
+			i = i + 1
+			continue
+		}
+		break
+	}
+}
+
+// Uploads size bytes at data to the object at path, streaming them in
+// writeChunkSize pieces straight from C memory. Returns once the object is
+// committed.
+//
+//export gcs_write_buffer
+func gcs_write_buffer(key string, storageBucket string, path string,
+	data unsafe.Pointer, size C.size_t) {
+	ctx := getContext(key)
+	// The writer uploads from a goroutine of its own
+	wc := storage.NewWriter(ctx, ownString(storageBucket), ownString(path))
+
+	n := int(size)
+	for off := 0; off < n; off += writeChunkSize {
+		end := off + writeChunkSize
+		if end > n {
+			end = n
+		}
+		chunk := (*[1 << 40]byte)(data)[off:end:end]
+		_, err := wc.Write(chunk)
+		if err != nil {
+			panic(err)
+		}
+	}
+
+	closeWriter(wc)
 }
 
 //export gcs_object_exists
-func gcs_object_exists (key string, storageBucket string, path string) bool {
+func gcs_object_exists(key string, storageBucket string, path string) bool {
 	ctx := getContext(key)
 
-    _, err := storage.StatObject(ctx, storageBucket, string(path))
-    if err == storage.ErrObjectNotExist {
-        return false
-    }
-    if err != nil {
-        panic(err)
-        return false
-    }
-    return true
+	_, err := storage.StatObject(ctx, storageBucket, string(path))
+	if err == storage.ErrObjectNotExist {
+		return false
+	}
+	if err != nil {
+		panic(err)
+		return false
+	}
+	return true
 }
 
 //export gcs_ensure_writes_are_done
-func gcs_ensure_writes_are_done (path string) {
-    wg_map.RLock()
-    x := wg_map.m[path]
-    wg_map.RUnlock()
-    (*x).Wait()
-    wg_map.Lock()
+func gcs_ensure_writes_are_done(path string) {
+	wg_map.RLock()
+	x := wg_map.m[path]
+	wg_map.RUnlock()
+	(*x).Wait()
+	wg_map.Lock()
 	delete(wg_map.m, path)
-    wg_map.Unlock()
+	wg_map.Unlock()
 }
-func main () {}
+func main() {}
@@ -0,0 +1,324 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"golang.org/x/net/context"
+	"google.golang.org/cloud/storage"
+	"io"
+	"net/http"
+	"net/url"
+	"sync"
+	"unsafe"
+)
+
+//#include <stdlib.h>
+import "C"
+
+// Context key under which getContext stores the authenticated client
+type httpClientKey struct{}
+
+// Objects larger than threshold bytes have the rest of their bytes fetched
+// as parts concurrent byte range requests. Set from C through
+// gcs_set_range_policy; a threshold of zero keeps every read a single stream.
+var rangePolicy = struct {
+	sync.RWMutex
+	threshold int64
+	parts     int
+}{
+	threshold: 8 << 20,
+	parts:     8,
+}
+
+var errObjectChanged = errors.New("object changed while it was being read")
+
+// Returned by getRange when the range starts past the end of the object
+var errRangeNotSatisfiable = errors.New("range starts past the end of the object")
+
+// Sets the object size above which reads are split into parts concurrent
+// range requests. A threshold of zero disables ranged reads.
+//
+//export gcs_set_range_policy
+func gcs_set_range_policy(threshold C.size_t, parts C.int) {
+	rangePolicy.Lock()
+	defer rangePolicy.Unlock()
+	rangePolicy.threshold = int64(threshold)
+	rangePolicy.parts = int(parts)
+	if rangePolicy.parts < 1 {
+		rangePolicy.parts = 1
+	}
+}
+
+// The current threshold and number of parts; a threshold of zero means ranged
+// reads are off
+func rangeSettings() (int64, int64) {
+	rangePolicy.RLock()
+	defer rangePolicy.RUnlock()
+	return rangePolicy.threshold, int64(rangePolicy.parts)
+}
+
+func objectURL(storageBucket string, path string) string {
+	return "https://storage.googleapis.com/" + storageBucket + "/" +
+		(&url.URL{Path: path}).EscapedPath()
+}
+
+// Issues a GET for the object through the client getContext stored in ctx,
+// with the Range header set unless byteRange is empty. The request is
+// cancelled when ctx is done, so an attempt's deadline aborts its transfer.
+func getObject(ctx context.Context, storageBucket string, path string,
+	byteRange string) (*http.Response, error) {
+	client, ok := ctx.Value(httpClientKey{}).(*http.Client)
+	if !ok {
+		return nil, errors.New("context has no GCS client")
+	}
+
+	req, err := http.NewRequest("GET", objectURL(storageBucket, path), nil)
+	if err != nil {
+		return nil, err
+	}
+	if byteRange != "" {
+		req.Header.Set("Range", byteRange)
+	}
+	req.Cancel = ctx.Done()
+	return client.Do(req)
+}
+
+// Parses a Content-Range header of the form "bytes first-last/total" and
+// returns first and total
+func parseContentRange(header string) (int64, int64, error) {
+	var first, last, total int64
+	_, err := fmt.Sscanf(header, "bytes %d-%d/%d", &first, &last, &total)
+	if err != nil || first > last || last >= total {
+		return 0, 0, fmt.Errorf("bad Content-Range %q", header)
+	}
+	return first, total, nil
+}
+
+// Issues a GET for length bytes at offset and returns the response along with
+// the size of the whole object. length must be positive. The body starts at
+// offset: a 206 must say it starts there, and a server that ignores Range and
+// sends the whole object with 200 is only accepted for ranges at offset zero.
+// Anything else is an error, so the retry policy can act rather than the
+// caller reading the wrong bytes.
+func getRange(ctx context.Context, storageBucket string, path string,
+	offset int64, length int64) (*http.Response, int64, error) {
+	if length <= 0 {
+		return nil, 0, fmt.Errorf("GET %s: empty range", path)
+	}
+	resp, err := getObject(ctx, storageBucket, path,
+		fmt.Sprintf("bytes=%d-%d", offset, offset+length-1))
+	if err != nil {
+		return nil, 0, err
+	}
+	switch resp.StatusCode {
+	case http.StatusPartialContent:
+		first, total, err := parseContentRange(resp.Header.Get("Content-Range"))
+		if err == nil && first != offset {
+			err = fmt.Errorf("asked for bytes from %d, got bytes from %d",
+				offset, first)
+		}
+		if err != nil {
+			resp.Body.Close()
+			return nil, 0, fmt.Errorf("GET %s: %s", path, err.Error())
+		}
+		return resp, total, nil
+	case http.StatusOK:
+		// The whole object; it holds the range only if the range starts it,
+		// and its length is the object's size
+		if offset > 0 && resp.ContentLength >= 0 &&
+			resp.ContentLength <= offset {
+			resp.Body.Close()
+			return nil, 0, errRangeNotSatisfiable
+		}
+		if offset != 0 || resp.ContentLength < 0 {
+			resp.Body.Close()
+			return nil, 0, fmt.Errorf("GET %s: range ignored", path)
+		}
+		return resp, resp.ContentLength, nil
+	case http.StatusNotFound:
+		resp.Body.Close()
+		return nil, 0, storage.ErrObjectNotExist
+	case http.StatusRequestedRangeNotSatisfiable:
+		resp.Body.Close()
+		return nil, 0, errRangeNotSatisfiable
+	default:
+		resp.Body.Close()
+		return nil, 0, fmt.Errorf("GET %s: %s", path, resp.Status)
+	}
+}
+
+func cBytes(buf unsafe.Pointer, n int64) []byte {
+	return (*[1 << 40]byte)(buf)[:n:n]
+}
+
+// Reads the object into a C-allocated buffer, starting with a range request
+// for its first threshold bytes. Objects no larger than that cost that one
+// request. For larger objects the Content-Range of the first response gives
+// the size, and the rest is split into parts ranges fetched concurrently into
+// their slice of the buffer.
+func readRanged(ctx context.Context, storageBucket string, path string,
+	threshold int64, parts int64) (unsafe.Pointer, int, error) {
+	resp, total, err := getRange(ctx, storageBucket, path, 0, threshold)
+	if err == errRangeNotSatisfiable {
+		// Only an empty object has no byte zero
+		return emptyBuffer(), 0, nil
+	}
+	if err != nil {
+		return nil, 0, err
+	}
+	first := total
+	if first > threshold {
+		first = threshold
+	}
+	buf, n, err := readStream(resp.Body, int(first))
+	resp.Body.Close()
+	if err != nil {
+		return nil, 0, err
+	}
+	if int64(n) != first {
+		C.free(buf)
+		return nil, 0, errObjectChanged
+	}
+	if total == first {
+		return buf, n, nil
+	}
+
+	buf = C.realloc(buf, C.size_t(total))
+	if buf == nil {
+		panic("readRanged: out of memory")
+	}
+	data := cBytes(buf, total)
+
+	remaining := total - first
+	partSize := (remaining + parts - 1) / parts
+	errs := make(chan error, parts)
+	var wg sync.WaitGroup
+	for off := first; off < total; off += partSize {
+		length := partSize
+		if off+length > total {
+			length = total - off
+		}
+		wg.Add(1)
+		go func(off int64, length int64) {
+			defer wg.Done()
+			resp, size, err := getRange(ctx, storageBucket, path, off, length)
+			if err != nil {
+				errs <- err
+				return
+			}
+			defer resp.Body.Close()
+			if size != total {
+				errs <- errObjectChanged
+				return
+			}
+			_, err = io.ReadFull(resp.Body, data[off:off+length])
+			if err != nil {
+				errs <- err
+			}
+		}(off, length)
+	}
+	wg.Wait()
+	close(errs)
+	if err := <-errs; err != nil {
+		C.free(buf)
+		return nil, 0, err
+	}
+
+	return buf, int(total), nil
+}
+
+// Makes a single attempt at reading length bytes at offset into a C-allocated
+// buffer. A range that runs past the end of the object is cut short, and one
+// that starts past it reads nothing.
+func readRangeAttempt(ctx context.Context, storageBucket string, path string,
+	offset int64, length int64) (unsafe.Pointer, int, error) {
+	resp, _, err := getRange(ctx, storageBucket, path, offset, length)
+	if err == errRangeNotSatisfiable {
+		return emptyBuffer(), 0, nil
+	}
+	if err != nil {
+		return nil, 0, err
+	}
+	defer resp.Body.Close()
+	return readStream(resp.Body, int(length))
+}
+
+// A buffer for a read of zero bytes, which is not NULL so C does not mistake
+// it for a failure
+func emptyBuffer() unsafe.Pointer {
+	buf := C.malloc(1)
+	if buf == nil {
+		panic("emptyBuffer: out of memory")
+	}
+	return buf
+}
+
+// Reads length bytes at offset into a C-allocated buffer under the read
+// policy and stores the number of bytes read in size. The caller owns the
+// returned memory and must release it with free(). Returns NULL if the range
+// could not be read.
+//
+//export gcs_read_range
+func gcs_read_range(key string, storageBucket string, path string,
+	offset C.size_t, length C.size_t,
+	size *C.size_t) unsafe.Pointer {
+	ctx := getContext(key)
+	storageBucket, path = ownString(storageBucket), ownString(path)
+
+	buf, n, err := readRange(ctx, storageBucket, path, int64(offset),
+		int64(length))
+	if err != nil {
+		fmt.Printf("Failed to read %s: %s\n", path, err.Error())
+		*size = 0
+		return nil
+	}
+
+	*size = C.size_t(n)
+	return buf
+}
+
+// Reads a byte range under the read policy. An empty range needs no request.
+func readRange(ctx context.Context, storageBucket string, path string,
+	offset int64, length int64) (unsafe.Pointer, int, error) {
+	if length == 0 {
+		return emptyBuffer(), 0, nil
+	}
+	return readWithPolicy(ctx, path,
+		func(ctx context.Context) (unsafe.Pointer, int, error) {
+			return readRangeAttempt(ctx, storageBucket, path, offset, length)
+		})
+}
+
+// Reads count byte ranges concurrently with at most workers requests in
+// flight. Range i is lengths[i] bytes at offsets[i] of paths[i]; the other
+// arguments and the result are as for gcs_read_many.
+//
+//export gcs_read_ranges
+func gcs_read_ranges(key string, storageBucket string,
+	paths **C.char, offsets *C.size_t, lengths *C.size_t,
+	count C.int, workers C.int,
+	buffers *unsafe.Pointer, sizes *C.size_t,
+	status *C.int) C.int {
+	ctx := getContext(key)
+	storageBucket = ownString(storageBucket)
+
+	n := int(count)
+	pathArr := (*[1 << 28]*C.char)(unsafe.Pointer(paths))[:n:n]
+	offsetArr := (*[1 << 28]C.size_t)(unsafe.Pointer(offsets))[:n:n]
+	lengthArr := (*[1 << 28]C.size_t)(unsafe.Pointer(lengths))[:n:n]
+	bufArr := (*[1 << 28]unsafe.Pointer)(unsafe.Pointer(buffers))[:n:n]
+	sizeArr := (*[1 << 28]C.size_t)(unsafe.Pointer(sizes))[:n:n]
+	statusArr := (*[1 << 28]C.int)(unsafe.Pointer(status))[:n:n]
+
+	// Copy the paths before handing them to goroutines
+	names := make([]string, n)
+	for i := 0; i < n; i++ {
+		names[i] = C.GoString(pathArr[i])
+	}
+
+	return readConcurrently(n, int(workers), names, bufArr, sizeArr, statusArr,
+		func(i int) (unsafe.Pointer, int, error) {
+			return readRange(ctx, storageBucket, names[i], int64(offsetArr[i]),
+				int64(lengthArr[i]))
+		})
+}
@@ -0,0 +1,238 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+	"golang.org/x/net/context"
+	"google.golang.org/cloud/storage"
+	"math/rand"
+	"sort"
+	"sync"
+	"time"
+	"unsafe"
+)
+
+//#include <stdlib.h>
+import "C"
+
+// How reads react to slow or failing requests. Set once from C through
+// gcs_set_read_policy before the first read.
+var readPolicy = struct {
+	sync.RWMutex
+	// Deadline for one attempt, including any hedged duplicate
+	timeout time.Duration
+	// Attempts made after the first one fails
+	retries int
+	// Latency percentile after which a duplicate request is sent; zero
+	// disables hedging
+	hedgePercentile float64
+}{
+	timeout: 30 * time.Second,
+	retries: 3,
+}
+
+const (
+	initialBackoff = 100 * time.Millisecond
+	maxBackoff     = 10 * time.Second
+
+	// Successful read latencies remembered for the hedging threshold
+	latencyWindow = 1024
+	// Samples needed before hedging kicks in
+	minLatencySamples = 64
+	// The threshold is recomputed after this many new samples
+	hedgeRefreshInterval = 64
+)
+
+var errDeadline = errors.New("read deadline exceeded")
+
+// Ring buffer of recent successful read latencies and the hedge delay derived
+// from them.
+var latencies = struct {
+	sync.Mutex
+	samples      []time.Duration
+	next         int
+	sinceRefresh int
+	hedgeDelay   time.Duration
+}{samples: make([]time.Duration, 0, latencyWindow)}
+
+var jitter = struct {
+	sync.Mutex
+	rng *rand.Rand
+}{rng: rand.New(rand.NewSource(time.Now().UnixNano()))}
+
+// Sets the deadline per attempt in milliseconds, the number of retries after a
+// failed attempt, and the latency percentile in (0, 1) after which a hedged
+// duplicate request is issued. A percentile of zero disables hedging.
+//
+//export gcs_set_read_policy
+func gcs_set_read_policy(timeoutMs C.int, retries C.int,
+	hedgePercentile C.double) {
+	readPolicy.Lock()
+	defer readPolicy.Unlock()
+	readPolicy.timeout = time.Duration(timeoutMs) * time.Millisecond
+	readPolicy.retries = int(retries)
+	readPolicy.hedgePercentile = float64(hedgePercentile)
+	// Percentiles outside the range would index past the latency samples
+	if readPolicy.hedgePercentile < 0 || readPolicy.hedgePercentile >= 1 {
+		readPolicy.hedgePercentile = 0
+	}
+}
+
+func recordLatency(d time.Duration, percentile float64) {
+	latencies.Lock()
+	defer latencies.Unlock()
+	if len(latencies.samples) < latencyWindow {
+		latencies.samples = append(latencies.samples, d)
+	} else {
+		latencies.samples[latencies.next] = d
+		latencies.next = (latencies.next + 1) % latencyWindow
+	}
+
+	latencies.sinceRefresh++
+	if percentile <= 0 || len(latencies.samples) < minLatencySamples ||
+		latencies.sinceRefresh < hedgeRefreshInterval {
+		return
+	}
+	latencies.sinceRefresh = 0
+	sorted := make([]time.Duration, len(latencies.samples))
+	copy(sorted, latencies.samples)
+	sort.Sort(durations(sorted))
+	latencies.hedgeDelay = sorted[int(percentile*float64(len(sorted)-1))]
+}
+
+// Returns zero until enough samples have been seen to pick a threshold
+func hedgeDelay() time.Duration {
+	latencies.Lock()
+	defer latencies.Unlock()
+	return latencies.hedgeDelay
+}
+
+type durations []time.Duration
+
+func (d durations) Len() int           { return len(d) }
+func (d durations) Less(i, j int) bool { return d[i] < d[j] }
+func (d durations) Swap(i, j int)      { d[i], d[j] = d[j], d[i] }
+
+func backoff(attempt int) time.Duration {
+	d := initialBackoff << uint(attempt)
+	if d > maxBackoff || d <= 0 {
+		d = maxBackoff
+	}
+	// Full jitter keeps retries from many readers from synchronizing
+	jitter.Lock()
+	defer jitter.Unlock()
+	return time.Duration(jitter.rng.Int63n(int64(d)))
+}
+
+type readResult struct {
+	buf unsafe.Pointer
+	n   int
+	err error
+}
+
+// Frees the buffers of requests that finished after a winner was chosen
+func drain(results chan readResult, outstanding int) {
+	for i := 0; i < outstanding; i++ {
+		r := <-results
+		if r.err == nil {
+			C.free(r.buf)
+		}
+	}
+}
+
+// One attempt at a read into a C-allocated buffer, such as a whole object or
+// a byte range of one
+type readFunc func(ctx context.Context) (unsafe.Pointer, int, error)
+
+// Runs one attempt under the policy deadline. If hedging is on and the first
+// request is still running after the hedge delay, a duplicate is sent and
+// whichever finishes first wins.
+func hedgedRead(ctx context.Context, read readFunc, timeout time.Duration,
+	hedge bool) (unsafe.Pointer, int, error) {
+	attemptCtx, cancel := context.WithTimeout(ctx, timeout)
+	defer cancel()
+
+	results := make(chan readResult, 2)
+	launch := func() {
+		go func() {
+			buf, n, err := read(attemptCtx)
+			results <- readResult{buf, n, err}
+		}()
+	}
+	launch()
+	outstanding := 1
+
+	var hedgeTimer <-chan time.Time
+	if delay := hedgeDelay(); hedge && delay > 0 {
+		hedgeTimer = time.After(delay)
+	}
+	deadline := time.After(timeout)
+
+	var lastErr error
+	for {
+		select {
+		case r := <-results:
+			outstanding--
+			if r.err == nil {
+				go drain(results, outstanding)
+				return r.buf, r.n, nil
+			}
+			lastErr = r.err
+			if outstanding == 0 {
+				return nil, 0, lastErr
+			}
+		case <-hedgeTimer:
+			hedgeTimer = nil
+			launch()
+			outstanding++
+		case <-deadline:
+			go drain(results, outstanding)
+			return nil, 0, errDeadline
+		}
+	}
+}
+
+// Reads the whole object into a C-allocated buffer under the read policy.
+// On success the caller owns the returned memory and must release it with
+// free().
+func readObject(ctx context.Context, storageBucket string,
+	path string) (unsafe.Pointer, int, error) {
+	return readWithPolicy(ctx, path,
+		func(ctx context.Context) (unsafe.Pointer, int, error) {
+			return readAttempt(ctx, storageBucket, path)
+		})
+}
+
+// Runs read under the read policy: every attempt has a deadline, failed
+// attempts are retried with exponential backoff and full jitter, and slow
+// attempts may be hedged. path names the object in log messages.
+func readWithPolicy(ctx context.Context, path string,
+	read readFunc) (unsafe.Pointer, int, error) {
+	readPolicy.RLock()
+	timeout := readPolicy.timeout
+	retries := readPolicy.retries
+	percentile := readPolicy.hedgePercentile
+	readPolicy.RUnlock()
+
+	var err error
+	for attempt := 0; attempt <= retries; attempt++ {
+		if attempt > 0 {
+			fmt.Printf("Retrying %s (%d of %d): %s\n",
+				path, attempt, retries, err.Error())
+			time.Sleep(backoff(attempt - 1))
+		}
+
+		start := time.Now()
+		buf, n, e := hedgedRead(ctx, read, timeout, percentile > 0)
+		if e == nil {
+			recordLatency(time.Since(start), percentile)
+			return buf, n, nil
+		}
+		err = e
+		// Missing objects will not appear by retrying
+		if err == storage.ErrObjectNotExist {
+			break
+		}
+	}
+	return nil, 0, err
+}
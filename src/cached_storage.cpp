@@ -0,0 +1,339 @@
+#include "cached_storage.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+// Eviction trims the cache to this fraction of the cap so it does not run on
+// every insert once the cache is full.
+const double low_watermark = 0.9;
+
+const char* lock_name = ".lock";
+const char* temp_suffix = ".tmp";
+
+// Temporary files untouched for this many seconds were left by inserts that
+// crashed. A live insert writes its file in one go, well within this.
+const time_t stale_temp_age = 10 * 60;
+
+uint64_t fnv1a(const std::string& str) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : str) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+struct Entry {
+  std::string path;
+  struct timespec mtime;
+  size_t size;
+};
+
+// Lists every committed entry in dir, skipping the lock and in-flight inserts
+std::vector<Entry> list_entries(const std::string& dir) {
+  std::vector<Entry> entries;
+  DIR* d = opendir(dir.c_str());
+  if (d == NULL) return entries;
+
+  struct dirent* ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (ent->d_name[0] == '.') continue;
+    if (strstr(ent->d_name, temp_suffix) != NULL) continue;
+
+    Entry entry;
+    entry.path = dir + "/" + ent->d_name;
+    struct stat st;
+    if (stat(entry.path.c_str(), &st) == -1) continue;
+    entry.mtime = st.st_mtim;
+    entry.size = st.st_size;
+    entries.push_back(entry);
+  }
+  closedir(d);
+  return entries;
+}
+
+// The lock file holds the bytes in the cache, read and written under the lock
+uint64_t read_usage(int lock_fd) {
+  uint64_t usage = 0;
+  if (pread(lock_fd, &usage, sizeof(usage), 0) != sizeof(usage)) return 0;
+  return usage;
+}
+
+void write_usage(int lock_fd, uint64_t usage) {
+  if (pwrite(lock_fd, &usage, sizeof(usage), 0) != sizeof(usage)) {
+    fprintf(stderr, "Cannot update the cache size in its lock file\n");
+  }
+}
+
+// Deletes the temporary files in dir that crashed inserts left behind
+void remove_stale_temps(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (d == NULL) return;
+
+  time_t cutoff = time(NULL) - stale_temp_age;
+  struct dirent* ent;
+  while ((ent = readdir(d)) != NULL) {
+    if (strstr(ent->d_name, temp_suffix) == NULL) continue;
+
+    std::string path = dir + "/" + ent->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1) continue;
+    if (st.st_mtime < cutoff) unlink(path.c_str());
+  }
+  closedir(d);
+}
+
+}
+
+CachedStorage::CachedStorage(const std::string& name, Storage* inner,
+                             const std::string& dir, size_t max_size)
+  : name_(name), inner_(inner), dir_(dir), max_size_(max_size) {
+  mkdir(dir_.c_str(), 0777);
+
+  // The count may be missing or stale if the directory was changed by hand
+  int lock_fd = lock_directory();
+  if (lock_fd == -1) return;
+  rescan(lock_fd);
+  close(lock_fd);
+}
+
+CachedStorage::~CachedStorage() {
+  delete inner_;
+}
+
+std::string CachedStorage::entry_path(const std::string& path) const {
+  char name[17];
+  snprintf(name, sizeof(name), "%016lx",
+           (unsigned long)fnv1a(name_ + "/" + path));
+  return dir_ + "/" + name;
+}
+
+char* CachedStorage::lookup(const std::string& path, size_t* size) {
+  std::string entry = entry_path(path);
+  char* data = files_.read(entry, size);
+  if (data != nullptr) {
+    // Mark as recently used; eviction orders entries by mtime
+    utimensat(AT_FDCWD, entry.c_str(), NULL, 0);
+  }
+  return data;
+}
+
+char* CachedStorage::lookup_range(const std::string& path,
+                                  size_t offset,
+                                  size_t length,
+                                  size_t* size) {
+  std::string entry = entry_path(path);
+  char* data = files_.read_range(entry, offset, length, size);
+  if (data != nullptr) {
+    utimensat(AT_FDCWD, entry.c_str(), NULL, 0);
+  }
+  return data;
+}
+
+void CachedStorage::insert(const std::string& path,
+                           const char* data,
+                           size_t size) {
+  std::string entry = entry_path(path);
+
+  // Unique per process and thread so concurrent inserts of the same object
+  // never write the same temporary file
+  std::stringstream temp;
+  temp << entry << temp_suffix << "." << getpid() << "."
+       << std::hash<std::thread::id>()(std::this_thread::get_id());
+
+  int fd = open(temp.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) return;
+
+  size_t total = 0;
+  while (total < size) {
+    ssize_t num_written = ::write(fd, data + total, size - total);
+    if (num_written <= 0) break;
+    total += num_written;
+  }
+  close(fd);
+
+  // Committing the entry and counting it happen under the lock, so every
+  // process sees the same count
+  int lock_fd = total == size ? lock_directory() : -1;
+  if (lock_fd == -1) {
+    unlink(temp.str().c_str());
+    return;
+  }
+
+  // An entry can be replaced by another process's insert of the same object
+  struct stat st;
+  uint64_t replaced = stat(entry.c_str(), &st) == 0 ? st.st_size : 0;
+  if (rename(temp.str().c_str(), entry.c_str()) == -1) {
+    unlink(temp.str().c_str());
+  } else {
+    uint64_t usage = read_usage(lock_fd);
+    usage = usage > replaced ? usage - replaced : 0;
+    usage += size;
+    if (usage > max_size_) {
+      rescan(lock_fd);
+    } else {
+      write_usage(lock_fd, usage);
+    }
+  }
+  close(lock_fd);
+}
+
+int CachedStorage::lock_directory() {
+  std::string lock_path = dir_ + "/" + lock_name;
+  int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+  if (lock_fd == -1) return -1;
+  if (flock(lock_fd, LOCK_EX) == -1) {
+    close(lock_fd);
+    return -1;
+  }
+  return lock_fd;
+}
+
+void CachedStorage::rescan(int lock_fd) {
+  remove_stale_temps(dir_);
+  std::vector<Entry> entries = list_entries(dir_);
+  uint64_t total = 0;
+  for (const Entry& entry : entries) {
+    total += entry.size;
+  }
+
+  if (total > max_size_) {
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) {
+                if (a.mtime.tv_sec != b.mtime.tv_sec)
+                  return a.mtime.tv_sec < b.mtime.tv_sec;
+                return a.mtime.tv_nsec < b.mtime.tv_nsec;
+              });
+
+    uint64_t target = max_size_ * low_watermark;
+    for (const Entry& entry : entries) {
+      if (total <= target) break;
+      if (unlink(entry.path.c_str()) == 0) {
+        total -= entry.size;
+      }
+    }
+  }
+  write_usage(lock_fd, total);
+}
+
+char* CachedStorage::read(const std::string& path, size_t* size) {
+  char* data = lookup(path, size);
+  if (data != nullptr) return data;
+
+  data = inner_->read(path, size);
+  if (data != nullptr) {
+    insert(path, data, *size);
+  }
+  return data;
+}
+
+char* CachedStorage::read_range(const std::string& path,
+                                size_t offset,
+                                size_t length,
+                                size_t* size) {
+  char* data = lookup_range(path, offset, length, size);
+  if (data != nullptr) return data;
+  return inner_->read_range(path, offset, length, size);
+}
+
+int CachedStorage::read_many(const std::vector<std::string>& paths,
+                             std::vector<char*>& buffers,
+                             std::vector<size_t>& sizes) {
+  buffers.assign(paths.size(), nullptr);
+  sizes.assign(paths.size(), 0);
+
+  // Serve hits locally and send only the misses to the wrapped backend
+  std::vector<size_t> misses;
+  std::vector<std::string> miss_paths;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    buffers[i] = lookup(paths[i], &sizes[i]);
+    if (buffers[i] == nullptr) {
+      misses.push_back(i);
+      miss_paths.push_back(paths[i]);
+    }
+  }
+  if (misses.empty()) return 0;
+
+  std::vector<char*> miss_buffers;
+  std::vector<size_t> miss_sizes;
+  int failed = inner_->read_many(miss_paths, miss_buffers, miss_sizes);
+
+  for (size_t j = 0; j < misses.size(); ++j) {
+    buffers[misses[j]] = miss_buffers[j];
+    sizes[misses[j]] = miss_sizes[j];
+    if (miss_buffers[j] != nullptr) {
+      insert(miss_paths[j], miss_buffers[j], miss_sizes[j]);
+    }
+  }
+  return failed;
+}
+
+int CachedStorage::read_ranges(const std::vector<std::string>& paths,
+                               const std::vector<size_t>& offsets,
+                               const std::vector<size_t>& lengths,
+                               std::vector<char*>& buffers,
+                               std::vector<size_t>& sizes) {
+  buffers.assign(paths.size(), nullptr);
+  sizes.assign(paths.size(), 0);
+
+  std::vector<size_t> misses;
+  std::vector<std::string> miss_paths;
+  std::vector<size_t> miss_offsets;
+  std::vector<size_t> miss_lengths;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    buffers[i] = lookup_range(paths[i], offsets[i], lengths[i], &sizes[i]);
+    if (buffers[i] == nullptr) {
+      misses.push_back(i);
+      miss_paths.push_back(paths[i]);
+      miss_offsets.push_back(offsets[i]);
+      miss_lengths.push_back(lengths[i]);
+    }
+  }
+  if (misses.empty()) return 0;
+
+  std::vector<char*> miss_buffers;
+  std::vector<size_t> miss_sizes;
+  int failed = inner_->read_ranges(miss_paths, miss_offsets, miss_lengths,
+                                   miss_buffers, miss_sizes);
+
+  for (size_t j = 0; j < misses.size(); ++j) {
+    buffers[misses[j]] = miss_buffers[j];
+    sizes[misses[j]] = miss_sizes[j];
+  }
+  return failed;
+}
+
+FILE* CachedStorage::write(const std::string& path) {
+  // The cached copy is stale as soon as the object is rewritten
+  unlink(entry_path(path).c_str());
+  return inner_->write(path);
+}
+
+void CachedStorage::close_write(FILE* fp, const std::string& path) {
+  inner_->close_write(fp, path);
+}
+
+void CachedStorage::write_buffer(const std::string& path,
+                                 const char* data,
+                                 size_t size) {
+  unlink(entry_path(path).c_str());
+  inner_->write_buffer(path, data, size);
+}
+
+bool CachedStorage::exists(const std::string& path) {
+  return access(entry_path(path).c_str(), F_OK) == 0 || inner_->exists(path);
+}
@@ -0,0 +1,89 @@
+#ifndef CACHED_STORAGE_H_
+#define CACHED_STORAGE_H_
+
+#include "storage.h"
+
+#include <string>
+#include <vector>
+
+// Keeps a copy of every object read through the wrapped backend in a local
+// directory. Entries are named by a hash of the backend name and object path.
+// Inserts go through a temporary file and rename() so processes sharing the
+// directory never see partial objects. Hits refresh the entry's mtime. The
+// bytes in the cache are counted in the directory's lock file, which every
+// process sharing the directory updates under the lock, so the cap holds
+// across processes. Once an insert takes the cache past the cap, the least
+// recently used entries are evicted.
+class CachedStorage : public Storage {
+public:
+  // name identifies the wrapped backend (e.g. "gs://bucket") in cache keys.
+  // Takes ownership of inner.
+  CachedStorage(const std::string& name, Storage* inner,
+                const std::string& dir, size_t max_size);
+
+  ~CachedStorage();
+
+  char* read(const std::string& path, size_t* size) override;
+
+  // Served from the cached copy of the whole object if there is one. Ranges
+  // themselves are not cached.
+  char* read_range(const std::string& path,
+                   size_t offset,
+                   size_t length,
+                   size_t* size) override;
+
+  int read_many(const std::vector<std::string>& paths,
+                std::vector<char*>& buffers,
+                std::vector<size_t>& sizes) override;
+
+  // Ranges of cached objects are served locally and the rest are read from
+  // the wrapped backend in one batch
+  int read_ranges(const std::vector<std::string>& paths,
+                  const std::vector<size_t>& offsets,
+                  const std::vector<size_t>& lengths,
+                  std::vector<char*>& buffers,
+                  std::vector<size_t>& sizes) override;
+
+  FILE* write(const std::string& path) override;
+
+  void close_write(FILE* fp, const std::string& path) override;
+
+  void write_buffer(const std::string& path,
+                    const char* data,
+                    size_t size) override;
+
+  bool exists(const std::string& path) override;
+
+private:
+  std::string entry_path(const std::string& path) const;
+
+  // Returns the cached copy of path, or NULL on a miss
+  char* lookup(const std::string& path, size_t* size);
+
+  // Returns the range of the cached copy of path, or NULL on a miss
+  char* lookup_range(const std::string& path,
+                     size_t offset,
+                     size_t length,
+                     size_t* size);
+
+  void insert(const std::string& path, const char* data, size_t size);
+
+  // Opens the lock file and locks it exclusively. Returns the descriptor, or
+  // -1 if the lock file cannot be opened.
+  int lock_directory();
+
+  // Recounts the bytes in the cache and stores the count in the lock file,
+  // held through lock_fd. If the cache is over its cap, least recently used
+  // entries are deleted until it is below its low watermark. Temporary files
+  // left by crashed inserts are deleted too.
+  void rescan(int lock_fd);
+
+  std::string name_;
+  Storage* inner_;
+  std::string dir_;
+  size_t max_size_;
+
+  FileStorage files_;
+};
+
+#endif // CACHED_STORAGE_H_
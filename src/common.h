@@ -3,6 +3,10 @@
 
 const int VEC_DIM = 9216;
 
+// Images per load and feature task. The load task reports which images it
+// managed to read as a bitmask, so a batch cannot be wider than 32.
+const int BATCH_SIZE = 32;
+
 struct Frame {
   Frame()
   : width(0), height(0), channels(0), element_size(0), data(nullptr) {}
@@ -58,10 +58,12 @@ shared_ptr<Net<float>> init_neural_net(Frame mean, int batch_size) {
   return feature_extraction_net;
 }
 
-void map_pool5_features(std::vector<Frame> frames, char* features_ptr) {
+void map_pool5_features(std::vector<Frame> frames, char* features_ptr,
+                        FeatureType type) {
   Frame mean(256, 256, 3, sizeof(float));
 
   int num_images = frames.size();
+  size_t row_size = feature_row_size(type, VEC_DIM);
 
   int BATCH_SIZE = 16;
   shared_ptr<Net<float> > feature_extraction_net =
@@ -102,9 +104,10 @@ void map_pool5_features(std::vector<Frame> frames, char* features_ptr) {
     const shared_ptr<Blob<float>> features_data =
       feature_extraction_net->blob_by_name("pool5");
 
-    memcpy(features_ptr + i * VEC_DIM,
-           features_data->cpu_data(),
-           sizeof(float) * VEC_DIM * BATCH_SIZE);
+    // Converted to the output type straight from the blob, so full precision
+    // vectors never leave the network's own buffer
+    encode_features(type, VEC_DIM, features_data->cpu_data(), current_batch,
+                    features_ptr + i * row_size);
   }
 
   delete[] mean.data;
@@ -2,10 +2,14 @@
 #define COMPUTE_FEATURES_H_
 
 #include "common.h"
+#include "feature_precision.h"
 
 #include <vector>
 #include <string>
 
-void map_pool5_features(std::vector<Frame> image_ptr, char* feature_ptr);
+// Runs the network on every frame and writes each pool5 vector to
+// feature_ptr as one row of type, feature_row_size(type, VEC_DIM) bytes apart
+void map_pool5_features(std::vector<Frame> image_ptr, char* feature_ptr,
+                        FeatureType type);
 
 #endif // COMPUTE_FEATURES_H_
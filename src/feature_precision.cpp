@@ -0,0 +1,302 @@
+#include "feature_precision.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Independent partial sums per lane, so float reductions vectorize without
+// reassociating adds
+const int lanes = 8;
+
+// Half rows are widened into stack buffers of this many elements
+const int widen_block = 256;
+
+// int32 sums of squared bytes over this many elements cannot overflow
+const int int8_block = 1 << 16;
+
+size_t round_up4(size_t bytes) {
+  return (bytes + 3) / 4 * 4;
+}
+
+union FloatBits {
+  float f;
+  uint32_t u;
+};
+
+// Rounds to nearest even. Values beyond the half range become infinity and
+// NaNs stay NaN.
+uint16_t float_to_half(float value) {
+  FloatBits f;
+  f.f = value;
+  uint32_t sign = f.u & 0x80000000u;
+  f.u ^= sign;
+
+  uint16_t half;
+  if (f.u >= 0x47800000u) {
+    half = f.u > 0x7f800000u ? 0x7e00 : 0x7c00;
+  } else if (f.u < 0x38800000u) {
+    // Half subnormal or zero: adding the magic value shifts the mantissa
+    // into place with the FPU's rounding
+    FloatBits magic;
+    magic.u = ((127 - 15) + (23 - 10) + 1) << 23;
+    f.f += magic.f;
+    half = f.u - magic.u;
+  } else {
+    uint32_t mantissa_odd = (f.u >> 13) & 1;
+    f.u += ((uint32_t)(15 - 127) << 23) + 0xfff;
+    f.u += mantissa_odd;
+    half = f.u >> 13;
+  }
+  return half | (sign >> 16);
+}
+
+// Scaling the shifted bits by 2^112 rebiases the exponent and normalizes
+// subnormals in one multiply, which keeps loops over this vectorizable
+float half_to_float(uint16_t half) {
+  FloatBits magic;
+  magic.u = (254 - 15) << 23;
+  FloatBits infinity_or_nan;
+  infinity_or_nan.u = (127 + 16) << 23;
+
+  FloatBits f;
+  f.u = (uint32_t)(half & 0x7fff) << 13;
+  f.f *= magic.f;
+  f.u |= f.f >= infinity_or_nan.f ? 255u << 23 : 0;
+  f.u |= (uint32_t)(half & 0x8000) << 16;
+  return f.f;
+}
+
+void narrow_halves(const float* in, int count, uint16_t* out) {
+  int i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= count; i += 8) {
+    __m128i halves =
+      _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*)(out + i), halves);
+  }
+#endif
+  for (; i < count; ++i) {
+    out[i] = float_to_half(in[i]);
+  }
+}
+
+void widen_halves(const uint16_t* in, int count, float* out) {
+  int i = 0;
+#ifdef __F16C__
+  for (; i + 8 <= count; i += 8) {
+    __m128i halves = _mm_loadu_si128((const __m128i*)(in + i));
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(halves));
+  }
+#endif
+  for (; i < count; ++i) {
+    out[i] = half_to_float(in[i]);
+  }
+}
+
+float float_distance(const float* a, const float* b, int dim) {
+  float sums[lanes] = {0};
+  int i = 0;
+  for (; i + lanes <= dim; i += lanes) {
+    for (int j = 0; j < lanes; ++j) {
+      float d = a[i + j] - b[i + j];
+      sums[j] += d * d;
+    }
+  }
+  float sum = 0;
+  for (; i < dim; ++i) {
+    float d = a[i] - b[i];
+    sum += d * d;
+  }
+  for (int j = 0; j < lanes; ++j) {
+    sum += sums[j];
+  }
+  return sum;
+}
+
+float half_distance(const uint16_t* a, const uint16_t* b, int dim) {
+  float wide_a[widen_block];
+  float wide_b[widen_block];
+  float sum = 0;
+  for (int i = 0; i < dim; i += widen_block) {
+    int count = std::min(widen_block, dim - i);
+    widen_halves(a + i, count, wide_a);
+    widen_halves(b + i, count, wide_b);
+    sum += float_distance(wide_a, wide_b, count);
+  }
+  return sum;
+}
+
+// Head of an int8 row, followed by the row's bytes
+struct Int8Row {
+  float scale;
+  // Squared length of the dequantized row
+  float norm;
+};
+
+// Sum of a[i] * b[i], widened to int32 in blocks that cannot overflow
+int64_t int8_dot(const int8_t* a, const int8_t* b, int dim) {
+  int64_t sum = 0;
+  for (int i = 0; i < dim; i += int8_block) {
+    int end = std::min(dim, i + int8_block);
+    int32_t block_sum = 0;
+    for (int j = i; j < end; ++j) {
+      block_sum += (int32_t)a[j] * (int32_t)b[j];
+    }
+    sum += block_sum;
+  }
+  return sum;
+}
+
+// |a - b|^2 = |a|^2 + |b|^2 - 2 a.b, with the norms stored in the rows, so
+// a distance is a single integer dot product
+float int8_distance(const char* a, const char* b, int dim) {
+  Int8Row head_a;
+  Int8Row head_b;
+  memcpy(&head_a, a, sizeof(Int8Row));
+  memcpy(&head_b, b, sizeof(Int8Row));
+  int64_t dot = int8_dot((const int8_t*)(a + sizeof(Int8Row)),
+                         (const int8_t*)(b + sizeof(Int8Row)), dim);
+
+  double distance = (double)head_a.norm + head_b.norm -
+    2.0 * head_a.scale * head_b.scale * dot;
+  return distance > 0 ? (float)distance : 0.0f;
+}
+
+void encode_int8(int dim, const float* in, char* out) {
+  float largest = 0;
+  for (int i = 0; i < dim; ++i) {
+    largest = std::max(largest, std::fabs(in[i]));
+  }
+  float inverse = largest > 0 ? 127 / largest : 0;
+
+  int8_t* q = (int8_t*)(out + sizeof(Int8Row));
+  for (int i = 0; i < dim; ++i) {
+    long value = lrintf(in[i] * inverse);
+    q[i] = (int8_t)std::max(-127L, std::min(127L, value));
+  }
+
+  Int8Row head;
+  head.scale = largest / 127;
+  head.norm = (double)head.scale * head.scale * int8_dot(q, q, dim);
+  memcpy(out, &head, sizeof(Int8Row));
+}
+
+}
+
+bool parse_feature_type(const char* name, FeatureType* type) {
+  if (!strcmp(name, "fp32")) {
+    *type = FEATURE_FLOAT32;
+  } else if (!strcmp(name, "fp16")) {
+    *type = FEATURE_FLOAT16;
+  } else if (!strcmp(name, "int8")) {
+    *type = FEATURE_INT8;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* feature_type_name(FeatureType type) {
+  switch (type) {
+  case FEATURE_FLOAT32: return "fp32";
+  case FEATURE_FLOAT16: return "fp16";
+  case FEATURE_INT8: return "int8";
+  }
+  return "unknown";
+}
+
+size_t feature_row_size(FeatureType type, int dim) {
+  switch (type) {
+  case FEATURE_FLOAT32: return dim * sizeof(float);
+  case FEATURE_FLOAT16: return round_up4(dim * sizeof(uint16_t));
+  case FEATURE_INT8: return sizeof(Int8Row) + round_up4(dim);
+  }
+  return 0;
+}
+
+void encode_features(FeatureType type, int dim, const float* in, size_t count,
+                     char* out) {
+  size_t row_size = feature_row_size(type, dim);
+  for (size_t i = 0; i < count; ++i, in += dim, out += row_size) {
+    switch (type) {
+    case FEATURE_FLOAT32:
+      memcpy(out, in, row_size);
+      break;
+    case FEATURE_FLOAT16:
+      memset(out, 0, row_size);
+      narrow_halves(in, dim, (uint16_t*)out);
+      break;
+    case FEATURE_INT8:
+      memset(out, 0, row_size);
+      encode_int8(dim, in, out);
+      break;
+    }
+  }
+}
+
+void decode_feature(FeatureType type, int dim, const char* row, float* out) {
+  switch (type) {
+  case FEATURE_FLOAT32:
+    memcpy(out, row, dim * sizeof(float));
+    break;
+  case FEATURE_FLOAT16:
+    widen_halves((const uint16_t*)row, dim, out);
+    break;
+  case FEATURE_INT8: {
+    Int8Row head;
+    memcpy(&head, row, sizeof(Int8Row));
+    const int8_t* q = (const int8_t*)(row + sizeof(Int8Row));
+    for (int i = 0; i < dim; ++i) {
+      out[i] = head.scale * q[i];
+    }
+    break;
+  }
+  }
+}
+
+float feature_distance(FeatureType type, int dim, const char* a,
+                       const char* b) {
+  switch (type) {
+  case FEATURE_FLOAT32:
+    return float_distance((const float*)a, (const float*)b, dim);
+  case FEATURE_FLOAT16:
+    return half_distance((const uint16_t*)a, (const uint16_t*)b, dim);
+  case FEATURE_INT8:
+    return int8_distance(a, b, dim);
+  }
+  return 0;
+}
+
+void nearest_rows(FeatureType type, int dim, const char* rows, size_t count,
+                  size_t query, int k, float* distances, int* indices) {
+  for (int j = 0; j < k; ++j) {
+    distances[j] = std::numeric_limits<float>::infinity();
+    indices[j] = -1;
+  }
+  if (k <= 0) return;
+
+  size_t row_size = feature_row_size(type, dim);
+  const char* query_row = rows + query * row_size;
+  for (size_t i = 0; i < count; ++i) {
+    if (i == query) continue;
+    float distance =
+      feature_distance(type, dim, query_row, rows + i * row_size);
+    if (!(distance < distances[k - 1])) continue;
+    // Insertion into the sorted list; k is small
+    int j = k - 1;
+    for (; j > 0 && distances[j - 1] > distance; --j) {
+      distances[j] = distances[j - 1];
+      indices[j] = indices[j - 1];
+    }
+    distances[j] = distance;
+    indices[j] = i;
+  }
+}
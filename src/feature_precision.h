@@ -0,0 +1,51 @@
+#ifndef FEATURE_PRECISION_H_
+#define FEATURE_PRECISION_H_
+
+#include <cstddef>
+
+// Element types feature vectors are kept in, in the vector regions and the
+// feature store. The network produces floats; narrower types are converted
+// as its output is copied out and read by KNN without widening whole rows.
+// The values are stored in feature segment headers, so existing ones must
+// not change.
+enum FeatureType {
+  // dim floats
+  FEATURE_FLOAT32,
+  // dim IEEE half floats, rounded to nearest even
+  FEATURE_FLOAT16,
+  // A float scale and the row's squared length, then dim signed bytes;
+  // element i is scale * q[i]. The scale maps the row's largest magnitude to
+  // 127.
+  FEATURE_INT8,
+};
+
+// Maps "fp32", "fp16" and "int8" to a type. Returns false for any other
+// name.
+bool parse_feature_type(const char* name, FeatureType* type);
+
+const char* feature_type_name(FeatureType type);
+
+// Bytes one row of dim elements takes, a multiple of four so rows stay
+// float aligned when packed back to back
+size_t feature_row_size(FeatureType type, int dim);
+
+// Converts count vectors of dim floats to rows of type, written
+// feature_row_size apart to out
+void encode_features(FeatureType type, int dim, const float* in, size_t count,
+                     char* out);
+
+// Widens one row of type back to dim floats
+void decode_feature(FeatureType type, int dim, const char* row, float* out);
+
+// Squared Euclidean distance between two rows of type. Half rows are widened
+// a block at a time and int8 rows are compared with one integer dot product.
+float feature_distance(FeatureType type, int dim, const char* a,
+                       const char* b);
+
+// Finds the k rows of rows[0, count) nearest to row query, other than query
+// itself, nearest first. Slots left over when count <= k get an infinite
+// distance and index -1.
+void nearest_rows(FeatureType type, int dim, const char* rows, size_t count,
+                  size_t query, int k, float* distances, int* indices);
+
+#endif // FEATURE_PRECISION_H_
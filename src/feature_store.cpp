@@ -0,0 +1,300 @@
+#include "feature_store.h"
+#include "storage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const std::string segment_suffix = ".seg";
+const std::string file_prefix = "file://";
+
+size_t align_up(size_t offset) {
+  return (offset + feature_matrix_alignment - 1) /
+    feature_matrix_alignment * feature_matrix_alignment;
+}
+
+// Filesystem directory of a file:// store, or empty for other schemes
+std::string store_directory(const std::string& store_uri) {
+  if (store_uri.compare(0, file_prefix.size(), file_prefix) != 0) return "";
+  return store_uri.substr(file_prefix.size());
+}
+
+// Size of an index record in segments of the given version
+size_t index_record_size(uint32_t version) {
+  return version == 1 ? 24 : sizeof(FeatureIndexRecord);
+}
+
+bool ends_with(const std::string& s, const std::string& suffix) {
+  return s.size() >= suffix.size() &&
+    s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}
+
+int FeatureSegmentWriter::add(const std::string& path,
+                              uint64_t hash,
+                              const char* row,
+                              int dup_of) {
+  FeatureIndexRecord record;
+  record.path_offset = paths_.size();
+  record.path_length = path.size();
+  record.row = -1;
+  record.hash = hash;
+  record.dup_of = dup_of;
+  record.reserved = 0;
+  if (row) {
+    record.row = matrix_.size() / row_size_;
+    matrix_.insert(matrix_.end(), row, row + row_size_);
+  }
+  records_.push_back(record);
+  paths_ += path;
+  return records_.size() - 1;
+}
+
+std::string FeatureSegmentWriter::name() const {
+  // FNV-1a over the paths, which are unique to the batch
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : paths_) {
+    hash ^= (unsigned char)c;
+    hash *= 1099511628211ULL;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+  return name + segment_suffix;
+}
+
+std::vector<char> FeatureSegmentWriter::finish() const {
+  FeatureSegmentHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, feature_store_magic, sizeof(feature_store_magic));
+  header.version = feature_store_version;
+  header.type = type_;
+  header.dim = dim_;
+  header.run = run_;
+  header.rows = matrix_.size() / row_size_;
+  header.entries = records_.size();
+  header.matrix_offset = align_up(sizeof(header));
+  header.index_offset = header.matrix_offset + matrix_.size();
+  header.paths_offset =
+    header.index_offset + records_.size() * sizeof(FeatureIndexRecord);
+
+  std::vector<char> data(header.paths_offset + paths_.size(), 0);
+  memcpy(data.data(), &header, sizeof(header));
+  memcpy(data.data() + header.matrix_offset, matrix_.data(), matrix_.size());
+  memcpy(data.data() + header.index_offset, records_.data(),
+         records_.size() * sizeof(FeatureIndexRecord));
+  memcpy(data.data() + header.paths_offset, paths_.data(), paths_.size());
+  return data;
+}
+
+uint32_t new_feature_run() {
+  std::random_device random;
+  uint32_t run = 0;
+  while (run == 0) {
+    run = random();
+  }
+  return run;
+}
+
+void prepare_feature_store(const std::string& store_uri) {
+  std::string directory = store_directory(store_uri);
+  if (directory.empty()) return;
+  if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Cannot create feature store %s\n", directory.c_str());
+    exit(1);
+  }
+}
+
+bool write_feature_segment(const std::string& store_uri,
+                           const FeatureSegmentWriter& segment) {
+  std::vector<char> data = segment.finish();
+  try {
+    write_object_buffer(store_uri + "/" + segment.name(), data.data(),
+                        data.size());
+  } catch (const std::runtime_error& e) {
+    fprintf(stderr, "Cannot write feature segment: %s\n", e.what());
+    return false;
+  }
+  return true;
+}
+
+FeatureStore::FeatureStore(const std::string& store_uri, FeatureType type,
+                           int dim, uint32_t skip_run)
+  : row_size_(feature_row_size(type, dim)), rows_(0) {
+  std::string directory = store_directory(store_uri);
+  DIR* dir = directory.empty() ? NULL : opendir(directory.c_str());
+  if (dir == NULL) {
+    fprintf(stderr, "Cannot open feature store %s\n", store_uri.c_str());
+    exit(1);
+  }
+
+  // Modification time and path of each segment, so records can be read
+  // newest first
+  std::vector<std::pair<struct timespec, std::string>> paths;
+  while (struct dirent* item = readdir(dir)) {
+    std::string name = item->d_name;
+    if (!ends_with(name, segment_suffix)) continue;
+    std::string path = directory + "/" + name;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(FeatureSegmentHeader)) {
+      fprintf(stderr, "Cannot read feature segment %s\n", path.c_str());
+      exit(1);
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Cannot map feature segment %s\n", path.c_str());
+      exit(1);
+    }
+
+    Segment segment;
+    segment.data = (const char*)data;
+    segment.size = st.st_size;
+    segment.header = (const FeatureSegmentHeader*)data;
+    segment.live_rows = 0;
+    const FeatureSegmentHeader& header = *segment.header;
+    if (memcmp(header.magic, feature_store_magic,
+               sizeof(feature_store_magic)) != 0 ||
+        header.version < 1 || header.version > feature_store_version ||
+        header.dim != (uint32_t)dim ||
+        (header.type == (uint32_t)type &&
+         header.matrix_offset + header.rows * row_size_ > segment.size) ||
+        header.index_offset +
+          header.entries * index_record_size(header.version) > segment.size ||
+        header.paths_offset > segment.size) {
+      fprintf(stderr, "%s is not a feature segment of this pipeline\n",
+              path.c_str());
+      exit(1);
+    }
+    if (header.type != (uint32_t)type) {
+      fprintf(stderr, "%s holds %s vectors, not %s; use -feature-precision "
+              "%s or another store\n", path.c_str(),
+              feature_type_name((FeatureType)header.type),
+              feature_type_name(type),
+              feature_type_name((FeatureType)header.type));
+      exit(1);
+    }
+    if (skip_run != 0 && header.run == skip_run) {
+      munmap(data, st.st_size);
+      continue;
+    }
+    segments_.push_back(segment);
+    paths.push_back(std::make_pair(st.st_mtim, path));
+  }
+  closedir(dir);
+
+  std::vector<size_t> order(segments_.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&paths](size_t a, size_t b) {
+    const struct timespec& ta = paths[a].first;
+    const struct timespec& tb = paths[b].first;
+    if (ta.tv_sec != tb.tv_sec) return ta.tv_sec > tb.tv_sec;
+    if (ta.tv_nsec != tb.tv_nsec) return ta.tv_nsec > tb.tv_nsec;
+    return paths[a].second > paths[b].second;
+  });
+
+  // A rerun that batched frames differently writes segments under other
+  // names, so a frame can have records in several segments. The newest
+  // record wins and the rows of the others are left out.
+  std::unordered_set<std::string> recorded;
+  for (size_t s : order) {
+    Segment& segment = segments_[s];
+    const std::string& path = paths[s].second;
+    const FeatureSegmentHeader& header = *segment.header;
+    size_t record_size = index_record_size(header.version);
+    std::vector<FeatureIndexRecord> records(header.entries);
+    for (uint64_t i = 0; i < header.entries; ++i) {
+      records[i].dup_of = -1;
+      memcpy(&records[i], segment.data + header.index_offset + i * record_size,
+             record_size);
+    }
+    const char* path_data = segment.data + header.paths_offset;
+    size_t paths_size = segment.size - header.paths_offset;
+    for (uint64_t i = 0; i < header.entries; ++i) {
+      if (records[i].path_offset > paths_size ||
+          records[i].path_length > paths_size - records[i].path_offset ||
+          (records[i].row >= 0 && (uint64_t)records[i].row >= header.rows) ||
+          (records[i].dup_of >= 0 &&
+           (uint64_t)records[i].dup_of >= header.entries)) {
+        fprintf(stderr, "Feature segment %s is corrupt\n", path.c_str());
+        exit(1);
+      }
+      std::string frame_path(path_data + records[i].path_offset,
+                             records[i].path_length);
+      if (records[i].hash != 0) {
+        hashes_.insert(records[i].hash);
+      } else {
+        paths_.insert(frame_path);
+      }
+      if (!recorded.insert(frame_path).second) continue;
+      if (records[i].row >= 0) segment.rows.push_back(records[i].row);
+      if (records[i].dup_of >= 0) {
+        const FeatureIndexRecord& kept = records[records[i].dup_of];
+        if (kept.path_offset > paths_size ||
+            kept.path_length > paths_size - kept.path_offset) {
+          fprintf(stderr, "Feature segment %s is corrupt\n", path.c_str());
+          exit(1);
+        }
+        duplicates_[frame_path] =
+          std::string(path_data + kept.path_offset, kept.path_length);
+      }
+    }
+    segment.live_rows = segment.rows.size();
+    std::sort(segment.rows.begin(), segment.rows.end());
+    // Segments with no superseded rows are copied as one block
+    if (segment.live_rows == header.rows) segment.rows.clear();
+    rows_ += segment.live_rows;
+  }
+}
+
+FeatureStore::~FeatureStore() {
+  for (const Segment& segment : segments_) {
+    munmap((void*)segment.data, segment.size);
+  }
+}
+
+bool FeatureStore::contains(const std::string& path, uint64_t hash) const {
+  if (hash != 0) return hashes_.count(hash) > 0;
+  return paths_.count(path) > 0;
+}
+
+bool FeatureStore::duplicate_of(const std::string& path,
+                                std::string* kept) const {
+  auto it = duplicates_.find(path);
+  if (it == duplicates_.end()) return false;
+  *kept = it->second;
+  return true;
+}
+
+void FeatureStore::copy_rows(char* out) const {
+  for (const Segment& segment : segments_) {
+    const char* matrix = segment.data + segment.header->matrix_offset;
+    if (segment.live_rows == segment.header->rows) {
+      size_t bytes = segment.live_rows * row_size_;
+      memcpy(out, matrix, bytes);
+      out += bytes;
+      continue;
+    }
+    for (uint64_t row : segment.rows) {
+      memcpy(out, matrix + row * row_size_, row_size_);
+      out += row_size_;
+    }
+  }
+}
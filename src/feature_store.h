@@ -0,0 +1,160 @@
+#ifndef FEATURE_STORE_H_
+#define FEATURE_STORE_H_
+
+#include "feature_precision.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// A feature store keeps the pool5 vectors of a run so later runs can use
+// them without running the network again. It is a directory of segment
+// objects, each written by one feature task for one batch and named after
+// the paths in it, so a retried batch overwrites its own segment. Layout of
+// a segment, little endian:
+//
+//   FeatureSegmentHeader           magic, version, element type, sizes
+//   matrix                         rows of dim elements of the header's
+//                                  FeatureType, at matrix_offset
+//   FeatureIndexRecord[entries]    one per frame of the batch, at index_offset
+//   path data                      the entries' paths back to back
+//
+// Frames the filters dropped have an index record but no row, so they are
+// known to the store without costing a vector. A frame dropped as a
+// near-duplicate also names the record of the kept frame it duplicates.
+// Version 1 segments have no dup_of field; their records are 24 bytes.
+
+const char feature_store_magic[8] = {'V', 'D', 'B', 'F', 'E', 'A', 'T', 'S'};
+const uint32_t feature_store_version = 2;
+
+// Rows start on this boundary so mapped matrices can be read with aligned
+// vector loads
+const size_t feature_matrix_alignment = 64;
+
+struct FeatureSegmentHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t type;
+  uint32_t dim;
+  // Run that wrote the segment, or zero if none was given
+  uint32_t run;
+  uint64_t rows;
+  uint64_t entries;
+  uint64_t matrix_offset;
+  uint64_t index_offset;
+  uint64_t paths_offset;
+};
+
+struct FeatureIndexRecord {
+  // Offset of the path from the start of the path data
+  uint64_t path_offset;
+  uint32_t path_length;
+  // Row of the frame's vector in the segment, or -1 if it was filtered out
+  int32_t row;
+  // Content hash from the manifest, or zero if it did not list one
+  uint64_t hash;
+  // Record of the kept frame this one was dropped as a near-duplicate of,
+  // or -1
+  int32_t dup_of;
+  uint32_t reserved;
+};
+
+// Builds one segment in memory
+class FeatureSegmentWriter {
+public:
+  // run is stored in the segment's header, see new_feature_run
+  FeatureSegmentWriter(FeatureType type, int dim, uint32_t run)
+    : type_(type), dim_(dim), row_size_(feature_row_size(type, dim)),
+      run_(run) {}
+
+  // Records a frame and returns the index of its record. row is one row of
+  // the writer's type, or NULL for a frame that was filtered out. dup_of is
+  // the record of the kept frame a near-duplicate was dropped for, or -1.
+  int add(const std::string& path, uint64_t hash, const char* row,
+          int dup_of);
+
+  // Object name of the segment, derived from the paths added to it
+  std::string name() const;
+
+  std::vector<char> finish() const;
+
+private:
+  FeatureType type_;
+  int dim_;
+  size_t row_size_;
+  uint32_t run_;
+  std::vector<FeatureIndexRecord> records_;
+  std::vector<char> matrix_;
+  std::string paths_;
+};
+
+// Returns a random, nonzero id for the segments a run writes, so the run can
+// leave its own segments out when it opens the store
+uint32_t new_feature_run();
+
+// Creates the store's directory if it is on a filesystem. Exits if it
+// cannot be created.
+void prepare_feature_store(const std::string& store_uri);
+
+// Writes a segment into the store. Returns false if the write failed.
+bool write_feature_segment(const std::string& store_uri,
+                           const FeatureSegmentWriter& segment);
+
+// Every segment of a store on a filesystem, memory mapped. Stores written to
+// GCS must be copied to a filesystem before they can be opened. A rerun
+// without -incremental that batches frames differently writes new segments
+// for frames the store already has; the record in the most recently written
+// segment supersedes the others, so each frame contributes at most one row.
+class FeatureStore {
+public:
+  // Exits if the store cannot be read or holds vectors of another type or
+  // dimension. Segments written by skip_run are ignored, so stores opened at
+  // different times during a run see the same segments; zero opens every
+  // segment.
+  FeatureStore(const std::string& store_uri, FeatureType type, int dim,
+               uint32_t skip_run = 0);
+  ~FeatureStore();
+
+  // Number of vectors across all segments, not counting superseded ones
+  size_t rows() const { return rows_; }
+
+  // Whether the store has a record of the frame, including frames the
+  // filters dropped. Frames with a content hash are matched by hash, so a
+  // frame that moved is still found; others are matched by path.
+  bool contains(const std::string& path, uint64_t hash) const;
+
+  // If the frame's newest record marks it as a near-duplicate, sets kept to
+  // the path of the frame it duplicates and returns true. That frame may
+  // itself have no row if it failed to decode.
+  bool duplicate_of(const std::string& path, std::string* kept) const;
+
+  // Copies every vector that is not superseded, segment by segment, to out
+  // as rows of the store's type
+  void copy_rows(char* out) const;
+
+private:
+  FeatureStore(const FeatureStore&);
+  FeatureStore& operator=(const FeatureStore&);
+
+  struct Segment {
+    const char* data;
+    size_t size;
+    const FeatureSegmentHeader* header;
+    // Rows not superseded by a newer segment
+    size_t live_rows;
+    // Those rows in order, or empty if that is all of them
+    std::vector<uint64_t> rows;
+  };
+
+  size_t row_size_;
+  size_t rows_;
+  std::vector<Segment> segments_;
+  std::unordered_set<uint64_t> hashes_;
+  std::unordered_set<std::string> paths_;
+  std::unordered_map<std::string, std::string> duplicates_;
+};
+
+#endif // FEATURE_STORE_H_
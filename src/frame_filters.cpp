@@ -0,0 +1,382 @@
+#include "frame_filters.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char* measure_names[FILTER_MEASURE_COUNT] = {
+  "brightness",
+  "colorfulness",
+  "sharpness",
+  "tone-peak",
+};
+
+const int histogram_bins = 16;
+
+// Sums of the per-pixel terms, accumulated in float along a row so the inner
+// loops vectorize and in double across rows so large frames stay exact
+struct Sums {
+  double luma;
+  double rg;
+  double rg_squared;
+  double yb;
+  double yb_squared;
+  double laplacian;
+  double laplacian_squared;
+};
+
+// Value of a sample on the 0-255 scale. 16-bit samples are the 8.8 fixed
+// point rows RowResampler writes.
+inline float sample_value(uint8_t v) { return v; }
+inline float sample_value(uint16_t v) { return v * (1.0f / 256); }
+
+// Converts one row to luma and accumulates its opponent color sums. r, g and
+// b are the channel offsets within a pixel.
+template <typename T>
+void consume_row(const T* in, int width, int channels, int r, int g, int b,
+                 float* luma, Sums* sums) {
+  float luma_sum = 0, rg_sum = 0, rg_squared = 0, yb_sum = 0, yb_squared = 0;
+  for (int x = 0; x < width; ++x) {
+    const T* pixel = in + x * channels;
+    float red = sample_value(pixel[r]);
+    float green = sample_value(pixel[g]);
+    float blue = sample_value(pixel[b]);
+    float y = 0.299f * red + 0.587f * green + 0.114f * blue;
+    float rg = red - green;
+    float yb = 0.5f * (red + green) - blue;
+    luma[x] = y;
+    luma_sum += y;
+    rg_sum += rg;
+    rg_squared += rg * rg;
+    yb_sum += yb;
+    yb_squared += yb * yb;
+  }
+  sums->luma += luma_sum;
+  sums->rg += rg_sum;
+  sums->rg_squared += rg_squared;
+  sums->yb += yb_sum;
+  sums->yb_squared += yb_squared;
+}
+
+// Accumulates the 4-neighbour Laplacian over the interior of the middle row
+void laplacian_row(const float* up, const float* middle, const float* down,
+                   int width, Sums* sums) {
+  float sum = 0, squared = 0;
+  for (int x = 1; x < width - 1; ++x) {
+    float l = up[x] + down[x] + middle[x - 1] + middle[x + 1] - 4 * middle[x];
+    sum += l;
+    squared += l * l;
+  }
+  sums->laplacian += sum;
+  sums->laplacian_squared += squared;
+}
+
+void histogram_row(const float* luma, int width, int* histogram) {
+  for (int x = 0; x < width; ++x) {
+    int bin = std::min(std::max((int)luma[x], 0) >> 4, histogram_bins - 1);
+    histogram[bin]++;
+  }
+}
+
+template <typename T>
+void compute_stats(const Frame& frame, int r, int g, int b,
+                   FrameStats* stats) {
+  int width = frame.width;
+  int height = frame.height;
+  const T* in = (const T*)frame.data;
+
+  // Luma of the last three rows, for the Laplacian
+  std::vector<float> luma(3 * width);
+  int histogram[histogram_bins] = {0};
+  Sums sums;
+  memset(&sums, 0, sizeof(sums));
+
+  for (int y = 0; y < height; ++y) {
+    float* row = luma.data() + (y % 3) * width;
+    consume_row(in + (size_t)y * width * frame.channels, width,
+                frame.channels, r, g, b, row, &sums);
+    histogram_row(row, width, histogram);
+    if (y >= 2) {
+      laplacian_row(luma.data() + ((y - 2) % 3) * width,
+                    luma.data() + ((y - 1) % 3) * width,
+                    row, width, &sums);
+    }
+  }
+
+  double pixels = (double)width * height;
+  double rg_mean = sums.rg / pixels;
+  double yb_mean = sums.yb / pixels;
+  double rg_variance = std::max(sums.rg_squared / pixels - rg_mean * rg_mean,
+                                0.0);
+  double yb_variance = std::max(sums.yb_squared / pixels - yb_mean * yb_mean,
+                                0.0);
+
+  double laplacian_variance = 0;
+  if (width > 2 && height > 2) {
+    double interior = (double)(width - 2) * (height - 2);
+    double mean = sums.laplacian / interior;
+    laplacian_variance =
+      std::max(sums.laplacian_squared / interior - mean * mean, 0.0);
+  }
+
+  stats->values[FILTER_BRIGHTNESS] = sums.luma / pixels;
+  stats->values[FILTER_COLORFULNESS] =
+    std::sqrt(rg_variance + yb_variance) +
+    0.3 * std::sqrt(rg_mean * rg_mean + yb_mean * yb_mean);
+  stats->values[FILTER_SHARPNESS] = laplacian_variance;
+  stats->values[FILTER_TONE_PEAK] =
+    *std::max_element(histogram, histogram + histogram_bins) / pixels;
+}
+
+// Side of the luma image the perceptual hash is computed from, and of the
+// block of low frequencies it keeps
+const int hash_size = 32;
+const int hash_frequencies = 8;
+
+struct DCTBasis {
+  DCTBasis() {
+    for (int u = 0; u < hash_frequencies; ++u) {
+      for (int x = 0; x < hash_size; ++x) {
+        values[u][x] = std::cos(M_PI * u * (2 * x + 1) / (2 * hash_size));
+      }
+    }
+  }
+
+  float values[hash_frequencies][hash_size];
+};
+
+// Box filters the frame's luma down to hash_size x hash_size
+template <typename T>
+void downscale_luma(const Frame& frame, int r, int g, int b, float* out) {
+  const T* in = (const T*)frame.data;
+  for (int y = 0; y < hash_size; ++y) {
+    int y0 = y * frame.height / hash_size;
+    int y1 = std::max((y + 1) * frame.height / hash_size, y0 + 1);
+    for (int x = 0; x < hash_size; ++x) {
+      int x0 = x * frame.width / hash_size;
+      int x1 = std::max((x + 1) * frame.width / hash_size, x0 + 1);
+      float sum = 0;
+      for (int sy = y0; sy < y1; ++sy) {
+        const T* row = in + (size_t)sy * frame.width * frame.channels;
+        for (int sx = x0; sx < x1; ++sx) {
+          const T* pixel = row + sx * frame.channels;
+          sum += 0.299f * sample_value(pixel[r]) +
+            0.587f * sample_value(pixel[g]) + 0.114f * sample_value(pixel[b]);
+        }
+      }
+      out[y * hash_size + x] = sum / ((y1 - y0) * (x1 - x0));
+    }
+  }
+}
+
+// Averages the frame's pixels over the footprint of each thumbnail pixel,
+// the eight source pixels square it covers, into RGB
+template <typename T>
+void box_downscale(const Frame& frame, int r, int g, int b,
+                   int source_width, int source_height,
+                   int thumb_width, int thumb_height, uint8_t* out) {
+  const T* in = (const T*)frame.data;
+  for (int ty = 0; ty < thumb_height; ++ty) {
+    int y0 = (int64_t)ty * 8 * frame.height / source_height;
+    int y1 = ((int64_t)std::min((ty + 1) * 8, source_height) * frame.height +
+              source_height - 1) / source_height;
+    y0 = std::min(y0, frame.height - 1);
+    y1 = std::min(std::max(y1, y0 + 1), frame.height);
+    for (int tx = 0; tx < thumb_width; ++tx) {
+      int x0 = (int64_t)tx * 8 * frame.width / source_width;
+      int x1 = ((int64_t)std::min((tx + 1) * 8, source_width) * frame.width +
+                source_width - 1) / source_width;
+      x0 = std::min(x0, frame.width - 1);
+      x1 = std::min(std::max(x1, x0 + 1), frame.width);
+      float red = 0, green = 0, blue = 0;
+      for (int sy = y0; sy < y1; ++sy) {
+        const T* row = in + (size_t)sy * frame.width * frame.channels;
+        for (int sx = x0; sx < x1; ++sx) {
+          const T* pixel = row + sx * frame.channels;
+          red += sample_value(pixel[r]);
+          green += sample_value(pixel[g]);
+          blue += sample_value(pixel[b]);
+        }
+      }
+      float scale = 1.0f / ((y1 - y0) * (x1 - x0));
+      uint8_t* thumb = out + ((size_t)ty * thumb_width + tx) * 3;
+      thumb[0] = (uint8_t)std::min(red * scale + 0.5f, 255.0f);
+      thumb[1] = (uint8_t)std::min(green * scale + 0.5f, 255.0f);
+      thumb[2] = (uint8_t)std::min(blue * scale + 0.5f, 255.0f);
+    }
+  }
+}
+
+// Parses an optional bound, leaving *value alone if text is empty
+bool parse_bound(const std::string& text, float* value) {
+  if (text.empty()) return true;
+  char* end;
+  *value = strtof(text.c_str(), &end);
+  return *end == '\0';
+}
+
+}
+
+void compute_frame_stats(const Frame& frame, FrameStats* stats) {
+  if (frame.width <= 0 || frame.height <= 0 || frame.channels < 3) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  if (frame.element_size == sizeof(uint16_t)) {
+    compute_stats<uint16_t>(frame, 2, 1, 0, stats);
+  } else {
+    compute_stats<uint8_t>(frame, 0, 1, 2, stats);
+  }
+}
+
+Frame eighth_scale_frame(const Frame& frame, int source_width,
+                         int source_height, std::vector<uint8_t>* pixels) {
+  Frame thumbnail;
+  if (frame.width <= 0 || frame.height <= 0 || frame.channels < 3 ||
+      source_width <= 0 || source_height <= 0) {
+    return thumbnail;
+  }
+  // libjpeg rounds scaled dimensions up
+  thumbnail.width = (source_width + 7) / 8;
+  thumbnail.height = (source_height + 7) / 8;
+  thumbnail.channels = 3;
+  thumbnail.element_size = sizeof(uint8_t);
+  pixels->resize((size_t)thumbnail.width * thumbnail.height * 3);
+  thumbnail.data = (char*)pixels->data();
+  if (frame.element_size == sizeof(uint16_t)) {
+    box_downscale<uint16_t>(frame, 2, 1, 0, source_width, source_height,
+                            thumbnail.width, thumbnail.height,
+                            pixels->data());
+  } else {
+    box_downscale<uint8_t>(frame, 0, 1, 2, source_width, source_height,
+                           thumbnail.width, thumbnail.height,
+                           pixels->data());
+  }
+  return thumbnail;
+}
+
+uint64_t perceptual_hash(const Frame& frame) {
+  if (frame.width <= 0 || frame.height <= 0 || frame.channels < 3) return 0;
+
+  float luma[hash_size * hash_size];
+  if (frame.element_size == sizeof(uint16_t)) {
+    downscale_luma<uint16_t>(frame, 2, 1, 0, luma);
+  } else {
+    downscale_luma<uint8_t>(frame, 0, 1, 2, luma);
+  }
+
+  // Only the lowest frequencies are kept, so the separable DCT computes
+  // hash_frequencies of each row's and column's hash_size coefficients
+  static const DCTBasis basis;
+
+  float rows[hash_size][hash_frequencies];
+  for (int y = 0; y < hash_size; ++y) {
+    for (int u = 0; u < hash_frequencies; ++u) {
+      float sum = 0;
+      for (int x = 0; x < hash_size; ++x) {
+        sum += basis.values[u][x] * luma[y * hash_size + x];
+      }
+      rows[y][u] = sum;
+    }
+  }
+  float coefficients[hash_frequencies * hash_frequencies];
+  for (int v = 0; v < hash_frequencies; ++v) {
+    for (int u = 0; u < hash_frequencies; ++u) {
+      float sum = 0;
+      for (int y = 0; y < hash_size; ++y) {
+        sum += basis.values[v][y] * rows[y][u];
+      }
+      coefficients[v * hash_frequencies + u] = sum;
+    }
+  }
+
+  // The DC term only tracks brightness, so it is left out of the median
+  float sorted[hash_frequencies * hash_frequencies - 1];
+  std::copy(coefficients + 1, coefficients + hash_frequencies * hash_frequencies,
+            sorted);
+  const int middle = (hash_frequencies * hash_frequencies - 1) / 2;
+  std::nth_element(sorted, sorted + middle,
+                   sorted + hash_frequencies * hash_frequencies - 1);
+  float median = sorted[middle];
+
+  uint64_t hash = 0;
+  for (int i = 0; i < hash_frequencies * hash_frequencies; ++i) {
+    if (coefficients[i] > median) hash |= (uint64_t)1 << i;
+  }
+  return hash;
+}
+
+int find_near_hash(uint64_t hash, const uint64_t* hashes, int count,
+                   int max_distance) {
+  // Distances are computed for a block of candidates at a time so the
+  // popcounts vectorize, then scanned for the first close one
+  const int block = 64;
+  int distances[block];
+  for (int start = 0; start < count; start += block) {
+    int end = std::min(start + block, count);
+    for (int i = start; i < end; ++i) {
+      distances[i - start] = __builtin_popcountll(hash ^ hashes[i]);
+    }
+    for (int i = start; i < end; ++i) {
+      if (distances[i - start] <= max_distance) return i;
+    }
+  }
+  return -1;
+}
+
+int DuplicateTracker::check(int sequence, uint64_t hash, int id) {
+  Kept& kept = kept_[sequence];
+  int match = find_near_hash(hash, kept.hashes.data(), kept.hashes.size(),
+                             max_distance_);
+  if (match >= 0) return kept.ids[match];
+
+  kept.hashes.push_back(hash);
+  kept.ids.push_back(id);
+  if ((int)kept.hashes.size() > window_) {
+    kept.hashes.erase(kept.hashes.begin());
+    kept.ids.erase(kept.ids.begin());
+  }
+  return -1;
+}
+
+bool passes_filters(const FrameStats& stats,
+                    const FilterPredicate* predicates,
+                    int count) {
+  for (int i = 0; i < count; ++i) {
+    float value = stats.values[predicates[i].measure];
+    if (value < predicates[i].min || value > predicates[i].max) return false;
+  }
+  return true;
+}
+
+bool parse_filter_predicate(const char* spec, FilterPredicate* predicate) {
+  std::string text(spec);
+  size_t first = text.find(':');
+  std::string name = text.substr(0, first);
+  std::string min_text;
+  std::string max_text;
+  if (first != std::string::npos) {
+    size_t second = text.find(':', first + 1);
+    min_text = text.substr(first + 1, second - first - 1);
+    if (second != std::string::npos) max_text = text.substr(second + 1);
+  }
+
+  int measure = 0;
+  while (measure < FILTER_MEASURE_COUNT && name != measure_names[measure]) {
+    measure++;
+  }
+  if (measure == FILTER_MEASURE_COUNT) return false;
+
+  predicate->measure = (FilterMeasure)measure;
+  predicate->min = -FLT_MAX;
+  predicate->max = FLT_MAX;
+  return parse_bound(min_text, &predicate->min) &&
+    parse_bound(max_text, &predicate->max);
+}
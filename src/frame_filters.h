@@ -0,0 +1,96 @@
+#ifndef FRAME_FILTERS_H_
+#define FRAME_FILTERS_H_
+
+#include "common.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Content measures the filter task can threshold frames on
+enum FilterMeasure {
+  // Mean luma, 0-255
+  FILTER_BRIGHTNESS,
+  // Hasler and Suesstrunk's colorfulness metric; near zero for gray frames
+  FILTER_COLORFULNESS,
+  // Variance of the Laplacian of luma; low for blurred or featureless frames
+  FILTER_SHARPNESS,
+  // Fraction of pixels in the fullest of 16 luma histogram bins; near one for
+  // black, overexposed or covered frames
+  FILTER_TONE_PEAK,
+  FILTER_MEASURE_COUNT,
+};
+
+// A frame passes if the measure lies within [min, max]
+struct FilterPredicate {
+  FilterMeasure measure;
+  float min;
+  float max;
+};
+
+// Predicates travel in task arguments, so their number is bounded
+const int MAX_FILTER_PREDICATES = 8;
+
+struct FrameStats {
+  float values[FILTER_MEASURE_COUNT];
+};
+
+// Computes every measure in one pass over the frame. Frames of 8-bit pixels
+// are read as RGB and frames of 16-bit samples as the BGR rows RowResampler
+// writes.
+void compute_frame_stats(const Frame& frame, FrameStats* stats);
+
+// Box filters frame, a decode of a source_width x source_height image at any
+// scale and in any layout compute_frame_stats accepts, down to the size of
+// the image's eighth-scale JPEG thumbnail, as 8-bit RGB in pixels. Measures
+// and hashes of the result track those of the thumbnail decoded from the
+// JPEG, so filter thresholds mean the same whatever form a frame is kept in.
+Frame eighth_scale_frame(const Frame& frame, int source_width,
+                         int source_height, std::vector<uint8_t>* pixels);
+
+bool passes_filters(const FrameStats& stats,
+                    const FilterPredicate* predicates,
+                    int count);
+
+// 64-bit DCT hash of the frame's luma: the signs of its lowest 8x8 DCT
+// coefficients at 32x32, relative to their median. Frames that look alike
+// have hashes a small Hamming distance apart.
+uint64_t perceptual_hash(const Frame& frame);
+
+// Returns the index of the first of count hashes within max_distance bits of
+// hash, or -1 if there is none
+int find_near_hash(uint64_t hash, const uint64_t* hashes, int count,
+                   int max_distance);
+
+// Near-duplicate detection over a stream of frames from several captures.
+// Each frame is only compared against the recent kept frames of its own
+// sequence, so frames of other captures neither hide a match nor use up the
+// window.
+class DuplicateTracker {
+public:
+  // Frames within max_distance bits of one of the last window kept frames of
+  // their sequence are duplicates
+  DuplicateTracker(int max_distance, int window)
+    : max_distance_(max_distance), window_(window) {}
+
+  // Returns the id of the first recent kept frame of sequence whose hash is
+  // near hash. If there is none, keeps the frame under id and returns -1.
+  int check(int sequence, uint64_t hash, int id);
+
+private:
+  struct Kept {
+    // Most recent last, at most window_ of each
+    std::vector<uint64_t> hashes;
+    std::vector<int> ids;
+  };
+
+  int max_distance_;
+  int window_;
+  std::unordered_map<int, Kept> kept_;
+};
+
+// Parses "<measure>:<min>:<max>", where either bound may be left empty, e.g.
+// "brightness:20:235" or "sharpness:50". Returns false if spec is malformed.
+bool parse_filter_predicate(const char* spec, FilterPredicate* predicate);
+
+#endif // FRAME_FILTERS_H_
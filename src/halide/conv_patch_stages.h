@@ -0,0 +1,175 @@
+#ifndef CONV_PATCH_STAGES_H_
+#define CONV_PATCH_STAGES_H_
+
+#include "Halide.h"
+#include <stdio.h>
+#include <algorithm>
+
+/* Stages shared by the to_conv_patch generators, taken directly from the
+ * Halide resize app */
+
+using namespace Halide;
+
+enum InterpolationType {
+    BOX, LINEAR, CUBIC, LANCZOS
+};
+
+Expr kernel_box(Expr x) {
+    Expr xx = abs(x);
+    return select(xx <= 0.5f, 1.0f, 0.0f);
+}
+
+Expr kernel_linear(Expr x) {
+    Expr xx = abs(x);
+    return select(xx < 1.0f, 1.0f - xx, 0.0f);
+}
+
+Expr kernel_cubic(Expr x) {
+    Expr xx = abs(x);
+    Expr xx2 = xx * xx;
+    Expr xx3 = xx2 * xx;
+    float a = -0.5f;
+
+    return select(xx < 1.0f, (a + 2.0f) * xx3 - (a + 3.0f) * xx2 + 1,
+                  select (xx < 2.0f, a * xx3 - 5 * a * xx2 + 8 * a * xx - 4.0f * a,
+                          0.0f));
+}
+
+Expr sinc(Expr x) {
+    return sin(float(M_PI) * x) / x;
+}
+
+Expr kernel_lanczos(Expr x) {
+    Expr value = sinc(x) * sinc(x/3);
+    value = select(x == 0.0f, 1.0f, value); // Take care of singularity at zero
+    value = select(x > 3 || x < -3, 0.0f, value); // Clamp to zero out of bounds
+    return value;
+}
+
+struct KernelInfo {
+    const char *name;
+    float size;
+    Expr (*kernel)(Expr);
+};
+
+static KernelInfo kernelInfo[] = {
+    { "box", 0.5f, kernel_box },
+    { "linear", 1.0f, kernel_linear },
+    { "cubic", 2.0f, kernel_cubic },
+    { "lanczos", 3.0f, kernel_lanczos }
+};
+
+
+InterpolationType interpolationType = LINEAR;
+int schedule = 3;
+
+// Interpolation weights for resampling one axis by scale_factor: output
+// coordinate v reads the source samples begin + dom, weighted by
+// kernel(v, dom)
+struct AxisResample {
+  Func kernel;
+  Expr begin;
+  RDom dom;
+};
+
+AxisResample resample_axis(Var v, Var k, Expr scale_factor,
+                           const char* name) {
+  const KernelInfo &info = kernelInfo[interpolationType];
+
+  // For downscaling, the kernel is not widened to lowpass filter
+  float kernelSize = info.size;
+
+  // source is the (non-integer) coordinate inside the source image. Since
+  // we allow an arbitrary scaling factor, the filter coefficients are
+  // different for each coordinate.
+  Expr source = (v + 0.5f) / scale_factor;
+
+  AxisResample resample;
+  resample.begin = cast<int>(source - kernelSize + 0.5f);
+  resample.dom = RDom(0, cast<int>(2.0f * kernelSize) + 1);
+  Func kv;
+  kv(v, k) = info.kernel(k + resample.begin - source);
+  resample.kernel = Func(name);
+  resample.kernel(v, k) = kv(v, k) / sum(kv(v, resample.dom));
+  return resample;
+}
+
+// Everything after the horizontal upscale: rows holds BGR floats in [0, 255]
+// already resampled to the mean image width, in_height rows of them. They
+// are upscaled vertically to the mean image, the mean is subtracted, and the
+// result is downscaled to the output size. horizontal, if given, is the
+// horizontal upscale stage, which is scheduled along with the rest. Returns
+// the scheduled output stage.
+Func conv_patch_stages(Func rows, Expr in_height, ImageParam mean,
+                       Param<int> output_width, Param<int> output_height,
+                       Var x, Var y, Var c, Var k, Func* horizontal) {
+  //////////////////////////////////////////////////////////////////////////////
+  /// Upscale
+  AxisResample u_y = resample_axis(
+    y, k, cast<float>(mean.height()) / in_height, "u_kernely");
+
+  Func u_resized_y("u_resized_y");
+  u_resized_y(x, y, c) = sum(u_y.kernel(y, u_y.dom) *
+                             rows(x, u_y.dom + u_y.begin, c));
+
+  /////////////////////////////////////////////////////////////////////////////
+  /// Subtract mean
+  Func clamped_mean = BoundaryConditions::repeat_edge(mean);
+  Func clamped;
+  clamped(x, y, c) =
+    (clamp(u_resized_y(x, y, c), 0.0f, 1.0f) * 255.0f - clamped_mean(x, y, c))
+    / 255.0f;
+
+  /////////////////////////////////////////////////////////////////////////////
+  /// Downscale
+  AxisResample d_x = resample_axis(
+    x, k, output_width / cast<float>(mean.width()), "kernelx");
+  AxisResample d_y = resample_axis(
+    y, k, output_height / cast<float>(mean.height()), "kernely");
+
+  // Perform separable resizing
+  Func resized_x("resized_x");
+  Func resized_y("resized_y");
+  resized_x(x, y, c) = sum(d_x.kernel(x, d_x.dom) *
+                           cast<float>(clamped(d_x.dom + d_x.begin, y, c)));
+  resized_y(x, y, c) = sum(d_y.kernel(y, d_y.dom) *
+                           resized_x(x, d_y.dom + d_y.begin, c));
+
+  Func final("final");
+  final(x, y, c) = clamp(resized_y(x, y, c), 0.0f, 1.0f) * 255.0f;
+
+  // Scheduling
+  bool parallelize = (schedule >= 2);
+  bool vectorize = (schedule == 1 || schedule == 3);
+
+  u_y.kernel.compute_at(clamped, y);
+
+  d_x.kernel.compute_root();
+  d_y.kernel.compute_at(final, y);
+
+  if (vectorize) {
+    if (horizontal) horizontal->vectorize(x, 4);
+    clamped.compute_root();
+    clamped.vectorize(x, 4);
+
+    resized_x.vectorize(x, 4);
+    final.vectorize(x, 4);
+  }
+
+  if (parallelize) {
+    Var yo, yi;
+
+    clamped.split(y, yo, y, 32).parallel(yo);
+    if (horizontal) horizontal->store_at(clamped, yo).compute_at(clamped, y);
+
+    final.split(y, yo, y, 32).parallel(yo);
+    resized_x.store_at(final, yo).compute_at(final, y);
+  } else {
+    if (horizontal) horizontal->store_at(clamped, c).compute_at(clamped, y);
+    resized_x.store_at(final, c).compute_at(final, y);
+  }
+
+  return final;
+}
+
+#endif // CONV_PATCH_STAGES_H_
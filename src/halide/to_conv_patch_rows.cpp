@@ -0,0 +1,32 @@
+#include "conv_patch_stages.h"
+
+int main(int argc, char **argv) {
+  // Variant of to_conv_patch for frames decoded through RowResampler: rows
+  // arrive as interleaved BGR in 8.8 fixed point, already resampled
+  // horizontally to the mean image width, so only the vertical half of the
+  // upscale remains.
+  Halide::Var x, y, c, k;
+  Halide::ImageParam in(Halide::type_of<uint16_t>(), 3);
+  Halide::ImageParam mean(Halide::type_of<float>(), 3);
+  Halide::Param<int> output_width;
+  Halide::Param<int> output_height;
+
+  Func clamped_in = (BoundaryConditions::repeat_edge(in));
+  Func widened;
+  widened(x, y, c) = cast<float>(clamped_in(x, y, c)) / 256.0f;
+
+  Func final = conv_patch_stages(widened, in.height(), mean,
+                                 output_width, output_height,
+                                 x, y, c, k, nullptr);
+
+  in.set_stride(0, 3);
+  in.set_stride(2, 1);
+  in.set_extent(2, 3);
+
+  final.compile_to_file
+    ("to_conv_patch_rows",
+     {in, mean,
+         output_width, output_height});
+
+  return 0;
+}
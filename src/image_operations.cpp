@@ -1,7 +1,56 @@
 #include "image_operations.h"
 #include "halide/to_conv_patch.h"
+#include "halide/to_conv_patch_rows.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+int to_conv_rows_input(Frame* in, Frame* out, Frame* mean) {
+  buffer_t in_buffer = {0};
+  in_buffer.host = reinterpret_cast<uint8_t*>(in->data);
+  in_buffer.extent[0] = in->width;
+  in_buffer.extent[1] = in->height;
+  in_buffer.extent[2] = in->channels;
+  in_buffer.stride[0] = in->channels;
+  in_buffer.stride[1] = in->width * in->channels;
+  in_buffer.stride[2] = 1;
+  in_buffer.elem_size = in->element_size;
+
+  buffer_t out_buffer = {0};
+  out_buffer.host = reinterpret_cast<uint8_t*>(out->data);
+  out_buffer.extent[0] = out->width;
+  out_buffer.extent[1] = out->height;
+  out_buffer.extent[2] = out->channels;
+  out_buffer.stride[0] = 1;
+  out_buffer.stride[1] = out->width;
+  out_buffer.stride[2] = out->width * out->height;
+  out_buffer.elem_size = out->element_size;
+
+  buffer_t mean_buffer = {0};
+  mean_buffer.host = reinterpret_cast<uint8_t*>(mean->data);
+  mean_buffer.extent[0] = mean->width;
+  mean_buffer.extent[1] = mean->height;
+  mean_buffer.extent[2] = mean->channels;
+  mean_buffer.stride[0] = 1;
+  mean_buffer.stride[1] = mean->width;
+  mean_buffer.stride[2] = mean->width * mean->height;
+  mean_buffer.elem_size = mean->element_size;
+
+  return ::to_conv_patch_rows(&in_buffer,
+                              &mean_buffer,
+                              out->width, out->height,
+                              &out_buffer);
+}
+
+}
 
 int to_conv_input(Frame* in, Frame* out, Frame* mean) {
+  if (in->element_size == sizeof(uint16_t)) {
+    return to_conv_rows_input(in, out, mean);
+  }
+
   buffer_t in_buffer = {0};
   in_buffer.host = reinterpret_cast<uint8_t*>(in->data);
   in_buffer.extent[0] = in->width;
@@ -37,3 +86,44 @@ int to_conv_input(Frame* in, Frame* out, Frame* mean) {
                          out->width, out->height,
                          &out_buffer);
 }
+
+RowResampler::RowResampler(unsigned in_width, unsigned out_width,
+                           uint16_t* out)
+  : out_width_(out_width), out_(out), row_(in_width * 3), taps_(out_width) {
+  // Same linear kernel and sample positions as the upscale in to_conv_patch
+  float scale = (float)out_width / in_width;
+  for (unsigned x = 0; x < out_width; ++x) {
+    float source = (x + 0.5f) / scale;
+    int begin = (int)(source - 1.0f + 0.5f);
+    float total = 0;
+    for (int k = 0; k < 3; ++k) {
+      float distance = std::abs(k + begin - source);
+      float weight = distance < 1.0f ? 1.0f - distance : 0.0f;
+      taps_[x].index[k] =
+        std::min(std::max(begin + k, 0), (int)in_width - 1);
+      taps_[x].weight[k] = weight;
+      total += weight;
+    }
+    for (int k = 0; k < 3; ++k) {
+      taps_[x].weight[k] *= 256.0f / total;
+    }
+  }
+}
+
+void RowResampler::consume() {
+  const uint8_t* in = row_.data();
+  for (unsigned x = 0; x < out_width_; ++x) {
+    const Taps& taps = taps_[x];
+    float r = 0, g = 0, b = 0;
+    for (int k = 0; k < 3; ++k) {
+      const uint8_t* pixel = in + taps.index[k] * 3;
+      r += taps.weight[k] * pixel[0];
+      g += taps.weight[k] * pixel[1];
+      b += taps.weight[k] * pixel[2];
+    }
+    out_[x * 3 + 0] = (uint16_t)(b + 0.5f);
+    out_[x * 3 + 1] = (uint16_t)(g + 0.5f);
+    out_[x * 3 + 2] = (uint16_t)(r + 0.5f);
+  }
+  out_ += out_width_ * 3;
+}
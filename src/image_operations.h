@@ -3,6 +3,58 @@
 
 #include "common.h"
 
+#include <cstdint>
+#include <vector>
+
+// Preprocesses a decoded frame into a network input patch. Frames of 8-bit
+// interleaved RGB go through the whole to_conv_patch pipeline; frames of
+// 16-bit rows already produced by RowResampler skip its channel flip and
+// horizontal resample.
 int to_conv_input(Frame* in, Frame* out, Frame* mean);
 
+// Consumes decoded RGB scanlines one at a time and writes each as a row of
+// interleaved BGR resampled to out_width, the first stages of to_conv_patch
+// fused into decoding. Only one source row is ever held, so the full
+// resolution frame is never materialized. Samples are 8.8 fixed point, which
+// keeps the interpolated fraction at half the size of floats;
+// to_conv_patch_rows widens them back.
+class RowResampler {
+public:
+  RowResampler(unsigned in_width, unsigned out_width, uint16_t* out);
+
+  // Scratch buffer the decoder writes the next source row into
+  uint8_t* row() { return row_.data(); }
+
+  // Resamples the row just written into the next output row
+  void consume();
+
+  // Passed to JPEGReader::load. The reader must be limited to one row
+  // pointer at a time with setMaxRowPtrs(1), and consume() must be called
+  // once more after load() returns for the last row.
+  struct Iter {
+    RowResampler* resampler;
+
+    uint8_t* operator*() { return resampler->row(); }
+
+    Iter& operator++() {
+      resampler->consume();
+      return *this;
+    }
+  };
+
+  Iter begin() { return Iter{this}; }
+
+private:
+  // Linear interpolation taps for one output pixel
+  struct Taps {
+    int index[3];
+    float weight[3];
+  };
+
+  unsigned out_width_;
+  uint16_t* out_;
+  std::vector<uint8_t> row_;
+  std::vector<Taps> taps_;
+};
+
 #endif // IMAGE_OPERATIONS_H_
@@ -1,4 +1,5 @@
 #include "JPEGReader.h"
+#include <algorithm>
 #include <cstdio>
 #include <stdexcept>
 #include <cassert>
@@ -7,7 +8,7 @@
 
 #include <iostream> // debug
 
-#include "libgcs.h"
+#include "../storage.h"
 
 // We need version 6b
 #if JPEG_LIB_VERSION < 62
@@ -28,7 +29,7 @@ namespace {
 }
 
 JPEGReader::JPEGReader():
-    file(NULL),
+    buffer(NULL),
     max_row_ptrs(std::numeric_limits<unsigned>::max()) {
 
     // Error handling first, in case the initialization fails.
@@ -47,35 +48,29 @@ JPEGReader::~JPEGReader() {
     assert(cinfo.client_data == this);
 
     jpeg_destroy_decompress(&cinfo);
-    if (file)
-        fclose(file);
+    if (buffer)
+        free(buffer);
 }
 
-void JPEGReader::header(const std::string& key,
-                        const std::string& bucket,
-                        const std::string& path) {
+void JPEGReader::reset() {
+    jpeg_abort_decompress(&cinfo);
+    max_row_ptrs = std::numeric_limits<unsigned>::max();
     warningMsg.clear();
+}
 
-    // Specify the source of the compressed data (eg, a file)
-    GoString key_str;
-    key_str.p = (char*) key.c_str();
-    key_str.n = key.length();
-
-    GoString bucket_str;
-    bucket_str.p = (char*) bucket.c_str();
-    bucket_str.n = bucket.length();
-
-    GoString path_str;
-    path_str.p = (char*) path.c_str();
-    path_str.n = path.length();
+void JPEGReader::header(const std::string& uri) {
+    reset();
 
-    char *fifo = (char*) gcs_read(key_str, bucket_str, path_str).data;
+    // Fetch the compressed data from whichever storage backend serves uri
+    if (buffer)
+        free(buffer);
 
-    if ((file = fopen(fifo, "rb")) == NULL)
-      throw std::runtime_error("Cannot open " + path);
+    size_t size = 0;
+    buffer = (unsigned char*) read_object(uri, &size);
+    if (buffer == NULL)
+      throw std::runtime_error("Cannot open " + uri);
 
-    fflush(stdout);
-    jpeg_stdio_src(&cinfo, file);
+    jpeg_mem_src(&cinfo, buffer, size);
 
     // Call jpeg_read_header to obtain image info
     jpeg_read_header(&cinfo, true);
@@ -87,7 +82,7 @@ void JPEGReader::header(const std::string& key,
 }
 
 void JPEGReader::header_mem(uint8_t *data, size_t size) {
-    warningMsg.clear();
+    reset();
 
     jpeg_mem_src(&cinfo, data, size);
 
@@ -174,18 +169,21 @@ void JPEGReader::setQuantization(const unsigned value) {
 void JPEGReader::setTradeoff(const JPEG::TimeQualityTradeoff value) {
     switch (value) {
         case JPEG::FASTER:
-            cinfo.dct_method = JDCT_FASTEST;
+            cinfo.dct_method = JDCT_IFAST;
             cinfo.do_fancy_upsampling = false;
+            cinfo.do_block_smoothing = false;
             break;
 
         case JPEG::DEFAULT:
             cinfo.dct_method = JDCT_DEFAULT;
             cinfo.do_fancy_upsampling = true;
+            cinfo.do_block_smoothing = true;
             break;
 
         case JPEG::BETTER:
             cinfo.dct_method = JDCT_FLOAT;
             cinfo.do_fancy_upsampling = true;
+            cinfo.do_block_smoothing = true;
             break;
 
         default:
@@ -194,6 +192,63 @@ void JPEGReader::setTradeoff(const JPEG::TimeQualityTradeoff value) {
     }
 }
 
+void JPEGReader::loadDC(std::vector<unsigned char>& pixels) {
+    const bool ycc = cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3;
+    if (!ycc && cinfo.jpeg_color_space != JCS_GRAYSCALE)
+        throw std::runtime_error("DC thumbnails need a grayscale or YCbCr image");
+
+    setScale(JPEG::SCALE_EIGHTH);
+    jvirt_barray_ptr* coefficients = jpeg_read_coefficients(&cinfo);
+
+    const unsigned thumb_width = width();
+    const unsigned thumb_height = height();
+    pixels.resize(thumb_width * thumb_height * 3);
+
+    // DC of a block, dequantized, is eight times its mean sample offset
+    // from the center value
+    const int components = ycc ? 3 : 1;
+    std::vector<float> planes[3];
+    for (int c = 0; c < components; ++c) {
+        jpeg_component_info* comp = &cinfo.comp_info[c];
+        const float step = comp->quant_table->quantval[0] / 8.0f;
+        planes[c].resize(thumb_width * thumb_height);
+
+        for (unsigned y = 0; y < thumb_height; ++y) {
+            // Components sampled below the maximum factor cover several
+            // thumbnail pixels per block
+            JDIMENSION by = y * comp->v_samp_factor / cinfo.max_v_samp_factor;
+            by = std::min(by, comp->height_in_blocks - 1);
+            JBLOCKARRAY row = (*cinfo.mem->access_virt_barray)
+                ((j_common_ptr) &cinfo, coefficients[c], by, 1, FALSE);
+
+            for (unsigned x = 0; x < thumb_width; ++x) {
+                JDIMENSION bx = x * comp->h_samp_factor / cinfo.max_h_samp_factor;
+                bx = std::min(bx, comp->width_in_blocks - 1);
+                planes[c][y * thumb_width + x] = row[0][bx][0] * step + CENTERJSAMPLE;
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < thumb_width * thumb_height; ++i) {
+        float r, g, b;
+        const float luma = planes[0][i];
+        if (ycc) {
+            const float cb = planes[1][i] - CENTERJSAMPLE;
+            const float cr = planes[2][i] - CENTERJSAMPLE;
+            r = luma + 1.402f * cr;
+            g = luma - 0.344136f * cb - 0.714136f * cr;
+            b = luma + 1.772f * cb;
+        } else {
+            r = g = b = luma;
+        }
+        pixels[i * 3 + 0] = (unsigned char) std::min(std::max(r + 0.5f, 0.0f), 255.0f);
+        pixels[i * 3 + 1] = (unsigned char) std::min(std::max(g + 0.5f, 0.0f), 255.0f);
+        pixels[i * 3 + 2] = (unsigned char) std::min(std::max(b + 0.5f, 0.0f), 255.0f);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+}
+
 void JPEGReader::error_exit() {
     output_message();
     throw std::runtime_error("libjpeg error: " + warningMsg);
@@ -28,11 +28,15 @@ class JPEGReader {
     /// Free the libjpeg structures.
     ~JPEGReader();
     
-    /// Start the load by reading the header of the JPEG file at \c path.
+    /// Abandon any image in progress and return to the state of a freshly
+    /// constructed reader, keeping libjpeg's allocations for the next image.
+    /// Called by header() and header_mem(), so a reader can be reused for
+    /// any number of images, including after a decode threw.
+    void reset();
+
+    /// Start the load by reading the header of the JPEG object at \c uri.
     /// After this point, width(), height(), components() are all valid.
-    void header(const std::string& key,
-                const std::string& bucket,
-                const std::string& path);
+    void header(const std::string& uri);
 
     void header_mem(uint8_t *data, size_t size);
     
@@ -103,7 +107,9 @@ class JPEGReader {
     /// quantization.  Can change components()!
     void setQuantization(const unsigned value);
     
-    /// Set the time/quality tradeoff.
+    /// Set the time/quality tradeoff.  Must be called after \c header(), which
+    /// resets libjpeg's decompression parameters.  \c FASTER uses the fast
+    /// integer IDCT and turns off fancy upsampling and block smoothing.
     void setTradeoff(const JPEG::TimeQualityTradeoff value);
 
     
@@ -183,6 +189,15 @@ class JPEGReader {
     /// cheap to copy, but this one will copy \c buffer...
     template <typename RowPtrIter>
     void load(RowPtrIter rows);
+
+    /// Build an eighth-scale RGB thumbnail from the DC coefficient of each
+    /// block, skipping the IDCT, upsampling and color conversion passes.
+    /// Sets the scale to \c SCALE_EIGHTH, so width() and height() give the
+    /// thumbnail size, and fills \c pixels with width() * height() * 3 bytes.
+    /// Only grayscale and YCbCr images are supported; others throw
+    /// std::runtime_error like any decode error, as do progressive images
+    /// whose DC scans are missing.
+    void loadDC(std::vector<unsigned char>& pixels);
     
     /// @}
     
@@ -211,7 +226,7 @@ class JPEGReader {
     struct jpeg_decompress_struct cinfo;        /// libjpeg file structure
     struct jpeg_error_mgr jerr;                 /// libjpeg error structure
     
-    FILE* file;                                 /// Good ol' C file IO
+    unsigned char* buffer;                      /// Compressed bytes fetched by header()
     unsigned max_row_ptrs;                      /// How many simultaneous rows can the user handle?
     std::vector<unsigned char*> row_ptrs;       /// Cached row pointers from the user
     
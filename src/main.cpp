@@ -1,13 +1,24 @@
 #include "common.h"
 #include "compute_features.h"
+#include "feature_store.h"
+#include "frame_filters.h"
+#include "image_operations.h"
+#include "manifest.h"
 #include "util.h"
+#include "options.h"
+#include "storage.h"
+#include "shard.h"
 #include "jpeg/JPEGReader.h"
 
 #include "legion.h"
 #include "default_mapper.h"
 #include "realm/realm.h"
 
+#include <algorithm>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <sstream>
 
 using namespace LegionRuntime::HighLevel;
 using namespace LegionRuntime::Accessor;
@@ -22,16 +33,36 @@ enum TunableVariables {
 enum TaskID {
   MAIN_TASK_ID,
   INNER_TASK_ID,
+  PROBE_TASK_ID,
   LOAD_TASK_ID,
   FILTER_TASK_ID,
   FEATURE_TASK_ID,
   REPARTITION_TASK_ID,
   COMPACT_TASK_ID,
   KNN_TASK_ID,
+  COUNT_SHARD_TASK_ID,
+  SHARD_TASK_ID,
+  CHUNK_TASK_ID,
 };
 
 enum MetadataIDs {
+  // Where the path is in the path heap, a PathRef
   PATH_ID,
+  // Size of the source image, from the manifest or a probe task
+  WIDTH_ID,
+  HEIGHT_ID,
+  // Length of the encoded image, needed to size regions that hold it with
+  // -compressed-regions
+  BYTES_ID,
+  // Content hash from the manifest, or zero; kept with the image's vector in
+  // the feature store
+  HASH_ID,
+};
+
+// Paths are packed back to back in a separate character region, so each
+// entry only costs its own length
+enum PathHeapIDs {
+  PATH_CHARS_ID,
 };
 
 enum ImageIDs {
@@ -41,15 +72,87 @@ enum ImageIDs {
 enum VectorIDs {
   VEC_ID,
   FILTER_ID,
+  // Vector index of the frame a near-duplicate was matched to, or -1
+  DUP_OF_ID,
+};
+
+// Values of FILTER_ID. The vector region is partitioned on it, so only
+// FILTER_PASSED vectors reach KNN.
+enum FilterResult {
+  FILTER_PASSED = 0,
+  FILTER_REJECTED = -1,
+  FILTER_DUPLICATE = -2,
 };
 
 const size_t K = 5;
-const size_t PATH_SIZE = 256;
+// Each KNN element holds K distances, nearest first, then their K indices
+const size_t KNN_SIZE = K * (sizeof(float) + sizeof(int));
+
+static_assert(BATCH_SIZE <= 32, "load mask holds one bit per image");
 
-const int IMAGE_WIDTH = 400;
-const int IMAGE_HEIGHT = 225;
 const int IMAGE_CHANNELS = 3;
 
+// Scaled decodes stop at the smallest size covering the mean image that
+// to_conv_patch resamples every input to
+const int DECODE_TARGET_WIDTH = 256;
+const int DECODE_TARGET_HEIGHT = 256;
+
+// Bytes of each object the probe task reads first when it only needs the
+// JPEG's frame header; JPEGs with larger metadata segments are read further
+const size_t PROBE_PREFIX_SIZE = 64 * 1024;
+
+// Image regions start with the size the load task decoded the image at,
+// followed by its pixels packed row by row. Pixels are 8-bit RGB, or with
+// -fused-decode 16-bit fixed point BGR rows already resampled to
+// DECODE_TARGET_WIDTH.
+//
+// With -compressed-regions the load task stores the JPEG itself after the
+// header instead, and the stages that need pixels decode it where they run.
+// encoded_size is then the length of the JPEG, width and height its source
+// size, and a zero encoded_size marks an image that failed to load.
+struct ImageHeader {
+  int width;
+  int height;
+  int channels;
+  int element_size;
+  int encoded_size;
+};
+
+// Scale the load task decodes a width x height JPEG at. Inner tasks size
+// image regions with the same rule before the image is read.
+JPEG::Scale decode_scale(int width, int height) {
+  if (!options.scaled_decode) return JPEG::SCALE_FULL_SIZE;
+  for (int denom = JPEG::SCALE_EIGHTH; denom > 1; denom /= 2) {
+    // libjpeg rounds scaled dimensions up
+    if ((width + denom - 1) / denom >= DECODE_TARGET_WIDTH &&
+        (height + denom - 1) / denom >= DECODE_TARGET_HEIGHT) {
+      return (JPEG::Scale)denom;
+    }
+  }
+  return JPEG::SCALE_FULL_SIZE;
+}
+
+// Bytes of pixel data for a source image of width x height once decoded.
+// Every region also holds at least one pixel so a blank frame always fits.
+size_t image_data_size(int width, int height) {
+  int denom = decode_scale(width, height);
+  size_t rows = std::max((height + denom - 1) / denom, 1);
+  if (options.fused_decode) {
+    return DECODE_TARGET_WIDTH * rows * IMAGE_CHANNELS * sizeof(uint16_t);
+  }
+  size_t columns = std::max((width + denom - 1) / denom, 1);
+  return columns * rows * IMAGE_CHANNELS;
+}
+
+// Bytes an image region needs after its header: the decoded image, or with
+// -compressed-regions the encoded one
+size_t image_region_size(int width, int height, int bytes) {
+  if (options.compressed_regions) {
+    return std::max(bytes, 1);
+  }
+  return image_data_size(width, height);
+}
+
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 // Mapper
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
@@ -64,10 +167,17 @@ public:
     auto id = task->task_id;
     if (id == MAIN_TASK_ID) {
     } else if (id == INNER_TASK_ID) {
-      //task->regions[0].virtual_map = true;
-      //task->regions[1].virtual_map = true;
+      // Only the path region is read here; the vector and heap regions are
+      // passed on to the subtasks, and mapping them would make each child
+      // launch wait for the parent's mapping to be released
+      task->regions[1].virtual_map = true;
       task->regions[2].virtual_map = true;
+      task->regions[3].virtual_map = true;
       task->task_priority = 4;
+    } else if (id == SHARD_TASK_ID || id == CHUNK_TASK_ID) {
+      // Only passed on to the inner task
+      task->regions[0].virtual_map = true;
+      task->regions[1].virtual_map = true;
     } else if (id == LOAD_TASK_ID) {
       task->task_priority = 2;
     } else if (id == FILTER_TASK_ID) {
@@ -82,6 +192,291 @@ public:
 // Legion Tasks
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
+// Location of a path in the path heap
+struct PathRef {
+  uint64_t offset;
+  uint32_t length;
+};
+
+// The paths held by a mapped subregion of the path heap, returned as views
+// into the mapping rather than copied
+class PathHeap {
+public:
+  PathHeap(HighLevelRuntime* rt, Context ctx, const PhysicalRegion& region) {
+    Rect<1> rect =
+      rt->get_index_space_domain(ctx,
+                                 region.get_logical_region()
+                                 .get_index_space()).get_rect<1>();
+    begin_ = rect.lo[0];
+    chars_ = get_array_pointer(region.get_field_accessor(PATH_CHARS_ID),
+                               rect, sizeof(char));
+  }
+
+  StringRef get(const PathRef& ref) const {
+    return StringRef(chars_ + (ref.offset - begin_), ref.length);
+  }
+
+private:
+  const char* chars_;
+  uint64_t begin_;
+};
+
+// Partitions the path heap like path_partition partitions path_is, so each
+// subregion of the path region has a heap subregion holding exactly its
+// paths. refs are the entries of path_is in order; since paths are packed in
+// entry order, every subregion's paths are one contiguous range.
+IndexPartition create_heap_partition(HighLevelRuntime* rt,
+                                     Context ctx,
+                                     IndexSpace heap_is,
+                                     IndexSpace path_is,
+                                     IndexPartition path_partition,
+                                     Domain color_domain,
+                                     const std::vector<PathRef>& refs) {
+  int first = rt->get_index_space_domain(ctx, path_is).get_rect<1>().lo[0];
+
+  DomainPointColoring coloring;
+  for (Realm::Domain::DomainPointIterator itr(color_domain); itr; itr++) {
+    IndexSpace sub_is = rt->get_index_subspace(ctx, path_partition, itr.p);
+    Rect<1> rect = rt->get_index_space_domain(ctx, sub_is).get_rect<1>();
+    const PathRef& lo = refs[rect.lo[0] - first];
+    const PathRef& hi = refs[rect.hi[0] - first];
+    coloring[itr.p] =
+      Domain::from_rect<1>(Rect<1>(Point<1>(lo.offset),
+                                   Point<1>(hi.offset + hi.length - 1)));
+  }
+  return rt->create_index_partition(ctx, heap_is, color_domain, coloring);
+}
+
+// Returns the header of an image region and stores the bytes available for
+// pixels after it in *data_size
+ImageHeader* get_image_header(HighLevelRuntime* rt,
+                              Context ctx,
+                              const PhysicalRegion& image_region,
+                              size_t* data_size = nullptr) {
+  size_t region_size =
+    rt->get_index_space_domain(ctx,
+                               image_region.get_logical_region()
+                               .get_index_space()).get_volume();
+  if (data_size != nullptr) *data_size = region_size - sizeof(ImageHeader);
+
+  Rect<1> image_rect(Point<1>(0), Point<1>(region_size - 1));
+  return (ImageHeader*)
+    get_array_pointer(image_region.get_field_accessor(DATA_ID),
+                      image_rect,
+                      sizeof(char));
+}
+
+// Wraps the decoded image held by an image region without copying it
+Frame get_image_frame(HighLevelRuntime* rt,
+                      Context ctx,
+                      const PhysicalRegion& image_region) {
+  ImageHeader* header = get_image_header(rt, ctx, image_region);
+  Frame frame;
+  frame.width = header->width;
+  frame.height = header->height;
+  frame.channels = header->channels;
+  frame.element_size = header->element_size;
+  frame.data = (char*)(header + 1);
+  return frame;
+}
+
+// Leaves a blank frame for an image that failed to load, so later stages
+// always see a well formed header. pixels must hold image_data_size(1, 1).
+void clear_image(ImageHeader* header, char* pixels) {
+  header->width = options.fused_decode ? DECODE_TARGET_WIDTH : 1;
+  header->height = 1;
+  header->channels = IMAGE_CHANNELS;
+  header->element_size =
+    options.fused_decode ? sizeof(uint16_t) : sizeof(char);
+  header->encoded_size = 0;
+  memset(pixels, 0, header->width * header->channels * header->element_size);
+}
+
+// Marks an image region as holding no image
+void drop_image(ImageHeader* header, char* pixels) {
+  if (options.compressed_regions) {
+    // A blank frame may not fit; decoding stages check encoded_size
+    header->width = 0;
+    header->height = 0;
+    header->encoded_size = 0;
+  } else {
+    clear_image(header, pixels);
+  }
+}
+
+// Creating a decompressor allocates libjpeg's memory pools, so every thread
+// that decodes images keeps one reader and its row pointers and reuses them
+// for each image. header_mem() resets the reader, including after a failed
+// decode.
+JPEGReader& local_jpeg_reader() {
+  static thread_local JPEGReader reader;
+  return reader;
+}
+
+std::vector<uint8_t*>& local_row_pointers() {
+  static thread_local std::vector<uint8_t*> rows;
+  return rows;
+}
+
+// Decodes the JPEG in data into pixels with the scale, profile and layout
+// the options select, and describes the result in header. Throws
+// std::runtime_error if data is not a valid JPEG or needs more than capacity
+// bytes of pixels.
+void decode_image(const char* data, size_t size,
+                  ImageHeader* header, char* pixels, size_t capacity) {
+  JPEGReader& reader = local_jpeg_reader();
+  reader.header_mem((uint8_t*)data, size);
+  reader.setColorSpace(JPEG::COLOR_RGB);
+  reader.setTradeoff(options.decode_tradeoff);
+  // With -scaled-decode the IDCT skips the detail that resampling would
+  // throw away. Regions are sized for this scale from the image's size in
+  // the path region, so a frame that does not match it is dropped rather
+  // than written past the end.
+  size_t needed = image_data_size(reader.width(), reader.height());
+  reader.setScale(decode_scale(reader.width(), reader.height()));
+  if (needed > capacity) {
+    throw std::runtime_error("image larger than its listed size");
+  }
+
+  if (options.fused_decode) {
+    // Scanlines stream through the resampler, which keeps only the current
+    // source row
+    RowResampler resampler(reader.width(), DECODE_TARGET_WIDTH,
+                           (uint16_t*)pixels);
+    reader.setMaxRowPtrs(1);
+    reader.load(resampler.begin());
+    resampler.consume();
+
+    header->width = DECODE_TARGET_WIDTH;
+    header->element_size = sizeof(uint16_t);
+  } else {
+    std::vector<uint8_t*>& rows = local_row_pointers();
+    size_t row_size = reader.width() * reader.components();
+    rows.resize(reader.height());
+    for (size_t j = 0; j < reader.height(); ++j) {
+      rows[j] = (uint8_t*)(pixels + row_size * j);
+    }
+    reader.load(rows.begin());
+
+    header->width = reader.width();
+    header->element_size = sizeof(char);
+  }
+  header->height = reader.height();
+  header->channels = reader.components();
+  header->encoded_size = 0;
+}
+
+// Sets *frame to the decoded image an image region holds. With
+// -compressed-regions the region holds the JPEG instead, which is decoded
+// into memory the frame owns; *owned is set so the caller knows to delete[]
+// frame->data. Returns false if the JPEG cannot be decoded: the load task
+// only parsed its header, so a corrupt body is first noticed here.
+bool decode_image_region(HighLevelRuntime* rt,
+                         Context ctx,
+                         const PhysicalRegion& image_region,
+                         Frame* frame,
+                         bool* owned) {
+  ImageHeader* header = get_image_header(rt, ctx, image_region);
+  *owned = false;
+  if (!options.compressed_regions) {
+    *frame = get_image_frame(rt, ctx, image_region);
+    return true;
+  }
+  if (header->encoded_size == 0) return false;
+
+  ImageHeader decoded;
+  size_t capacity = image_data_size(header->width, header->height);
+  char* pixels = new char[capacity];
+  try {
+    decode_image((char*)(header + 1), header->encoded_size,
+                 &decoded, pixels, capacity);
+  } catch (const std::runtime_error& e) {
+    delete[] pixels;
+    return false;
+  }
+
+  *owned = true;
+  frame->width = decoded.width;
+  frame->height = decoded.height;
+  frame->channels = decoded.channels;
+  frame->element_size = decoded.element_size;
+  frame->data = pixels;
+  return true;
+}
+
+// Per-thread buffer for thumbnails decoded by the filter and prefilter
+std::vector<uint8_t>& local_thumbnail() {
+  static thread_local std::vector<uint8_t> thumbnail;
+  return thumbnail;
+}
+
+// Decodes the JPEG in data at an eighth of its size into thumbnail as 8-bit
+// RGB and returns a frame over it. Throws std::runtime_error if data is empty
+// or not a valid JPEG.
+Frame decode_thumbnail(const char* data, size_t size,
+                       std::vector<uint8_t>* thumbnail) {
+  if (size == 0) {
+    throw std::runtime_error("image was not loaded");
+  }
+  JPEGReader& reader = local_jpeg_reader();
+  reader.header_mem((uint8_t*)data, size);
+  reader.setColorSpace(JPEG::COLOR_RGB);
+  reader.setTradeoff(JPEG::FASTER);
+  reader.setScale(JPEG::SCALE_EIGHTH);
+
+  std::vector<uint8_t*>& rows = local_row_pointers();
+  size_t row_size = reader.width() * reader.components();
+  thumbnail->resize(row_size * reader.height());
+  rows.resize(reader.height());
+  for (size_t j = 0; j < reader.height(); ++j) {
+    rows[j] = thumbnail->data() + row_size * j;
+  }
+  reader.load(rows.begin());
+
+  Frame frame;
+  frame.width = reader.width();
+  frame.height = reader.height();
+  frame.channels = reader.components();
+  frame.element_size = sizeof(uint8_t);
+  frame.data = (char*)thumbnail->data();
+  return frame;
+}
+
+// Returns false if the DC thumbnail of the JPEG in data fails a -prefilter
+// predicate. Images the thumbnail cannot be built for are passed on to the
+// full decode, which reports anything actually wrong with them.
+bool passes_prefilter(const char* data, size_t size) {
+  if (options.prefilters.empty()) return true;
+
+  JPEGReader& reader = local_jpeg_reader();
+  std::vector<uint8_t>& thumbnail = local_thumbnail();
+  try {
+    reader.header_mem((uint8_t*)data, size);
+    reader.loadDC(thumbnail);
+  } catch (const std::runtime_error& e) {
+    return true;
+  }
+
+  Frame frame;
+  frame.width = reader.width();
+  frame.height = reader.height();
+  frame.channels = IMAGE_CHANNELS;
+  frame.element_size = sizeof(uint8_t);
+  frame.data = (char*)thumbnail.data();
+  FrameStats stats;
+  compute_frame_stats(frame, &stats);
+  return passes_filters(stats, options.prefilters.data(),
+                        options.prefilters.size());
+}
+
+// Bytes of one VEC_ID element, which depend on -feature-precision
+size_t vector_row_size() {
+  return feature_row_size(options.feature_type, VEC_DIM);
+}
+
+// Brute force KNN over every vector of the region. Distances are computed on
+// the vectors in the type they are kept in, so fp16 and int8 vectors are
+// never widened to full rows.
 void knn_task(const Task* task,
               const std::vector<PhysicalRegion>& regions,
               Context ctx,
@@ -91,16 +486,28 @@ void knn_task(const Task* task,
 
   RegionAccessor<AccessorType::Generic, void> vector_acc
     = vector_region.get_field_accessor(VEC_ID);
+  RegionAccessor<AccessorType::Generic, void> knn_acc
+    = knn_region.get_field_accessor(DATA_ID);
 
   size_t extent =
     rt->get_index_space_domain(ctx,
                                vector_region.get_logical_region()
                                .get_index_space()).get_volume();
   IndexIterator itr(rt, ctx, vector_region.get_logical_region());
-  char* filter_ptr =
-    get_array_pointer(vector_acc, itr.next(), extent, VEC_DIM * sizeof(float));
+  char* vector_ptr =
+    get_array_pointer(vector_acc, itr.next(), extent, vector_row_size());
+  IndexIterator knn_itr(rt, ctx, knn_region.get_logical_region());
+  char* knn_ptr = get_array_pointer(knn_acc, knn_itr.next(), extent, KNN_SIZE);
+
+  for (size_t i = 0; i < extent; ++i) {
+    float* distances = (float*)(knn_ptr + i * KNN_SIZE);
+    int* indices = (int*)(distances + K);
+    nearest_rows(options.feature_type, VEC_DIM, vector_ptr, extent, i, K,
+                 distances, indices);
+  }
 
-  printf("hi %e\n", vec_sum((float*)filter_ptr, VEC_DIM));
+  printf("knn over %lu %s vectors\n", extent,
+         feature_type_name(options.feature_type));
   fflush(stdout);
 }
 
@@ -125,11 +532,11 @@ void compact_task(const Task* task,
     get_array_pointer(filtered_vector_acc,
                       itr.next(),
                       extent,
-                      VEC_DIM * sizeof(float));
+                      vector_row_size());
 
   IndexIterator dense_itr(rt, ctx, dense_vector_region.get_logical_region());
   dense_vector_acc.write_untyped(dense_itr.next(),
-                                 filter_ptr, VEC_DIM * sizeof(float));
+                                 filter_ptr, vector_row_size());
 }
 
 IndexPartition
@@ -151,8 +558,58 @@ repartition_task(const Task* task,
 
 struct FeatureArgs {
   int batch_size;
+  // Feature store run id, see new_feature_run
+  uint32_t run;
 };
 
+// Adds the batch's vectors to the feature store as one segment. Frames that
+// failed to load are left out, so a later run tries them again. dup_slots
+// holds the batch position of the kept frame each near-duplicate was dropped
+// for, or -1.
+void store_features(HighLevelRuntime* rt,
+                    Context ctx,
+                    const PhysicalRegion& path_region,
+                    const PhysicalRegion& heap_region,
+                    unsigned loaded_mask,
+                    unsigned passed_mask,
+                    const std::vector<int>& dup_slots,
+                    const char* vectors,
+                    uint32_t run) {
+  RegionAccessor<AccessorType::Generic, PathRef> path_acc =
+    path_region.get_field_accessor(PATH_ID).typeify<PathRef>();
+  RegionAccessor<AccessorType::Generic, uint64_t> hash_acc =
+    path_region.get_field_accessor(HASH_ID).typeify<uint64_t>();
+  PathHeap heap(rt, ctx, heap_region);
+
+  FeatureSegmentWriter segment(options.feature_type, VEC_DIM, run);
+  // Record of each batch position, so duplicates can name their kept frame
+  std::vector<int> records(dup_slots.size(), -1);
+  IndexSpace path_is = path_region.get_logical_region().get_index_space();
+  int i = 0;
+  for (Realm::Domain::DomainPointIterator
+         itr(rt->get_index_space_domain(ctx, path_is));
+       itr;
+       itr++, i++) {
+    if (!(loaded_mask & (1u << i))) continue;
+    const char* vector = nullptr;
+    if (passed_mask & (1u << i)) {
+      vector = vectors + i * vector_row_size();
+    }
+    int dup_of = dup_slots[i] >= 0 ? records[dup_slots[i]] : -1;
+    records[i] = segment.add(heap.get(path_acc.read(itr.p)).str(),
+                             hash_acc.read(itr.p), vector, dup_of);
+  }
+  write_feature_segment(options.feature_store, segment);
+}
+
+// Regions:
+//   0: vector batch subregion, VEC_ID
+//   1: the same subregion, FILTER_ID and DUP_OF_ID
+//   2: path batch subregion, PATH_ID and HASH_ID
+//   3: path heap subregion of the batch
+//   4...: one image region per frame of the batch
+// Futures: the load mask, then the filter's passed mask. Frames that pass the
+// filters but fail to decode are marked FILTER_REJECTED here.
 void feature_task(const Task* task,
                   const std::vector<PhysicalRegion>& regions,
                   Context ctx,
@@ -161,21 +618,33 @@ void feature_task(const Task* task,
 
   PhysicalRegion vector_region = regions[0];
 
+  // Frames the filter task dropped are neither decoded nor run through the
+  // network. to_conv_patch resamples from whatever size each image was
+  // decoded at.
+  unsigned loaded_mask = task->futures[0].get_result<unsigned>();
+  unsigned passed_mask = task->futures[1].get_result<unsigned>();
+  RegionAccessor<AccessorType::Generic, int> filter_acc =
+    regions[1].get_field_accessor(FILTER_ID).typeify<int>();
+  std::vector<ptr_t> points;
+  for (IndexIterator itr(rt, ctx, task->regions[1].region); itr.has_next();) {
+    points.push_back(itr.next());
+  }
+
   std::vector<Frame> frames;
+  std::vector<int> frame_slots;
+  std::vector<char*> decoded;
   for (int i = 0; i < args->batch_size; ++i) {
-    PhysicalRegion image_region = regions[i+1];
-    char* image_ptr =
-      get_image_pointer(image_region.get_field_accessor(DATA_ID),
-                        IMAGE_WIDTH,
-                        IMAGE_HEIGHT,
-                        IMAGE_CHANNELS);
+    if (!(passed_mask & (1u << i))) continue;
     Frame frame;
-    frame.width = IMAGE_WIDTH;
-    frame.height = IMAGE_HEIGHT;
-    frame.channels = IMAGE_CHANNELS;
-    frame.element_size = sizeof(char);
-    frame.data = image_ptr;
+    bool owned;
+    if (!decode_image_region(rt, ctx, regions[i+4], &frame, &owned)) {
+      filter_acc.write(points[i], FILTER_REJECTED);
+      passed_mask &= ~(1u << i);
+      continue;
+    }
     frames.push_back(frame);
+    frame_slots.push_back(i);
+    if (owned) decoded.push_back(frame.data);
   }
 
   //
@@ -187,85 +656,417 @@ void feature_task(const Task* task,
                                .get_index_space()).get_volume();
   IndexIterator itr(rt, ctx, vector_region.get_logical_region());
   char* vector_ptr =
-    get_array_pointer(vector_acc, itr.next(), extent, VEC_DIM * sizeof(float));
+    get_array_pointer(vector_acc, itr.next(), extent, vector_row_size());
   //
 
-  map_pool5_features(frames, vector_ptr);
+  // Vectors are converted to -feature-precision as they leave the network
+  const size_t vector_size = vector_row_size();
+  if (frames.size() == (size_t)args->batch_size) {
+    map_pool5_features(frames, vector_ptr, options.feature_type);
+  } else {
+    // Vectors of dropped frames are left zero
+    memset(vector_ptr, 0, args->batch_size * vector_size);
+    if (!frames.empty()) {
+      std::vector<char> features(frames.size() * vector_size);
+      map_pool5_features(frames, features.data(), options.feature_type);
+      for (size_t j = 0; j < frames.size(); ++j) {
+        memcpy(vector_ptr + frame_slots[j] * vector_size,
+               features.data() + j * vector_size, vector_size);
+      }
+    }
+  }
+
+  for (char* pixels : decoded) {
+    delete[] pixels;
+  }
+
+  if (!options.feature_store.empty()) {
+    // The filter task names kept frames by their point in the vector region
+    RegionAccessor<AccessorType::Generic, int> dup_of_acc =
+      regions[1].get_field_accessor(DUP_OF_ID).typeify<int>();
+    std::vector<int> dup_slots(points.size(), -1);
+    for (size_t i = 0; i < points.size(); ++i) {
+      int dup_of = dup_of_acc.read(points[i]);
+      for (size_t j = 0; j < i && dup_of >= 0; ++j) {
+        if (points[j].value == dup_of) dup_slots[i] = j;
+      }
+    }
+    store_features(rt, ctx, regions[2], regions[3], loaded_mask, passed_mask,
+                   dup_slots, vector_ptr, args->run);
+  }
 }
 
-bool filter_task(const Task* task,
-                 const std::vector<PhysicalRegion>& regions,
-                 Context ctx,
-                 HighLevelRuntime* rt) {
-  LogicalRegion vector_logical_region = task->regions[1].region;
-  PhysicalRegion image_region = regions[0];
-  PhysicalRegion vector_region = regions[1];
-
-  char* image_ptr = get_image_pointer(image_region.get_field_accessor(DATA_ID),
-                                      IMAGE_WIDTH,
-                                      IMAGE_HEIGHT,
-                                      IMAGE_CHANNELS);
+struct FilterArgs {
+  int batch_size;
+  int predicate_count;
+  FilterPredicate predicates[MAX_FILTER_PREDICATES];
+  // Largest perceptual hash distance at which a frame is a near-duplicate of
+  // an earlier one, or -1 to keep duplicates
+  int dedup_distance;
+  // Earlier kept frames of the same sequence each frame is compared against
+  int dedup_window;
+};
+
+// Frames of one capture are named <sequence>_frame<number>, so everything
+// before the last "_frame" identifies the sequence. Paths without it are
+// their own sequence.
+StringRef sequence_key(const StringRef& path) {
+  const char tag[] = "_frame";
+  const char* end = path.data + path.size;
+  const char* frame = std::find_end(path.data, end, tag, tag + sizeof(tag) - 1);
+  return StringRef(path.data, frame - path.data);
+}
+
+// Evaluates the launch's predicates over every image of a load batch, then
+// drops frames that are near-duplicates of a recent kept frame of the same
+// sequence, and records the result in FILTER_ID and DUP_OF_ID. Batches hold
+// consecutive manifest entries, so runs of frames from one capture are
+// compared within a batch; the first frame of each batch is always kept.
+// Measures and hashes are taken from each image's eighth-scale thumbnail
+// whatever the decode options, so thresholds mean the same in every mode and
+// match -prefilter's. Returns a mask with bit i set if image i passed, so the
+// feature task can skip the rest.
+unsigned filter_task(const Task* task,
+                     const std::vector<PhysicalRegion>& regions,
+                     Context ctx,
+                     HighLevelRuntime* rt) {
+  FilterArgs* args = (FilterArgs*)task->args;
+
+  LogicalRegion vector_logical_region = task->regions[0].region;
+  PhysicalRegion vector_region = regions[0];
+  PhysicalRegion path_region = regions[1];
+  PhysicalRegion heap_region = regions[2];
+
   RegionAccessor<AccessorType::Generic, int> filter_acc =
     vector_region.get_field_accessor(FILTER_ID).typeify<int>();
+  RegionAccessor<AccessorType::Generic, int> dup_of_acc =
+    vector_region.get_field_accessor(DUP_OF_ID).typeify<int>();
+  std::vector<ptr_t> points;
+  for (IndexIterator itr(rt, ctx, vector_logical_region); itr.has_next();) {
+    points.push_back(itr.next());
+  }
 
-  // Filter by checking first bit of image
-  IndexIterator itr(rt, ctx, vector_logical_region);
-  if (*image_ptr % 2 == 0) {
-    filter_acc.write(itr.next(), 0);
-    return true;
-  } else {
-    filter_acc.write(itr.next(), -1);
-    return false;
+  // Source sizes, which the thumbnails are scaled from. Frames are numbered
+  // by the first frame of the batch from their sequence.
+  bool dedup = args->dedup_distance >= 0;
+  std::vector<int> widths;
+  std::vector<int> heights;
+  std::vector<int> sequences;
+  {
+    std::vector<StringRef> keys;
+    IndexSpace path_is = path_region.get_logical_region().get_index_space();
+    RegionAccessor<AccessorType::Generic, PathRef> path_acc =
+      path_region.get_field_accessor(PATH_ID).typeify<PathRef>();
+    RegionAccessor<AccessorType::Generic, int> width_acc =
+      path_region.get_field_accessor(WIDTH_ID).typeify<int>();
+    RegionAccessor<AccessorType::Generic, int> height_acc =
+      path_region.get_field_accessor(HEIGHT_ID).typeify<int>();
+    PathHeap heap(rt, ctx, heap_region);
+    for (Realm::Domain::DomainPointIterator
+           itr(rt->get_index_space_domain(ctx, path_is));
+         itr;
+         itr++) {
+      widths.push_back(width_acc.read(itr.p));
+      heights.push_back(height_acc.read(itr.p));
+      if (!dedup) continue;
+      keys.push_back(sequence_key(heap.get(path_acc.read(itr.p))));
+      int first = std::find(keys.begin(), keys.end(), keys.back()) -
+        keys.begin();
+      sequences.push_back(first);
+    }
+  }
+
+  // Images the load task could not read or decode never pass
+  unsigned loaded_mask = task->futures[0].get_result<unsigned>();
+
+  // Kept frames are identified by their batch position
+  DuplicateTracker duplicates(args->dedup_distance, args->dedup_window);
+
+  unsigned passed_mask = 0;
+  for (int i = 0; i < args->batch_size; ++i) {
+    int result = (loaded_mask & (1u << i)) ? FILTER_PASSED : FILTER_REJECTED;
+    int dup_of = -1;
+    if (result == FILTER_PASSED && (args->predicate_count > 0 || dedup)) {
+      PhysicalRegion image_region = regions[i+3];
+      Frame frame;
+      if (options.compressed_regions) {
+        // Only a thumbnail is decoded here; the feature task decodes the
+        // image at full size next to the network
+        ImageHeader* header = get_image_header(rt, ctx, image_region);
+        try {
+          frame = decode_thumbnail((char*)(header + 1), header->encoded_size,
+                                   &local_thumbnail());
+        } catch (const std::runtime_error& e) {
+          result = FILTER_REJECTED;
+        }
+      } else {
+        frame = eighth_scale_frame(get_image_frame(rt, ctx, image_region),
+                                   widths[i], heights[i], &local_thumbnail());
+      }
+
+      if (result == FILTER_PASSED && args->predicate_count > 0) {
+        FrameStats stats;
+        compute_frame_stats(frame, &stats);
+        if (!passes_filters(stats, args->predicates, args->predicate_count)) {
+          result = FILTER_REJECTED;
+        }
+      }
+
+      if (result == FILTER_PASSED && dedup) {
+        int match =
+          duplicates.check(sequences[i], perceptual_hash(frame), i);
+        if (match >= 0) {
+          result = FILTER_DUPLICATE;
+          dup_of = points[match].value;
+        }
+      }
+    }
+
+    filter_acc.write(points[i], result);
+    dup_of_acc.write(points[i], dup_of);
+    if (result == FILTER_PASSED) passed_mask |= 1u << i;
   }
+  return passed_mask;
 }
 
-void load_task(const Task* task,
-               const std::vector<PhysicalRegion>& regions,
-               Context ctx,
-               HighLevelRuntime* rt) {
-  PhysicalRegion path_region = regions[0];
-  PhysicalRegion image_region = regions[1];
+struct LoadArgs {
+  int batch_size;
+};
 
-  IndexSpace path_is = path_region.get_logical_region().get_index_space();
-  Realm::Domain::DomainPointIterator itr
-    (rt->get_index_space_domain(ctx, path_is));
+// Reads the source size of each of uris from the start of the object. The
+// first PROBE_PREFIX_SIZE bytes are read, and the read is doubled for every
+// JPEG whose frame header lies further in, until the header is found or the
+// object ends. Sizes of objects that cannot be read or parsed are left 0x0.
+void probe_jpeg_sizes(const std::vector<std::string>& uris,
+                      std::vector<int>* widths,
+                      std::vector<int>* heights) {
+  widths->assign(uris.size(), 0);
+  heights->assign(uris.size(), 0);
+  std::vector<std::string> prefixes(uris.size());
+  std::vector<size_t> pending(uris.size());
+  for (size_t i = 0; i < pending.size(); ++i) {
+    pending[i] = i;
+  }
+  while (!pending.empty()) {
+    std::vector<std::string> pending_uris;
+    std::vector<size_t> offsets;
+    std::vector<size_t> lengths;
+    for (size_t i : pending) {
+      size_t offset = prefixes[i].size();
+      pending_uris.push_back(uris[i]);
+      offsets.push_back(offset);
+      lengths.push_back(offset == 0 ? PROBE_PREFIX_SIZE : offset);
+    }
+    std::vector<char*> buffers;
+    std::vector<size_t> sizes;
+    read_object_ranges(pending_uris, offsets, lengths, buffers, sizes);
+
+    std::vector<size_t> next;
+    for (size_t j = 0; j < pending.size(); ++j) {
+      size_t i = pending[j];
+      if (buffers[j] == nullptr) {
+        fprintf(stderr, "Cannot probe %s\n", uris[i].c_str());
+        continue;
+      }
+      prefixes[i].append(buffers[j], sizes[j]);
+      free(buffers[j]);
+      if (read_jpeg_size(prefixes[i].data(), prefixes[i].size(),
+                         &(*widths)[i], &(*heights)[i])) {
+        prefixes[i].clear();
+        continue;
+      }
+      (*widths)[i] = 0;
+      (*heights)[i] = 0;
+      if (sizes[j] == lengths[j]) {
+        next.push_back(i);
+      } else {
+        fprintf(stderr, "Cannot probe %s: no JPEG frame header\n",
+                uris[i].c_str());
+      }
+    }
+    pending.swap(next);
+  }
+}
 
-  StringAccessor path_acc = path_region.get_field_accessor(PATH_ID);
-  std::string path =
-    read_string<PATH_SIZE>(path_acc, itr.p);
+// Fills in the source size of every image the manifest gave no size for by
+// parsing its JPEG header, and with -compressed-regions its encoded length.
+// When only the size is missing, loose objects are probed by reading a
+// prefix. Frames in shards, prefiltered runs and encoded lengths need the
+// whole JPEG, which is then read in full, so with -cache-dir the load task's
+// later read of the same image is served locally. Images that cannot be
+// read, or that the prefilter rejects, are left at 0x0 so they get the
+// smallest region and are never fetched again.
+void probe_task(const Task* task,
+                const std::vector<PhysicalRegion>& regions,
+                Context ctx,
+                HighLevelRuntime* rt) {
+  PhysicalRegion path_region = regions[0];
+  PathHeap heap(rt, ctx, regions[1]);
 
-  FILE* fp = read_gcs_file(gcs_key, gcs_bucket, path);
+  IndexSpace path_is = path_region.get_logical_region().get_index_space();
+  RegionAccessor<AccessorType::Generic, PathRef> path_acc =
+    path_region.get_field_accessor(PATH_ID).typeify<PathRef>();
+  RegionAccessor<AccessorType::Generic, int> width_acc =
+    path_region.get_field_accessor(WIDTH_ID).typeify<int>();
+  RegionAccessor<AccessorType::Generic, int> height_acc =
+    path_region.get_field_accessor(HEIGHT_ID).typeify<int>();
+  RegionAccessor<AccessorType::Generic, int> bytes_acc =
+    path_region.get_field_accessor(BYTES_ID).typeify<int>();
+
+  // Images whose whole JPEG is needed, and those probed by a prefix
+  std::vector<DomainPoint> points;
+  std::vector<std::string> paths;
+  std::vector<DomainPoint> header_points;
+  std::vector<std::string> header_paths;
+  for (Realm::Domain::DomainPointIterator
+         itr(rt->get_index_space_domain(ctx, path_is));
+       itr;
+       itr++) {
+    bool sized = width_acc.read(itr.p) > 0 && height_acc.read(itr.p) > 0;
+    bool need_bytes = options.compressed_regions && bytes_acc.read(itr.p) == 0;
+    if (sized && !need_bytes) continue;
+    std::string path = heap.get(path_acc.read(itr.p)).str();
+    std::string shard_uri;
+    int index;
+    if (!need_bytes && options.prefilters.empty() &&
+        !parse_shard_uri(path, &shard_uri, &index)) {
+      header_points.push_back(itr.p);
+      header_paths.push_back(path);
+    } else {
+      points.push_back(itr.p);
+      paths.push_back(path);
+    }
+  }
 
-  // Read image from GCS
-  std::vector<char> input;
-  {
-    input.resize(1024);
-    size_t size_before = 0;
-    while (true) {
-      size_t num_read = fread(input.data() + size_before, 1, 1024, fp);
-      if (num_read != 1024) {
-        input.resize(size_before + num_read);
-        break;
+  if (!header_paths.empty()) {
+    std::vector<int> widths;
+    std::vector<int> heights;
+    probe_jpeg_sizes(header_paths, &widths, &heights);
+    for (size_t i = 0; i < header_paths.size(); ++i) {
+      width_acc.write(header_points[i], widths[i]);
+      height_acc.write(header_points[i], heights[i]);
+    }
+  }
+  if (paths.empty()) return;
+
+  FrameBatch inputs;
+  inputs.read(paths);
+
+  JPEGReader& reader = local_jpeg_reader();
+  for (size_t i = 0; i < paths.size(); ++i) {
+    int width = 0;
+    int height = 0;
+    int bytes = 0;
+    if (inputs.data(i) != nullptr) {
+      try {
+        reader.header_mem((uint8_t*)inputs.data(i), inputs.size(i));
+        width = reader.width();
+        height = reader.height();
+        bytes = inputs.size(i);
+        if (!passes_prefilter(inputs.data(i), inputs.size(i))) {
+          width = 0;
+          height = 0;
+          bytes = 0;
+        }
+      } catch (const std::runtime_error& e) {
+        fprintf(stderr, "Cannot probe %s: %s\n", paths[i].c_str(), e.what());
       }
-      size_before = input.size();
-      input.resize(input.size() + 1024);
     }
+    width_acc.write(points[i], width);
+    height_acc.write(points[i], height);
+    bytes_acc.write(points[i], bytes);
   }
-  fclose(fp);
+}
 
-  char* image_ptr = get_image_pointer(image_region.get_field_accessor(DATA_ID),
-                                      IMAGE_WIDTH,
-                                      IMAGE_HEIGHT,
-                                      IMAGE_CHANNELS);
+// Returns a mask with bit i set if image i of the batch was loaded. Images
+// that could not be read or decoded are skipped so the rest of the batch
+// still proceeds.
+unsigned load_task(const Task* task,
+                   const std::vector<PhysicalRegion>& regions,
+                   Context ctx,
+                   HighLevelRuntime* rt) {
+  LoadArgs* args = (LoadArgs*)task->args;
 
-  // Decode image into raw data
-  JPEGReader reader;
-  reader.header_mem((uint8_t*)input.data(), input.size());
-  std::vector<uint8_t*> rows(reader.height(), NULL);
-  for (size_t i = 0; i < reader.height(); ++i) {
-    rows[i] = (uint8_t*)(image_ptr + IMAGE_WIDTH * IMAGE_CHANNELS * i);
+  PhysicalRegion path_region = regions[0];
+  PathHeap heap(rt, ctx, regions[1]);
+
+  IndexSpace path_is = path_region.get_logical_region().get_index_space();
+  RegionAccessor<AccessorType::Generic, PathRef> path_acc =
+    path_region.get_field_accessor(PATH_ID).typeify<PathRef>();
+  RegionAccessor<AccessorType::Generic, int> width_acc =
+    path_region.get_field_accessor(WIDTH_ID).typeify<int>();
+  RegionAccessor<AccessorType::Generic, int> height_acc =
+    path_region.get_field_accessor(HEIGHT_ID).typeify<int>();
+  std::vector<std::string> paths;
+  // Images listed as 0x0 were found unreadable or rejected by the prefilter
+  // when probed, so they are not fetched again
+  std::vector<bool> listed;
+  for (Realm::Domain::DomainPointIterator
+         itr(rt->get_index_space_domain(ctx, path_is));
+       itr;
+       itr++) {
+    paths.push_back(heap.get(path_acc.read(itr.p)).str());
+    listed.push_back(width_acc.read(itr.p) > 0 && height_acc.read(itr.p) > 0);
   }
-  reader.load(rows.begin());
+  assert(paths.size() == (size_t)args->batch_size);
+
+  // Read the whole batch; frames packed in shards are decoded in place
+  std::vector<std::string> fetch_paths;
+  std::vector<int> fetch_index(paths.size(), -1);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!listed[i]) continue;
+    fetch_index[i] = fetch_paths.size();
+    fetch_paths.push_back(paths[i]);
+  }
+  FrameBatch inputs;
+  inputs.read(fetch_paths);
+
+  unsigned loaded_mask = 0;
+  for (int i = 0; i < args->batch_size; ++i) {
+    size_t capacity;
+    ImageHeader* header = get_image_header(rt, ctx, regions[i+2], &capacity);
+    char* image_ptr = (char*)(header + 1);
+
+    if (fetch_index[i] < 0) {
+      drop_image(header, image_ptr);
+      continue;
+    }
+    const char* data = inputs.data(fetch_index[i]);
+    size_t size = inputs.size(fetch_index[i]);
+
+    try {
+      if (data == nullptr) {
+        throw std::runtime_error("could not be read");
+      }
+      // Frames the prefilter rejects are dropped before the full decode
+      if (!passes_prefilter(data, size)) {
+        drop_image(header, image_ptr);
+        continue;
+      }
+      if (options.compressed_regions) {
+        // Check the header so a corrupt image is dropped here rather than
+        // on every stage that decodes it
+        JPEGReader& reader = local_jpeg_reader();
+        reader.header_mem((uint8_t*)data, size);
+        if (size > capacity) {
+          throw std::runtime_error("image larger than its listed size");
+        }
+        memcpy(image_ptr, data, size);
+        header->width = reader.width();
+        header->height = reader.height();
+        header->channels = IMAGE_CHANNELS;
+        header->element_size = sizeof(char);
+        header->encoded_size = size;
+      } else {
+        decode_image(data, size, header, image_ptr, capacity);
+      }
+      loaded_mask |= 1u << i;
+    } catch (const std::runtime_error& e) {
+      fprintf(stderr, "Skipping %s: %s\n", paths[i].c_str(), e.what());
+      drop_image(header, image_ptr);
+    }
+  }
+  return loaded_mask;
 }
 
 
@@ -276,52 +1077,75 @@ void inner_task(const Task* task,
   LogicalRegion path_logical_region = task->regions[0].region;
   LogicalRegion vector_filter_logical_region = task->regions[1].region;
   LogicalRegion vector_data_logical_region = task->regions[2].region;
+  LogicalRegion heap_logical_region = task->regions[3].region;
+  // Feature store run id, passed on to the feature tasks
+  uint32_t run = *(uint32_t*)task->args;
 
   IndexSpace path_is = path_logical_region.get_index_space();
   IndexSpace vector_is = vector_filter_logical_region.get_index_space();
 
-  const int BATCH_SIZE = 32;
+  // Source image sizes, in path order, to size each image region exactly
+  std::vector<size_t> image_sizes;
+  std::vector<PathRef> path_refs;
+  {
+    PhysicalRegion path_region = regions[0];
+    RegionAccessor<AccessorType::Generic, PathRef> path_acc =
+      path_region.get_field_accessor(PATH_ID).typeify<PathRef>();
+    RegionAccessor<AccessorType::Generic, int> width_acc =
+      path_region.get_field_accessor(WIDTH_ID).typeify<int>();
+    RegionAccessor<AccessorType::Generic, int> height_acc =
+      path_region.get_field_accessor(HEIGHT_ID).typeify<int>();
+    RegionAccessor<AccessorType::Generic, int> bytes_acc =
+      path_region.get_field_accessor(BYTES_ID).typeify<int>();
+    for (Realm::Domain::DomainPointIterator
+           itr(rt->get_index_space_domain(ctx, path_is));
+         itr;
+         itr++) {
+      path_refs.push_back(path_acc.read(itr.p));
+      image_sizes.push_back(sizeof(ImageHeader) +
+                            image_region_size(width_acc.read(itr.p),
+                                              height_acc.read(itr.p),
+                                              bytes_acc.read(itr.p)));
+    }
+  }
 
-  // Partition into sub regions of size 1
-  Domain path_even_domain =
-    Domain::from_rect<1>
-    (Rect<1>(Point<1>(0),
-             Point<1>(rt->get_index_space_domain(ctx, path_is)
-                      .get_volume() - 1)));
   Domain vector_even_domain =
     Domain::from_rect<1>
     (Rect<1>(Point<1>(0),
              Point<1>(rt->get_index_space_domain(ctx, vector_is)
                       .get_volume() - 1)));
-  printf("path partition\n");
-  IndexPartition path_even_partition =
-    create_even_partition(rt, ctx, path_is, path_even_domain);
-  printf("vector partition\n");
-  IndexPartition vector_even_partition =
-    create_even_partition(rt, ctx, vector_is, vector_even_domain);
-
-  LogicalPartition path_even_filter_partition =
-    rt->get_logical_partition(ctx, path_logical_region,
-                              path_even_partition);
-  LogicalPartition vector_even_filter_partition =
-    rt->get_logical_partition(ctx, vector_filter_logical_region,
-                              vector_even_partition);
 
   // Partition into batched sub regions
   Domain batched_domain;
   IndexPartition vector_batched_partition =
     create_batched_partition(rt, ctx, vector_is, BATCH_SIZE, batched_domain);
+  printf("path partition\n");
+  Domain path_batched_domain;
+  IndexPartition path_batched_partition =
+    create_batched_partition(rt, ctx, path_is, BATCH_SIZE,
+                             path_batched_domain);
 
-  // LogicalPartition batched_filter_partition =
-  //   rt->get_logical_partition(ctx, vector_filter_logical_region,
-  //                             vector_batched_partition);
+  IndexPartition heap_batched_partition =
+    create_heap_partition(rt, ctx, heap_logical_region.get_index_space(),
+                          path_is, path_batched_partition,
+                          path_batched_domain, path_refs);
+
+  LogicalPartition path_batched_load_partition =
+    rt->get_logical_partition(ctx, path_logical_region,
+                              path_batched_partition);
+  LogicalPartition heap_batched_load_partition =
+    rt->get_logical_partition(ctx, heap_logical_region,
+                              heap_batched_partition);
+  LogicalPartition batched_filter_partition =
+    rt->get_logical_partition(ctx, vector_filter_logical_region,
+                              vector_batched_partition);
   LogicalPartition batched_data_partition =
     rt->get_logical_partition(ctx, vector_data_logical_region,
                               vector_batched_partition);
 
 
-  Realm::Domain::DomainPointIterator path_itr(path_even_domain);
   Realm::Domain::DomainPointIterator even_itr(vector_even_domain);
+  size_t image_index = 0;
   for (Realm::Domain::DomainPointIterator batched_itr(batched_domain);
        batched_itr;
        batched_itr++) {
@@ -329,14 +1153,11 @@ void inner_task(const Task* task,
     std::vector<LogicalRegion> images;
     for (current_batch_size = 0; current_batch_size < BATCH_SIZE;
          current_batch_size++) {
-      if (!even_itr || !path_itr) break;
-
-      // We could create these at the top level once because we are working with
-      // images all of the same size but we might want to work with images of
-      // multiple sizes
-      Rect<1> image_rect(Point<1>(0), Point<1>(IMAGE_WIDTH *
-                                               IMAGE_HEIGHT *
-                                               IMAGE_CHANNELS));
+      if (!even_itr) break;
+
+      // Each region holds exactly one image of its listed size
+      Rect<1> image_rect(Point<1>(0),
+                         Point<1>(image_sizes[image_index++] - 1));
       IndexSpace image_is =
         rt->create_index_space(ctx, Domain::from_rect<1>(image_rect));
 
@@ -350,50 +1171,89 @@ void inner_task(const Task* task,
         rt->create_logical_region(ctx, image_is, image_fs);
       images.push_back(image_region);
 
-      //////////////////////////////////////////////////////////////////////////
-      /// Load image
-      LogicalRegion path_filter_subregion =
-        rt->get_logical_subregion_by_color(ctx, path_even_filter_partition,
-                                           path_itr.p);
+      even_itr++;
+    }
 
-      TaskLauncher load_launcher(LOAD_TASK_ID, TaskArgument());
-      load_launcher.add_region_requirement
-        (RegionRequirement(path_filter_subregion, READ_ONLY, EXCLUSIVE,
-                           path_logical_region));
-      load_launcher.add_field(0, PATH_ID);
+    ///////////////////////////////////////////////////////////////////////////
+    /// Load the batch of images
+    LogicalRegion path_batch_subregion =
+      rt->get_logical_subregion_by_color(ctx, path_batched_load_partition,
+                                         batched_itr.p);
+    LogicalRegion heap_batch_subregion =
+      rt->get_logical_subregion_by_color(ctx, heap_batched_load_partition,
+                                         batched_itr.p);
+
+    LoadArgs load_args;
+    load_args.batch_size = current_batch_size;
+    TaskLauncher load_launcher(LOAD_TASK_ID,
+                               TaskArgument(&load_args, sizeof(load_args)));
+    load_launcher.add_region_requirement
+      (RegionRequirement(path_batch_subregion, READ_ONLY, EXCLUSIVE,
+                         path_logical_region));
+    load_launcher.add_field(0, PATH_ID);
+    load_launcher.add_field(0, WIDTH_ID);
+    load_launcher.add_field(0, HEIGHT_ID);
+    load_launcher.add_region_requirement
+      (RegionRequirement(heap_batch_subregion, READ_ONLY, EXCLUSIVE,
+                         heap_logical_region));
+    load_launcher.add_field(1, PATH_CHARS_ID);
+
+    for (size_t i = 0; i < images.size(); ++i) {
+      LogicalRegion image_region = images[i];
 
       load_launcher.add_region_requirement
         (RegionRequirement(image_region, WRITE_ONLY, EXCLUSIVE, image_region));
-      load_launcher.add_field(1, DATA_ID);
-
-      rt->execute_task(ctx, load_launcher);
+      load_launcher.add_field(i + 2, DATA_ID);
+    }
 
-      //////////////////////////////////////////////////////////////////////////
-      /// Check if image passes filter
-      LogicalRegion vector_filter_subregion =
-        rt->get_logical_subregion_by_color(ctx, vector_even_filter_partition,
-                                           even_itr.p);
+    Future loaded = rt->execute_task(ctx, load_launcher);
 
-      TaskLauncher filter_launcher(FILTER_TASK_ID, TaskArgument());
-      filter_launcher.add_region_requirement
-        (RegionRequirement(image_region, READ_ONLY, EXCLUSIVE, image_region));
-      filter_launcher.add_field(0, DATA_ID);
+    ///////////////////////////////////////////////////////////////////////////
+    /// Check which images pass the filters
+    LogicalRegion vector_filter_subregion =
+      rt->get_logical_subregion_by_color(ctx, batched_filter_partition,
+                                         batched_itr.p);
 
-      filter_launcher.add_region_requirement
-        (RegionRequirement(vector_filter_subregion,
-                           WRITE_ONLY,
-                           EXCLUSIVE,
-                           vector_filter_logical_region));
-      filter_launcher.add_field(1, FILTER_ID);
+    FilterArgs filter_args;
+    filter_args.batch_size = current_batch_size;
+    filter_args.predicate_count = options.filters.size();
+    std::copy(options.filters.begin(), options.filters.end(),
+              filter_args.predicates);
+    filter_args.dedup_distance = options.dedup_distance;
+    filter_args.dedup_window = options.dedup_window;
+    TaskLauncher filter_launcher(FILTER_TASK_ID,
+                                 TaskArgument(&filter_args,
+                                              sizeof(filter_args)));
+    filter_launcher.add_future(loaded);
+    filter_launcher.add_region_requirement
+      (RegionRequirement(vector_filter_subregion,
+                         WRITE_ONLY,
+                         EXCLUSIVE,
+                         vector_filter_logical_region));
+    filter_launcher.add_field(0, FILTER_ID);
+    filter_launcher.add_field(0, DUP_OF_ID);
+
+    filter_launcher.add_region_requirement
+      (RegionRequirement(path_batch_subregion, READ_ONLY, EXCLUSIVE,
+                         path_logical_region));
+    filter_launcher.add_field(1, PATH_ID);
+    filter_launcher.add_field(1, WIDTH_ID);
+    filter_launcher.add_field(1, HEIGHT_ID);
+    filter_launcher.add_region_requirement
+      (RegionRequirement(heap_batch_subregion, READ_ONLY, EXCLUSIVE,
+                         heap_logical_region));
+    filter_launcher.add_field(2, PATH_CHARS_ID);
 
-      rt->execute_task(ctx, filter_launcher);
-      //Future f = rt->execute_task(ctx, filter_launcher);
-      //Predicate filter_result = rt->create_predicate(ctx, f);
+    for (size_t i = 0; i < images.size(); ++i) {
+      LogicalRegion image_region = images[i];
 
-      even_itr++;
-      path_itr++;
+      filter_launcher.add_region_requirement
+        (RegionRequirement(image_region, READ_ONLY, EXCLUSIVE, image_region));
+      filter_launcher.add_field(i + 3, DATA_ID);
     }
 
+    Future passed = rt->execute_task(ctx, filter_launcher);
+
     ///////////////////////////////////////////////////////////////////////////
     /// Compute feature vector from image
     LogicalRegion vector_data_subregion =
@@ -402,8 +1262,11 @@ void inner_task(const Task* task,
 
     FeatureArgs args;
     args.batch_size = current_batch_size;
+    args.run = run;
     TaskLauncher vector_launcher(FEATURE_TASK_ID,
                                  TaskArgument(&args, sizeof(args)));
+    vector_launcher.add_future(loaded);
+    vector_launcher.add_future(passed);
 
     vector_launcher.add_region_requirement
       (RegionRequirement(vector_data_subregion,
@@ -411,13 +1274,32 @@ void inner_task(const Task* task,
                          EXCLUSIVE,
                          vector_data_logical_region));
     vector_launcher.add_field(0, VEC_ID);
+    // Frames whose JPEG turns out to be corrupt are rejected after the fact
+    vector_launcher.add_region_requirement
+      (RegionRequirement(vector_filter_subregion,
+                         READ_WRITE,
+                         EXCLUSIVE,
+                         vector_filter_logical_region));
+    vector_launcher.add_field(1, FILTER_ID);
+    // Read to record near-duplicates in the feature store
+    vector_launcher.add_field(1, DUP_OF_ID);
+
+    vector_launcher.add_region_requirement
+      (RegionRequirement(path_batch_subregion, READ_ONLY, EXCLUSIVE,
+                         path_logical_region));
+    vector_launcher.add_field(2, PATH_ID);
+    vector_launcher.add_field(2, HASH_ID);
+    vector_launcher.add_region_requirement
+      (RegionRequirement(heap_batch_subregion, READ_ONLY, EXCLUSIVE,
+                         heap_logical_region));
+    vector_launcher.add_field(3, PATH_CHARS_ID);
 
     for (size_t i = 0; i < images.size(); ++i) {
       LogicalRegion image_region = images[i];
 
       vector_launcher.add_region_requirement
         (RegionRequirement(image_region, READ_ONLY, EXCLUSIVE, image_region));
-      vector_launcher.add_field(i + 1, DATA_ID);
+      vector_launcher.add_field(i + 4, DATA_ID);
     }
 
     rt->execute_task(ctx, vector_launcher);
@@ -430,129 +1312,785 @@ void inner_task(const Task* task,
     }
   }
 
-  rt->destroy_index_partition(ctx, path_even_partition);
-  rt->destroy_index_partition(ctx, vector_even_partition);
+  rt->destroy_index_partition(ctx, path_batched_partition);
+  rt->destroy_index_partition(ctx, heap_batched_partition);
   rt->destroy_index_partition(ctx, vector_batched_partition);
 }
 
-void main_task(const Task* task,
-               const std::vector<PhysicalRegion> &regions,
-               Context ctx,
-               HighLevelRuntime *rt) {
-  /////////////////////////////////////////////////////////////////////////////
-  /// Load paths from file
-  std::vector<std::string> paths;
-  {
-    std::ifstream image_paths_stream("images.txt");
-    while (image_paths_stream.good()) {
-      std::string path;
-      std::getline(image_paths_stream, path);
-      printf("path %s\n", path.c_str());
-      // -1 for null character
-      if (path.size() > PATH_SIZE - 1) {
-        std::cerr << "Path longer than maximum path size("
-                  << PATH_SIZE << "): " << path << std::endl;
-        exit(1);
-      }
-      if (path.size() == 0) {
-        break;
-      }
-      paths.push_back(path);
-    }
+// Packs the paths of entries back to back from the start of the heap
+std::vector<PathRef> pack_paths(const std::vector<ManifestEntry>& entries) {
+  std::vector<PathRef> refs(entries.size());
+  uint64_t offset = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    refs[i].offset = offset;
+    refs[i].length = entries[i].path.size();
+    offset += refs[i].length;
   }
+  return refs;
+}
 
-  /////////////////////////////////////////////////////////////////////////////
-  /// Create path region
-  Rect<1> rect(Point<1>(0), Point<1>(paths.size() - 1));
-  IndexSpace is = rt->create_index_space(ctx, Domain::from_rect<1>(rect));
-
-  FieldSpace fs = rt->create_field_space(ctx);
-  {
-    FieldAllocator allocator = rt->create_field_allocator(ctx, fs);
-    allocator.allocate_field(PATH_SIZE * sizeof(char), PATH_ID);
+// Writes entries into the path region and their paths into the heap region,
+// both in order. The heap must hold exactly the entries' paths.
+void write_manifest(HighLevelRuntime* rt,
+                    Context ctx,
+                    LogicalRegion path_region,
+                    LogicalRegion heap_region,
+                    const std::vector<ManifestEntry>& entries) {
+  std::vector<PathRef> refs = pack_paths(entries);
+
+  RegionRequirement req(path_region, WRITE_ONLY, EXCLUSIVE, path_region);
+  req.add_field(PATH_ID);
+  req.add_field(WIDTH_ID);
+  req.add_field(HEIGHT_ID);
+  req.add_field(BYTES_ID);
+  req.add_field(HASH_ID);
+  InlineLauncher launcher(req);
+  PhysicalRegion pr = rt->map_region(ctx, launcher);
+
+  RegionRequirement heap_req(heap_region, WRITE_ONLY, EXCLUSIVE, heap_region);
+  heap_req.add_field(PATH_CHARS_ID);
+  InlineLauncher heap_launcher(heap_req);
+  PhysicalRegion heap_pr = rt->map_region(ctx, heap_launcher);
+  pr.wait_until_valid();
+  heap_pr.wait_until_valid();
+
+  RegionAccessor<AccessorType::Generic, PathRef> path_acc =
+    pr.get_field_accessor(PATH_ID).typeify<PathRef>();
+  RegionAccessor<AccessorType::Generic, int> width_acc =
+    pr.get_field_accessor(WIDTH_ID).typeify<int>();
+  RegionAccessor<AccessorType::Generic, int> height_acc =
+    pr.get_field_accessor(HEIGHT_ID).typeify<int>();
+  RegionAccessor<AccessorType::Generic, int> bytes_acc =
+    pr.get_field_accessor(BYTES_ID).typeify<int>();
+  RegionAccessor<AccessorType::Generic, uint64_t> hash_acc =
+    pr.get_field_accessor(HASH_ID).typeify<uint64_t>();
+
+  Rect<1> heap_rect =
+    rt->get_index_space_domain(ctx, heap_region.get_index_space())
+    .get_rect<1>();
+  char* chars = get_array_pointer(heap_pr.get_field_accessor(PATH_CHARS_ID),
+                                  heap_rect, sizeof(char));
+
+  Rect<1> rect(Point<1>(0), Point<1>(entries.size() - 1));
+  int i = 0;
+  for (GenericPointInRectIterator<1> itr(rect); itr; itr++, i++) {
+    DomainPoint p = DomainPoint::from_point<1>(itr.p);
+    memcpy(chars + refs[i].offset, entries[i].path.data(), refs[i].length);
+    path_acc.write(p, refs[i]);
+    width_acc.write(p, entries[i].width);
+    height_acc.write(p, entries[i].height);
+    bytes_acc.write(p, entries[i].bytes);
+    hash_acc.write(p, entries[i].hash);
   }
+  rt->unmap_region(ctx, pr);
+  rt->unmap_region(ctx, heap_pr);
+}
 
+// Creates a region in the path field space fs holding entries, and in
+// *heap_region a region in heap_fs holding their paths. Sizes the manifest
+// did not list are probed, and images of the same shape are grouped into the
+// same batches; entries is updated to match the region.
+LogicalRegion create_path_region(HighLevelRuntime* rt,
+                                 Context ctx,
+                                 FieldSpace fs,
+                                 FieldSpace heap_fs,
+                                 std::vector<ManifestEntry>& entries,
+                                 bool sizes_missing,
+                                 LogicalRegion* heap_region) {
+  Rect<1> rect(Point<1>(0), Point<1>(entries.size() - 1));
+  IndexSpace is = rt->create_index_space(ctx, Domain::from_rect<1>(rect));
   LogicalRegion path_region = rt->create_logical_region(ctx, is, fs);
 
+  std::vector<PathRef> refs = pack_paths(entries);
+  Rect<1> heap_rect(Point<1>(0),
+                    Point<1>(refs.back().offset + refs.back().length - 1));
+  IndexSpace heap_is =
+    rt->create_index_space(ctx, Domain::from_rect<1>(heap_rect));
+  *heap_region = rt->create_logical_region(ctx, heap_is, heap_fs);
+
   /////////////////////////////////////////////////////////////////////////////
   /// Fill in path region
-  {
-    RegionRequirement req(path_region, WRITE_ONLY, EXCLUSIVE, path_region);
-    req.add_field(PATH_ID);
+  write_manifest(rt, ctx, path_region, *heap_region, entries);
+
+  /////////////////////////////////////////////////////////////////////////////
+  /// Probe the sizes the manifest did not list
+  if (sizes_missing) {
+    Domain probe_domain;
+    IndexPartition probe_index_partition =
+      create_batched_partition(rt, ctx, is, BATCH_SIZE, probe_domain);
+    LogicalPartition probe_partition =
+      rt->get_logical_partition(ctx, path_region, probe_index_partition);
+    IndexPartition probe_heap_index_partition =
+      create_heap_partition(rt, ctx, heap_is, is, probe_index_partition,
+                            probe_domain, refs);
+    LogicalPartition probe_heap_partition =
+      rt->get_logical_partition(ctx, *heap_region,
+                                probe_heap_index_partition);
+
+    IndexLauncher probe_launcher(PROBE_TASK_ID, probe_domain, TaskArgument(),
+                                 ArgumentMap());
+    probe_launcher.add_region_requirement
+      (RegionRequirement(probe_partition, 0, READ_WRITE, EXCLUSIVE,
+                         path_region));
+    probe_launcher.add_field(0, PATH_ID);
+    probe_launcher.add_field(0, WIDTH_ID);
+    probe_launcher.add_field(0, HEIGHT_ID);
+    probe_launcher.add_field(0, BYTES_ID);
+    probe_launcher.add_region_requirement
+      (RegionRequirement(probe_heap_partition, 0, READ_ONLY, EXCLUSIVE,
+                         *heap_region));
+    probe_launcher.add_field(1, PATH_CHARS_ID);
+    rt->execute_index_space(ctx, probe_launcher);
+
+    RegionRequirement req(path_region, READ_ONLY, EXCLUSIVE, path_region);
+    req.add_field(WIDTH_ID);
+    req.add_field(HEIGHT_ID);
+    req.add_field(BYTES_ID);
     InlineLauncher launcher(req);
     PhysicalRegion pr = rt->map_region(ctx, launcher);
     pr.wait_until_valid();
 
-    StringAccessor path_acc = pr.get_field_accessor(PATH_ID);
-
+    RegionAccessor<AccessorType::Generic, int> width_acc =
+      pr.get_field_accessor(WIDTH_ID).typeify<int>();
+    RegionAccessor<AccessorType::Generic, int> height_acc =
+      pr.get_field_accessor(HEIGHT_ID).typeify<int>();
+    RegionAccessor<AccessorType::Generic, int> bytes_acc =
+      pr.get_field_accessor(BYTES_ID).typeify<int>();
     int i = 0;
     for (GenericPointInRectIterator<1> itr(rect); itr; itr++, i++) {
       DomainPoint p = DomainPoint::from_point<1>(itr.p);
-      write_string<PATH_SIZE>(path_acc, p, paths[i]);
+      entries[i].width = width_acc.read(p);
+      entries[i].height = height_acc.read(p);
+      entries[i].bytes = bytes_acc.read(p);
     }
+    rt->unmap_region(ctx, pr);
+    rt->destroy_index_partition(ctx, probe_index_partition);
+    rt->destroy_index_partition(ctx, probe_heap_index_partition);
   }
 
+  /////////////////////////////////////////////////////////////////////////////
+  /// Group images of the same shape into the same batches. Vectors follow
+  /// the order of the path region, so it is rewritten in sorted order.
+  std::vector<ManifestEntry> sorted_entries = entries;
+  std::stable_sort(sorted_entries.begin(), sorted_entries.end(),
+                   [](const ManifestEntry& a, const ManifestEntry& b) {
+                     if (a.height != b.height) return a.height < b.height;
+                     return a.width < b.width;
+                   });
+  bool reordered = false;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (sorted_entries[i].path != entries[i].path) reordered = true;
+  }
+  if (reordered) {
+    entries.swap(sorted_entries);
+    write_manifest(rt, ctx, path_region, *heap_region, entries);
+  }
+  return path_region;
+}
+
+// Field spaces of the path region and of the path heap
+void create_path_field_spaces(HighLevelRuntime* rt,
+                              Context ctx,
+                              FieldSpace* fs,
+                              FieldSpace* heap_fs) {
+  *fs = rt->create_field_space(ctx);
+  {
+    FieldAllocator allocator = rt->create_field_allocator(ctx, *fs);
+    allocator.allocate_field(sizeof(PathRef), PATH_ID);
+    allocator.allocate_field(sizeof(int), WIDTH_ID);
+    allocator.allocate_field(sizeof(int), HEIGHT_ID);
+    allocator.allocate_field(sizeof(int), BYTES_ID);
+    allocator.allocate_field(sizeof(uint64_t), HASH_ID);
+  }
+
+  *heap_fs = rt->create_field_space(ctx);
+  {
+    FieldAllocator allocator = rt->create_field_allocator(ctx, *heap_fs);
+    allocator.allocate_field(sizeof(char), PATH_CHARS_ID);
+  }
+}
+
+// Launches an inner task over every entry of path_region, writing the vectors
+// of vector_subregion, a subregion of vector_parent. run is the feature store
+// run id of the segments it writes.
+void launch_inner_task(HighLevelRuntime* rt,
+                       Context ctx,
+                       LogicalRegion path_region,
+                       LogicalRegion heap_region,
+                       LogicalRegion vector_subregion,
+                       LogicalRegion vector_parent,
+                       uint32_t run) {
+  TaskLauncher launcher(INNER_TASK_ID, TaskArgument(&run, sizeof(run)));
+  launcher.add_region_requirement
+    (RegionRequirement(path_region, READ_ONLY, EXCLUSIVE, path_region));
+  launcher.add_field(0, PATH_ID);
+  launcher.add_field(0, WIDTH_ID);
+  launcher.add_field(0, HEIGHT_ID);
+  launcher.add_field(0, BYTES_ID);
+  launcher.add_field(0, HASH_ID);
+
+  // Read-write because the feature task revisits FILTER_ID
+  launcher.add_region_requirement
+    (RegionRequirement(vector_subregion, READ_WRITE, EXCLUSIVE,
+                       vector_parent));
+  launcher.add_field(1, FILTER_ID);
+  launcher.add_field(1, DUP_OF_ID);
+
+  launcher.add_region_requirement
+    (RegionRequirement(vector_subregion, WRITE_ONLY, EXCLUSIVE,
+                       vector_parent));
+  launcher.add_field(2, VEC_ID);
+
+  launcher.add_region_requirement
+    (RegionRequirement(heap_region, READ_ONLY, EXCLUSIVE, heap_region));
+  launcher.add_field(3, PATH_CHARS_ID);
+
+  rt->execute_task(ctx, launcher);
+}
+
+// Shards travel to their tasks as a ShardArgs followed by the file's path
+struct ShardArgs {
+  uint64_t begin;
+  uint64_t end;
+};
+
+std::vector<char> pack_shard_args(const ManifestShard& shard) {
+  ShardArgs args;
+  args.begin = shard.begin;
+  args.end = shard.end;
+  std::vector<char> buffer(sizeof(args) + shard.path.size());
+  memcpy(buffer.data(), &args, sizeof(args));
+  memcpy(buffer.data() + sizeof(args), shard.path.data(), shard.path.size());
+  return buffer;
+}
+
+ManifestShard unpack_shard_args(const void* buffer, size_t size) {
+  ShardArgs args;
+  memcpy(&args, buffer, sizeof(args));
+  ManifestShard shard;
+  shard.begin = args.begin;
+  shard.end = args.end;
+  shard.path.assign((const char*)buffer + sizeof(args), size - sizeof(args));
+  return shard;
+}
+
+// Streamed chunks travel to their tasks as a ChunkArgs, a ManifestRecord per
+// entry and the entries' paths back to back, as in a binary manifest
+struct ChunkArgs {
+  uint32_t run;
+  uint32_t sizes_missing;
+  uint64_t count;
+};
+
+std::vector<char> pack_chunk_args(const std::vector<ManifestEntry>& entries,
+                                  bool sizes_missing,
+                                  uint32_t run) {
+  ChunkArgs args;
+  args.run = run;
+  args.sizes_missing = sizes_missing;
+  args.count = entries.size();
+  size_t paths_offset = sizeof(args) + entries.size() * sizeof(ManifestRecord);
+  size_t path_bytes = 0;
+  for (const ManifestEntry& entry : entries) {
+    path_bytes += entry.path.size();
+  }
+  std::vector<char> buffer(paths_offset + path_bytes);
+  memcpy(buffer.data(), &args, sizeof(args));
+
+  ManifestRecord* records = (ManifestRecord*)(buffer.data() + sizeof(args));
+  uint64_t offset = 0;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    records[i].path_offset = offset;
+    records[i].path_length = entries[i].path.size();
+    records[i].bytes = entries[i].bytes;
+    records[i].width = entries[i].width;
+    records[i].height = entries[i].height;
+    records[i].hash = entries[i].hash;
+    memcpy(buffer.data() + paths_offset + offset, entries[i].path.data(),
+           entries[i].path.size());
+    offset += entries[i].path.size();
+  }
+  return buffer;
+}
+
+std::vector<ManifestEntry> unpack_chunk_args(const void* buffer,
+                                             bool* sizes_missing,
+                                             uint32_t* run) {
+  ChunkArgs args;
+  memcpy(&args, buffer, sizeof(args));
+  *sizes_missing = args.sizes_missing;
+  *run = args.run;
+
+  const ManifestRecord* records =
+    (const ManifestRecord*)((const char*)buffer + sizeof(args));
+  const char* paths = (const char*)(records + args.count);
+  std::vector<ManifestEntry> entries(args.count);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    entries[i].path.assign(paths + records[i].path_offset,
+                           records[i].path_length);
+    entries[i].width = records[i].width;
+    entries[i].height = records[i].height;
+    entries[i].bytes = records[i].bytes;
+    entries[i].hash = records[i].hash;
+  }
+  return entries;
+}
+
+// With -incremental, keeps only the entries the feature store has no record
+// of. store must outlive the filter.
+EntryFilter missing_from(const FeatureStore* store) {
+  if (store == nullptr) return EntryFilter();
+  return [store](const ManifestEntry& entry) {
+    return !store->contains(entry.path, entry.hash);
+  };
+}
+
+// Feature store as of the start of the run, or NULL unless -incremental.
+// run is the id of the segments this run writes.
+std::unique_ptr<FeatureStore> open_incremental_store(uint32_t run) {
+  if (!options.incremental) return nullptr;
+  return std::unique_ptr<FeatureStore>
+    (new FeatureStore(options.feature_store, options.feature_type, VEC_DIM,
+                      run));
+}
+
+// Builds the path region for entries, probing and sorting them, and runs an
+// inner task on it that writes the vectors of vector_region. Used by the
+// tasks that each handle part of the manifest.
+void process_entries(HighLevelRuntime* rt,
+                     Context ctx,
+                     std::vector<ManifestEntry>& entries,
+                     bool sizes_missing,
+                     LogicalRegion vector_region,
+                     uint32_t run) {
+  FieldSpace fs;
+  FieldSpace heap_fs;
+  create_path_field_spaces(rt, ctx, &fs, &heap_fs);
+
+  LogicalRegion heap_region;
+  LogicalRegion path_region =
+    create_path_region(rt, ctx, fs, heap_fs, entries, sizes_missing,
+                       &heap_region);
+  launch_inner_task(rt, ctx, path_region, heap_region, vector_region,
+                    vector_region, run);
+
+  rt->destroy_logical_region(ctx, path_region);
+  rt->destroy_index_space(ctx, path_region.get_index_space());
+  rt->destroy_logical_region(ctx, heap_region);
+  rt->destroy_index_space(ctx, heap_region.get_index_space());
+  rt->destroy_field_space(ctx, fs);
+  rt->destroy_field_space(ctx, heap_fs);
+}
+
+// Returns the number of entries in the shard named by the point's argument,
+// so the main task can size the vector region before any path is read. The
+// global argument is the run's feature store id.
+size_t count_shard_task(const Task* task,
+                        const std::vector<PhysicalRegion>& regions,
+                        Context ctx,
+                        HighLevelRuntime* rt) {
+  std::unique_ptr<FeatureStore> store =
+    open_incremental_store(*(uint32_t*)task->args);
+  return count_manifest_shard(unpack_shard_args(task->local_args,
+                                                task->local_arglen),
+                              missing_from(store.get()));
+}
+
+// Reads the shard named by the point's argument and runs an inner task on
+// it, so its paths are parsed and held on the node that processes them
+// rather than sent out from the main task.
+//
+// Regions:
+//   0: subregion of the vector region for the shard, FILTER_ID and DUP_OF_ID
+//   1: the same subregion, VEC_ID
+void shard_task(const Task* task,
+                const std::vector<PhysicalRegion>& regions,
+                Context ctx,
+                HighLevelRuntime* rt) {
+  ManifestShard shard = unpack_shard_args(task->local_args,
+                                          task->local_arglen);
+  uint32_t run = *(uint32_t*)task->args;
+  std::unique_ptr<FeatureStore> store = open_incremental_store(run);
+  bool sizes_missing = false;
+  std::vector<ManifestEntry> entries =
+    read_manifest_shard(shard, &sizes_missing, missing_from(store.get()));
+  store.reset();
+
+  LogicalRegion vector_region = task->regions[0].region;
+  size_t expected =
+    rt->get_index_space_domain(ctx, vector_region.get_index_space())
+    .get_volume();
+  if (entries.size() != expected) {
+    std::cerr << shard.path << " changed while it was being read"
+              << std::endl;
+    exit(1);
+  }
+  if (entries.empty()) return;
+
+  process_entries(rt, ctx, entries, sizes_missing, vector_region, run);
+}
+
+// Probes and sorts a chunk of the manifest the main task read and runs an
+// inner task on it, so the main task goes on to read the next chunk while
+// this one is prepared. The task argument is packed by pack_chunk_args.
+//
+// Regions:
+//   0: subregion of the vector region for the chunk, FILTER_ID and DUP_OF_ID
+//   1: the same subregion, VEC_ID
+void chunk_task(const Task* task,
+                const std::vector<PhysicalRegion>& regions,
+                Context ctx,
+                HighLevelRuntime* rt) {
+  bool sizes_missing;
+  uint32_t run;
+  std::vector<ManifestEntry> entries =
+    unpack_chunk_args(task->args, &sizes_missing, &run);
+  process_entries(rt, ctx, entries, sizes_missing, task->regions[0].region,
+                  run);
+}
+
+// Region of size vectors, over an index space of its own
+LogicalRegion create_dense_vector_region(HighLevelRuntime* rt,
+                                         Context ctx,
+                                         size_t size) {
+  IndexSpace is = rt->create_index_space(ctx, size);
+  {
+    IndexAllocator allocator = rt->create_index_allocator(ctx, is);
+    allocator.alloc(size);
+  }
+
+  FieldSpace fs = rt->create_field_space(ctx);
+  {
+    FieldAllocator allocator = rt->create_field_allocator(ctx, fs);
+    allocator.allocate_field(vector_row_size(), VEC_ID);
+  }
+
+  return rt->create_logical_region(ctx, is, fs);
+}
+
+void destroy_dense_vector_region(HighLevelRuntime* rt,
+                                 Context ctx,
+                                 LogicalRegion region) {
+  rt->destroy_logical_region(ctx, region);
+  rt->destroy_index_space(ctx, region.get_index_space());
+  rt->destroy_field_space(ctx, region.get_field_space());
+}
+
+// Finds the K nearest neighbours of every vector in dense_vector_region
+void run_knn(HighLevelRuntime* rt,
+             Context ctx,
+             LogicalRegion dense_vector_region) {
+  IndexSpace knn_is = dense_vector_region.get_index_space();
+  FieldSpace knn_fs = rt->create_field_space(ctx);
+  {
+    FieldAllocator allocator = rt->create_field_allocator(ctx, knn_fs);
+    allocator.allocate_field(KNN_SIZE, DATA_ID);
+  }
+
+  LogicalRegion knn_region = rt->create_logical_region(ctx, knn_is, knn_fs);
+
+  TaskLauncher knn_launcher(KNN_TASK_ID, TaskArgument());
+
+  knn_launcher.add_region_requirement
+    (RegionRequirement(dense_vector_region, READ_ONLY, EXCLUSIVE,
+                       dense_vector_region));
+  knn_launcher.add_field(0, VEC_ID);
+
+  knn_launcher.add_region_requirement
+    (RegionRequirement(knn_region, READ_WRITE, EXCLUSIVE, knn_region));
+  knn_launcher.add_field(1, DATA_ID);
+
+  rt->execute_task(ctx, knn_launcher);
+
+  rt->destroy_logical_region(ctx, knn_region);
+  rt->destroy_field_space(ctx, knn_fs);
+}
+
+// Fills region, a subregion of parent with one vector per row of store, with
+// the store's vectors
+void copy_store_vectors(HighLevelRuntime* rt,
+                        Context ctx,
+                        const FeatureStore& store,
+                        LogicalRegion region,
+                        LogicalRegion parent) {
+  RegionRequirement req(region, WRITE_DISCARD, EXCLUSIVE, parent);
+  req.add_field(VEC_ID);
+  InlineLauncher launcher(req);
+  PhysicalRegion pr = rt->map_region(ctx, launcher);
+  pr.wait_until_valid();
+
+  IndexIterator itr(rt, ctx, region);
+  char* vector_ptr =
+    get_array_pointer(pr.get_field_accessor(VEC_ID), itr.next(),
+                      store.rows(), vector_row_size());
+  store.copy_rows(vector_ptr);
+  rt->unmap_region(ctx, pr);
+}
+
+// -knn-only: runs KNN on the vectors of the feature store instead of
+// computing any. The store's segments are mapped and copied straight into
+// the dense vector region.
+void run_knn_on_store(HighLevelRuntime* rt, Context ctx) {
+  FeatureStore store(options.feature_store, options.feature_type, VEC_DIM);
+  printf("feature store size: %lu\n", store.rows());
+  fflush(stdout);
+  if (store.rows() == 0) return;
+
+  LogicalRegion dense_vector_region =
+    create_dense_vector_region(rt, ctx, store.rows());
+  copy_store_vectors(rt, ctx, store, dense_vector_region, dense_vector_region);
+
+  run_knn(rt, ctx, dense_vector_region);
+  destroy_dense_vector_region(rt, ctx, dense_vector_region);
+}
+
+void main_task(const Task* task,
+               const std::vector<PhysicalRegion> &regions,
+               Context ctx,
+               HighLevelRuntime *rt) {
+  if (options.knn_only) {
+    run_knn_on_store(rt, ctx);
+    return;
+  }
+  if (!options.feature_store.empty()) {
+    prepare_feature_store(options.feature_store);
+  }
+
+  // With -incremental, only entries the store has no record of are
+  // processed, and the store's vectors join theirs for KNN. Segments this run
+  // writes carry its run id and are left out, so every task sees the same
+  // store.
+  uint32_t run = new_feature_run();
+  std::unique_ptr<FeatureStore> stored = open_incremental_store(run);
+  EntryFilter keep = missing_from(stored.get());
+
+  /////////////////////////////////////////////////////////////////////////////
+  /// Load paths from file. When streaming, only the entries are counted up
+  /// front, to size the vector region; chunks are read as they are launched.
+  /// Sharded manifests are counted by a task per shard and never read here.
+  std::ifstream manifest("images.txt");
+  bool sharded =
+    !options.manifest_files.empty() || options.manifest_shards > 0;
+  bool streaming = !sharded && options.manifest_chunk > 0;
+  std::vector<ManifestEntry> entries;
+  bool sizes_missing = false;
+  size_t entry_count;
+
+  Domain shard_domain;
+  ArgumentMap shard_argmap;
+  std::vector<size_t> shard_sizes;
+  if (sharded) {
+    std::vector<std::string> files = options.manifest_files;
+    if (files.empty()) files.push_back("images.txt");
+    std::vector<ManifestShard> shards =
+      split_manifests(files, std::max(options.manifest_shards, 1));
+    if (shards.empty()) exit(1);
+
+    shard_domain =
+      Domain::from_rect<1>(Rect<1>(Point<1>(0), Point<1>(shards.size() - 1)));
+    for (size_t i = 0; i < shards.size(); ++i) {
+      std::vector<char> args = pack_shard_args(shards[i]);
+      shard_argmap.set_point(DomainPoint::from_point<1>(Point<1>(i)),
+                             TaskArgument(args.data(), args.size()));
+    }
+
+    IndexLauncher count_launcher(COUNT_SHARD_TASK_ID, shard_domain,
+                                 TaskArgument(&run, sizeof(run)),
+                                 shard_argmap);
+    FutureMap counts = rt->execute_index_space(ctx, count_launcher);
+    entry_count = 0;
+    for (size_t i = 0; i < shards.size(); ++i) {
+      shard_sizes.push_back(counts.get_result<size_t>
+                            (DomainPoint::from_point<1>(Point<1>(i))));
+      entry_count += shard_sizes.back();
+    }
+  } else if (streaming) {
+    entry_count = count_manifest(manifest, keep);
+    manifest.clear();
+    manifest.seekg(0);
+  } else {
+    entries = read_manifest(manifest, std::numeric_limits<size_t>::max(),
+                            &sizes_missing, keep);
+    entry_count = entries.size();
+  }
+
+  if (entry_count == 0) {
+    printf("input size: 0\n");
+    fflush(stdout);
+    if (stored) run_knn_on_store(rt, ctx);
+    return;
+  }
+
+  FieldSpace fs;
+  FieldSpace heap_fs;
+  create_path_field_spaces(rt, ctx, &fs, &heap_fs);
+
   /////////////////////////////////////////////////////////////////////////////
   /// Create vector region
-  IndexSpace vector_is = rt->create_index_space(ctx, paths.size());
+  IndexSpace vector_is = rt->create_index_space(ctx, entry_count);
   {
     IndexAllocator allocator = rt->create_index_allocator(ctx, vector_is);
-    allocator.alloc(paths.size());
+    allocator.alloc(entry_count);
   }
 
   FieldSpace vector_fs = rt->create_field_space(ctx);
   {
     FieldAllocator allocator = rt->create_field_allocator(ctx, vector_fs);
-    allocator.allocate_field(VEC_DIM * sizeof(float), VEC_ID);
+    allocator.allocate_field(vector_row_size(), VEC_ID);
     allocator.allocate_field(sizeof(int), FILTER_ID);
+    allocator.allocate_field(sizeof(int), DUP_OF_ID);
   }
 
   LogicalRegion vector_region =
     rt->create_logical_region(ctx, vector_is, vector_fs);
 
-  /////////////////////////////////////////////////////////////////////////////
-  /// Partition path and vector region
-  // Partition each image into its own color
-  Rect<1> color_rect(Point<1>(0), Point<1>(1));
-  Domain color_domain(Domain::from_rect<1>(color_rect));
-
-  // Not implemented in non-shared low level runtime
-  // IndexPartition path_index_partition =
-  //   rt->create_equal_partition(ctx, is, color_domain);
-  // IndexPartition vector_index_partition =
-  //   rt->create_equal_partition(ctx, vector_is, color_domain);
-
-  IndexPartition path_index_partition =
-    create_even_partition(rt, ctx, is, color_domain);
-  IndexPartition vector_index_partition =
-    create_even_partition(rt, ctx, vector_is, color_domain);
-
-  LogicalPartition path_partition =
-    rt->get_logical_partition(ctx, path_region, path_index_partition);
-  LogicalPartition vector_partition =
-    rt->get_logical_partition(ctx, vector_region, vector_index_partition);
-
-
-  /////////////////////////////////////////////////////////////////////////////
-  /// Launch filter task
   ArgumentMap argmap;
-  IndexLauncher launcher(INNER_TASK_ID, color_domain, TaskArgument(), argmap);
-
-  launcher.add_region_requirement
-    (RegionRequirement(path_partition, 0, READ_ONLY, EXCLUSIVE, path_region));
-  launcher.add_field(0, PATH_ID);
+  if (sharded) {
+    ///////////////////////////////////////////////////////////////////////////
+    /// Hand each shard its run of the vector region
+    IndexPartition shard_index_partition =
+      create_sized_partition(rt, ctx, vector_is, shard_sizes, shard_domain);
+    LogicalPartition shard_partition =
+      rt->get_logical_partition(ctx, vector_region, shard_index_partition);
+
+    IndexLauncher launcher(SHARD_TASK_ID, shard_domain,
+                           TaskArgument(&run, sizeof(run)),
+                           shard_argmap);
+    // Read-write because the feature task revisits FILTER_ID
+    launcher.add_region_requirement
+      (RegionRequirement(shard_partition, 0, READ_WRITE, EXCLUSIVE,
+                         vector_region));
+    launcher.add_field(0, FILTER_ID);
+    launcher.add_field(0, DUP_OF_ID);
+
+    launcher.add_region_requirement
+      (RegionRequirement(shard_partition, 0, WRITE_ONLY, EXCLUSIVE,
+                         vector_region));
+    launcher.add_field(1, VEC_ID);
+
+    rt->execute_index_space(ctx, launcher);
+  } else if (streaming) {
+    ///////////////////////////////////////////////////////////////////////////
+    /// Read the manifest a chunk at a time, launching a chunk task on each as
+    /// soon as it is read so ingestion overlaps with processing. Probing and
+    /// sorting happen in the chunk task, so reading is never held up by
+    /// them.
+    Domain chunk_domain;
+    IndexPartition chunk_index_partition =
+      create_batched_partition(rt, ctx, vector_is, options.manifest_chunk,
+                               chunk_domain);
+    LogicalPartition chunk_partition =
+      rt->get_logical_partition(ctx, vector_region, chunk_index_partition);
+
+    size_t chunk_start = 0;
+    for (Realm::Domain::DomainPointIterator itr(chunk_domain); itr; itr++) {
+      bool chunk_sizes_missing = false;
+      std::vector<ManifestEntry> chunk =
+        read_manifest(manifest, options.manifest_chunk, &chunk_sizes_missing,
+                      keep);
+      size_t expected =
+        std::min(options.manifest_chunk, entry_count - chunk_start);
+      if (chunk.size() != expected) {
+        std::cerr << "images.txt changed while it was being read" << std::endl;
+        exit(1);
+      }
+      chunk_start += chunk.size();
+
+      LogicalRegion chunk_vector_region =
+        rt->get_logical_subregion_by_color(ctx, chunk_partition, itr.p);
+      std::vector<char> args =
+        pack_chunk_args(chunk, chunk_sizes_missing, run);
+      TaskLauncher launcher(CHUNK_TASK_ID,
+                            TaskArgument(args.data(), args.size()));
+      // Read-write because the feature task revisits FILTER_ID
+      launcher.add_region_requirement
+        (RegionRequirement(chunk_vector_region, READ_WRITE, EXCLUSIVE,
+                           vector_region));
+      launcher.add_field(0, FILTER_ID);
+      launcher.add_field(0, DUP_OF_ID);
+
+      launcher.add_region_requirement
+        (RegionRequirement(chunk_vector_region, WRITE_ONLY, EXCLUSIVE,
+                           vector_region));
+      launcher.add_field(1, VEC_ID);
+
+      rt->execute_task(ctx, launcher);
+    }
+  } else {
+    LogicalRegion heap_region;
+    LogicalRegion path_region =
+      create_path_region(rt, ctx, fs, heap_fs, entries, sizes_missing,
+                         &heap_region);
+    IndexSpace is = path_region.get_index_space();
 
-  launcher.add_region_requirement
-    (RegionRequirement(vector_partition, 0, WRITE_ONLY, EXCLUSIVE,
-                       vector_region));
-  launcher.add_field(1, FILTER_ID);
+    ///////////////////////////////////////////////////////////////////////////
+    /// Partition path and vector region
+    // Partition each image into its own color
+    Rect<1> color_rect(Point<1>(0), Point<1>(1));
+    Domain color_domain(Domain::from_rect<1>(color_rect));
+
+    // Not implemented in non-shared low level runtime
+    // IndexPartition path_index_partition =
+    //   rt->create_equal_partition(ctx, is, color_domain);
+    // IndexPartition vector_index_partition =
+    //   rt->create_equal_partition(ctx, vector_is, color_domain);
+
+    IndexPartition path_index_partition =
+      create_even_partition(rt, ctx, is, color_domain);
+    IndexPartition vector_index_partition =
+      create_even_partition(rt, ctx, vector_is, color_domain);
+
+    IndexPartition heap_index_partition =
+      create_heap_partition(rt, ctx, heap_region.get_index_space(), is,
+                            path_index_partition, color_domain,
+                            pack_paths(entries));
+
+    LogicalPartition path_partition =
+      rt->get_logical_partition(ctx, path_region, path_index_partition);
+    LogicalPartition heap_partition =
+      rt->get_logical_partition(ctx, heap_region, heap_index_partition);
+    LogicalPartition vector_partition =
+      rt->get_logical_partition(ctx, vector_region, vector_index_partition);
 
-  launcher.add_region_requirement
-    (RegionRequirement(vector_partition, 0, WRITE_ONLY, EXCLUSIVE,
-                       vector_region));
-  launcher.add_field(2, VEC_ID);
 
-  FutureMap fm = rt->execute_index_space(ctx, launcher);
+    ///////////////////////////////////////////////////////////////////////////
+    /// Launch filter task
+    IndexLauncher launcher(INNER_TASK_ID, color_domain,
+                           TaskArgument(&run, sizeof(run)),
+                           argmap);
+
+    launcher.add_region_requirement
+      (RegionRequirement(path_partition, 0, READ_ONLY, EXCLUSIVE,
+                         path_region));
+    launcher.add_field(0, PATH_ID);
+    launcher.add_field(0, WIDTH_ID);
+    launcher.add_field(0, HEIGHT_ID);
+    launcher.add_field(0, BYTES_ID);
+    launcher.add_field(0, HASH_ID);
+
+    launcher.add_region_requirement
+      (RegionRequirement(vector_partition, 0, READ_WRITE, EXCLUSIVE,
+                         vector_region));
+    launcher.add_field(1, FILTER_ID);
+    launcher.add_field(1, DUP_OF_ID);
+
+    launcher.add_region_requirement
+      (RegionRequirement(vector_partition, 0, WRITE_ONLY, EXCLUSIVE,
+                         vector_region));
+    launcher.add_field(2, VEC_ID);
+
+    launcher.add_region_requirement
+      (RegionRequirement(heap_partition, 0, READ_ONLY, EXCLUSIVE,
+                         heap_region));
+    launcher.add_field(3, PATH_CHARS_ID);
+
+    FutureMap fm = rt->execute_index_space(ctx, launcher);
+
+    rt->destroy_logical_region(ctx, path_region);
+    rt->destroy_index_space(ctx, is);
+    rt->destroy_logical_region(ctx, heap_region);
+    rt->destroy_index_space(ctx, heap_region.get_index_space());
+  }
 
   /////////////////////////////////////////////////////////////////////////////
   /// Compact feature vectors
@@ -571,117 +2109,114 @@ void main_task(const Task* task,
 
   /////////////////////////////////////////////////////////////////////////////
   /// Create dense vector and knn region based on filtered size
-  IndexSpace filtered_is = rt->get_index_subspace(ctx, filtered_partition, 0);
+  IndexSpace filtered_is =
+    rt->get_index_subspace(ctx, filtered_partition, FILTER_PASSED);
   size_t filtered_size =
     rt->get_index_space_domain(ctx, filtered_is).get_volume();
-  printf("input size: %lu, filtered size %lu\n", paths.size(), filtered_size);
+  size_t stored_size = stored ? stored->rows() : 0;
+  printf("input size: %lu, filtered size %lu, stored size %lu\n",
+         entry_count, filtered_size, stored_size);
   fflush(stdout);
-
-  IndexSpace knn_is = rt->create_index_space(ctx, filtered_size);
-  {
-    IndexAllocator allocator = rt->create_index_allocator(ctx, knn_is);
-    allocator.alloc(filtered_size);
-  }
-  size_t knn_size = rt->get_index_space_domain(ctx, knn_is).get_volume();
-
-  FieldSpace knn_fs = rt->create_field_space(ctx);
-  {
-    FieldAllocator allocator = rt->create_field_allocator(ctx, knn_fs);
-    allocator.allocate_field(K * (sizeof(float) + sizeof(int)), DATA_ID);
-  }
-
-  LogicalRegion knn_region = rt->create_logical_region(ctx, knn_is, knn_fs);
-
-  FieldSpace dense_vector_fs = rt->create_field_space(ctx);
-  {
-    FieldAllocator allocator = rt->create_field_allocator(ctx, dense_vector_fs);
-    allocator.allocate_field(VEC_DIM * sizeof(float), VEC_ID);
+  if (filtered_size + stored_size == 0) {
+    rt->destroy_logical_region(ctx, vector_region);
+    rt->destroy_index_space(ctx, vector_is);
+    rt->destroy_field_space(ctx, fs);
+    rt->destroy_field_space(ctx, heap_fs);
+    rt->destroy_field_space(ctx, vector_fs);
+    return;
   }
 
+  // Vectors computed by this run come first, followed by the store's
   LogicalRegion dense_vector_region =
-    rt->create_logical_region(ctx, knn_is, dense_vector_fs);
-
-  /////////////////////////////////////////////////////////////////////////////
-  /// Partition vector regions for index space compact task
-  Domain filter_even_domain =
-    Domain::from_rect<1>
-    (Rect<1>(Point<1>(0),
-             Point<1>(rt->get_index_space_domain(ctx, filtered_is)
-                      .get_volume() - 1)));
-  IndexPartition filtered_vector_index_partition =
-    create_even_partition(rt, ctx, filtered_is, filter_even_domain);
-  IndexPartition dense_vector_index_partition =
-    create_even_partition(rt, ctx, knn_is, filter_even_domain);
-
-  /////////////////////////////////////////////////////////////////////////////
-  /// Perform copy from sparse to dense vector region
-  LogicalRegion filtered_vector_subregion =
-    rt->get_logical_subregion_by_color(ctx, filtered_vector_lp, 0);
-  LogicalPartition filtered_vector_subregion_partition =
-    rt->get_logical_partition(ctx, filtered_vector_subregion,
-                              filtered_vector_index_partition);
-
-  LogicalPartition dense_vector_partition =
-    rt->get_logical_partition(ctx, dense_vector_region,
-                              dense_vector_index_partition);
-
-  // CopyLauncher vector_copy_launcher;
-  // vector_copy_launcher.add_copy_requirements
-  //   (RegionRequirement(vector_filtered_subregion, READ_ONLY, EXCLUSIVE,
-  //                      vector_region),
-  //    RegionRequirement(dense_vector_region, WRITE_ONLY, EXCLUSIVE,
-  //                      dense_vector_region));
-  // vector_copy_launcher.add_src_field(0, VEC_ID);
-  // vector_copy_launcher.add_dst_field(0, VEC_ID);
-
-  // rt->issue_copy_operation(ctx, vector_copy_launcher);
-  IndexLauncher compact_launcher(COMPACT_TASK_ID, filter_even_domain,
-                                 TaskArgument(), argmap);
-
-  compact_launcher.add_region_requirement
-    (RegionRequirement(filtered_vector_subregion_partition, 0, READ_ONLY,
-                       EXCLUSIVE,
-                       vector_region));
-  compact_launcher.add_field(0, VEC_ID);
-
-  compact_launcher.add_region_requirement
-    (RegionRequirement(dense_vector_partition, 0, WRITE_ONLY, EXCLUSIVE,
-                       dense_vector_region));
-  compact_launcher.add_field(1, VEC_ID);
+    create_dense_vector_region(rt, ctx, filtered_size + stored_size);
+  LogicalRegion computed_vector_region = dense_vector_region;
+  if (stored_size > 0) {
+    std::vector<size_t> sizes;
+    sizes.push_back(filtered_size);
+    sizes.push_back(stored_size);
+    Domain parts_domain;
+    IndexPartition parts_index_partition =
+      create_sized_partition(rt, ctx, dense_vector_region.get_index_space(),
+                             sizes, parts_domain);
+    LogicalPartition parts =
+      rt->get_logical_partition(ctx, dense_vector_region,
+                                parts_index_partition);
+    computed_vector_region =
+      rt->get_logical_subregion_by_color(ctx, parts, 0);
+    copy_store_vectors(rt, ctx, *stored,
+                       rt->get_logical_subregion_by_color(ctx, parts, 1),
+                       dense_vector_region);
+  }
+  stored.reset();
 
-  rt->execute_index_space(ctx, compact_launcher);
+  // An incremental run may have computed nothing that passed
+  if (filtered_size > 0) {
+    IndexSpace knn_is = computed_vector_region.get_index_space();
 
-  /////////////////////////////////////////////////////////////////////////////
-  /// Run KNN
+    ///////////////////////////////////////////////////////////////////////////
+    /// Partition vector regions for index space compact task
+    Domain filter_even_domain =
+      Domain::from_rect<1>
+      (Rect<1>(Point<1>(0),
+               Point<1>(rt->get_index_space_domain(ctx, filtered_is)
+                        .get_volume() - 1)));
+    IndexPartition filtered_vector_index_partition =
+      create_even_partition(rt, ctx, filtered_is, filter_even_domain);
+    IndexPartition dense_vector_index_partition =
+      create_even_partition(rt, ctx, knn_is, filter_even_domain);
 
-  TaskLauncher knn_launcher(KNN_TASK_ID, TaskArgument());
+    ///////////////////////////////////////////////////////////////////////////
+    /// Perform copy from sparse to dense vector region
+    LogicalRegion filtered_vector_subregion =
+      rt->get_logical_subregion_by_color(ctx, filtered_vector_lp,
+                                         FILTER_PASSED);
+    LogicalPartition filtered_vector_subregion_partition =
+      rt->get_logical_partition(ctx, filtered_vector_subregion,
+                                filtered_vector_index_partition);
+
+    LogicalPartition dense_vector_partition =
+      rt->get_logical_partition(ctx, computed_vector_region,
+                                dense_vector_index_partition);
+
+    // CopyLauncher vector_copy_launcher;
+    // vector_copy_launcher.add_copy_requirements
+    //   (RegionRequirement(vector_filtered_subregion, READ_ONLY, EXCLUSIVE,
+    //                      vector_region),
+    //    RegionRequirement(dense_vector_region, WRITE_ONLY, EXCLUSIVE,
+    //                      dense_vector_region));
+    // vector_copy_launcher.add_src_field(0, VEC_ID);
+    // vector_copy_launcher.add_dst_field(0, VEC_ID);
+
+    // rt->issue_copy_operation(ctx, vector_copy_launcher);
+    IndexLauncher compact_launcher(COMPACT_TASK_ID, filter_even_domain,
+                                   TaskArgument(), argmap);
+
+    compact_launcher.add_region_requirement
+      (RegionRequirement(filtered_vector_subregion_partition, 0, READ_ONLY,
+                         EXCLUSIVE,
+                         vector_region));
+    compact_launcher.add_field(0, VEC_ID);
 
-  knn_launcher.add_region_requirement
-    (RegionRequirement(dense_vector_region, READ_ONLY, EXCLUSIVE,
-                       dense_vector_region));
-  knn_launcher.add_field(0, VEC_ID);
+    compact_launcher.add_region_requirement
+      (RegionRequirement(dense_vector_partition, 0, WRITE_ONLY, EXCLUSIVE,
+                         dense_vector_region));
+    compact_launcher.add_field(1, VEC_ID);
 
-  knn_launcher.add_region_requirement
-    (RegionRequirement(knn_region, READ_WRITE, EXCLUSIVE, knn_region));
-  knn_launcher.add_field(1, DATA_ID);
+    rt->execute_index_space(ctx, compact_launcher);
+  }
 
-  rt->execute_task(ctx, knn_launcher);
+  run_knn(rt, ctx, dense_vector_region);
 
   /////////////////////////////////////////////////////////////////////////////
   /// Cleanup
 
-  rt->destroy_logical_region(ctx, path_region);
   rt->destroy_logical_region(ctx, vector_region);
-  rt->destroy_logical_region(ctx, knn_region);
-
-  rt->destroy_index_space(ctx, is);
   rt->destroy_index_space(ctx, vector_is);
-  rt->destroy_index_space(ctx, knn_is);
+  destroy_dense_vector_region(rt, ctx, dense_vector_region);
 
   rt->destroy_field_space(ctx, fs);
+  rt->destroy_field_space(ctx, heap_fs);
   rt->destroy_field_space(ctx, vector_fs);
-  rt->destroy_field_space(ctx, knn_fs);
-  rt->destroy_field_space(ctx, dense_vector_fs);
 }
 
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
@@ -698,23 +2233,31 @@ void mapper_registration(Machine m, HighLevelRuntime *rt,
 
 
 int main(int argc, char **argv) {
+  parse_options(argc, argv);
+
   HighLevelRuntime::set_top_level_task_id(MAIN_TASK_ID);
   HighLevelRuntime::register_legion_task<main_task>
     (MAIN_TASK_ID, Processor::LOC_PROC, true, false,
      AUTO_GENERATE_ID, TaskConfigOptions(),
      "main task");
 
+  // Not an inner task: it maps the path region to size image regions
   HighLevelRuntime::register_legion_task<inner_task>
     (INNER_TASK_ID, Processor::LOC_PROC, false, true,
-     AUTO_GENERATE_ID, TaskConfigOptions(false, true/*inner task*/),
+     AUTO_GENERATE_ID, TaskConfigOptions(),
      "inner task");
 
-  HighLevelRuntime::register_legion_task<load_task>
+  HighLevelRuntime::register_legion_task<probe_task>
+    (PROBE_TASK_ID, Processor::IO_PROC, false, true,
+     AUTO_GENERATE_ID, TaskConfigOptions(true/*leaf task*/),
+     "probe task");
+
+  HighLevelRuntime::register_legion_task<unsigned, load_task>
     (LOAD_TASK_ID, Processor::IO_PROC, true, true,
      AUTO_GENERATE_ID, TaskConfigOptions(false/*leaf task*/),
      "load task");
 
-  HighLevelRuntime::register_legion_task<bool, filter_task>
+  HighLevelRuntime::register_legion_task<unsigned, filter_task>
     (FILTER_TASK_ID, Processor::LOC_PROC, true, true,
      AUTO_GENERATE_ID, TaskConfigOptions(true/*leaf task*/),
      "filter task");
@@ -739,6 +2282,23 @@ int main(int argc, char **argv) {
      AUTO_GENERATE_ID, TaskConfigOptions(),
      "knn task");
 
+  HighLevelRuntime::register_legion_task<size_t, count_shard_task>
+    (COUNT_SHARD_TASK_ID, Processor::LOC_PROC, false, true,
+     AUTO_GENERATE_ID, TaskConfigOptions(true/*leaf task*/),
+     "count shard task");
+
+  // Not an inner task: it maps the path region it creates
+  HighLevelRuntime::register_legion_task<shard_task>
+    (SHARD_TASK_ID, Processor::LOC_PROC, false, true,
+     AUTO_GENERATE_ID, TaskConfigOptions(),
+     "shard task");
+
+  // Not an inner task: it maps the path region it creates
+  HighLevelRuntime::register_legion_task<chunk_task>
+    (CHUNK_TASK_ID, Processor::LOC_PROC, true, true,
+     AUTO_GENERATE_ID, TaskConfigOptions(),
+     "chunk task");
+
   HighLevelRuntime::set_registration_callback(mapper_registration);
 
   HighLevelRuntime::start(argc, argv);
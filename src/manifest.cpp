@@ -0,0 +1,337 @@
+#include "manifest.h"
+#include "options.h"
+#include "jpeg/JPEGReader.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Parses the whitespace-separated integer ending at *end, moving *end to the
+// start of it. Returns false if the line does not end with one.
+bool parse_trailing_int(const std::string& line, size_t* end, int* value) {
+  size_t last = *end;
+  while (last > 0 && isspace((unsigned char)line[last - 1])) last--;
+  size_t first = last;
+  while (first > 0 && !isspace((unsigned char)line[first - 1])) first--;
+  if (first == last || first == 0) return false;
+
+  std::string field = line.substr(first, last - first);
+  char* field_end;
+  long parsed = strtol(field.c_str(), &field_end, 10);
+  if (*field_end != '\0') return false;
+  *value = parsed;
+  *end = first;
+  return true;
+}
+
+// Parses one manifest line into *entry. Returns false if it has no path. The
+// size fields are taken from the end of the line, so the URI is everything
+// before them and may contain spaces.
+bool parse_entry(const std::string& line, ManifestEntry* entry) {
+  entry->path.clear();
+  entry->width = 0;
+  entry->height = 0;
+  entry->bytes = 0;
+  entry->hash = 0;
+
+  size_t begin = 0;
+  while (begin < line.size() && isspace((unsigned char)line[begin])) begin++;
+  size_t end = line.size();
+  while (end > begin && isspace((unsigned char)line[end - 1])) end--;
+  if (begin == end) return false;
+
+  size_t uri_end = end;
+  int width, height, bytes;
+  if (parse_trailing_int(line, &uri_end, &bytes) &&
+      parse_trailing_int(line, &uri_end, &height) &&
+      parse_trailing_int(line, &uri_end, &width) &&
+      uri_end > begin) {
+    entry->width = width;
+    entry->height = height;
+    entry->bytes = bytes;
+    while (isspace((unsigned char)line[uri_end - 1])) uri_end--;
+    end = uri_end;
+  }
+  entry->path = line.substr(begin, end - begin);
+  return true;
+}
+
+bool needs_probe(const ManifestEntry& entry) {
+  return entry.width <= 0 || entry.height <= 0 ||
+    (options.compressed_regions && entry.bytes <= 0);
+}
+
+// Read-only mapping of a whole file
+class MappedFile {
+public:
+  explicit MappedFile(const std::string& path) : data_(nullptr), size_(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Cannot open manifest %s\n", path.c_str());
+      exit(1);
+    }
+    struct stat st;
+    fstat(fd, &st);
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map manifest %s\n", path.c_str());
+        exit(1);
+      }
+      madvise(data, size_, MADV_SEQUENTIAL);
+      data_ = (const char*)data;
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_) munmap((void*)data_, size_);
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char* data_;
+  size_t size_;
+};
+
+bool is_binary_manifest(const ManifestHeader& header) {
+  return memcmp(header.magic, manifest_magic, sizeof(manifest_magic)) == 0 &&
+    header.version == manifest_version;
+}
+
+// Returns the header of a binary manifest, or NULL if data is not one
+const ManifestHeader* binary_header(const char* data, size_t size) {
+  if (size < sizeof(ManifestHeader)) return nullptr;
+  const ManifestHeader* header = (const ManifestHeader*)data;
+  if (!is_binary_manifest(*header)) return nullptr;
+  if (sizeof(ManifestHeader) + header->count * sizeof(ManifestRecord) > size) {
+    fprintf(stderr, "Binary manifest is truncated\n");
+    exit(1);
+  }
+  return header;
+}
+
+// Calls f(begin, end) for each line of file that starts in the shard's range
+template <typename F>
+void for_each_shard_line(const MappedFile& file, const ManifestShard& shard,
+                         F f) {
+  const char* data = file.data();
+  const char* end = data + file.size();
+  const char* range_end = data + std::min<uint64_t>(shard.end, file.size());
+  const char* line = data + std::min<uint64_t>(shard.begin, file.size());
+
+  // A line straddling the start of the range belongs to the previous shard
+  if (line > data && line[-1] != '\n') {
+    line = std::find(line, end, '\n');
+    if (line != end) line++;
+  }
+  while (line < range_end) {
+    const char* line_end = std::find(line, end, '\n');
+    f(line, line_end);
+    line = line_end == end ? end : line_end + 1;
+  }
+}
+
+}
+
+std::vector<ManifestEntry> read_manifest(std::istream& stream,
+                                         size_t max_entries,
+                                         bool* sizes_missing,
+                                         const EntryFilter& keep) {
+  std::vector<ManifestEntry> entries;
+  while (entries.size() < max_entries && stream.good()) {
+    std::string line;
+    std::getline(stream, line);
+
+    ManifestEntry entry;
+    if (!parse_entry(line, &entry)) {
+      break;
+    }
+    if (keep && !keep(entry)) continue;
+    if (needs_probe(entry)) {
+      *sizes_missing = true;
+    }
+    entries.push_back(entry);
+  }
+  return entries;
+}
+
+size_t count_manifest(std::istream& stream, const EntryFilter& keep) {
+  size_t count = 0;
+  std::string line;
+  while (std::getline(stream, line)) {
+    ManifestEntry entry;
+    if (!parse_entry(line, &entry)) break;
+    if (keep && !keep(entry)) continue;
+    count++;
+  }
+  return count;
+}
+
+uint64_t content_hash(const char* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= (unsigned char)data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+bool read_jpeg_size(const char* data, size_t size, int* width, int* height) {
+  try {
+    JPEGReader reader;
+    reader.header_mem((uint8_t*)data, size);
+    *width = reader.width();
+    *height = reader.height();
+    return *width > 0 && *height > 0;
+  } catch (const std::runtime_error& e) {
+    return false;
+  }
+}
+
+bool write_binary_manifest(const std::string& path,
+                           const std::vector<ManifestEntry>& entries) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == NULL) return false;
+
+  ManifestHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, manifest_magic, sizeof(manifest_magic));
+  header.version = manifest_version;
+  header.count = entries.size();
+  fwrite(&header, sizeof(header), 1, fp);
+
+  uint64_t offset = 0;
+  for (const ManifestEntry& entry : entries) {
+    ManifestRecord record;
+    record.path_offset = offset;
+    record.path_length = entry.path.size();
+    record.bytes = entry.bytes;
+    record.width = entry.width;
+    record.height = entry.height;
+    record.hash = entry.hash;
+    fwrite(&record, sizeof(record), 1, fp);
+    offset += entry.path.size();
+  }
+  for (const ManifestEntry& entry : entries) {
+    fwrite(entry.path.data(), 1, entry.path.size(), fp);
+  }
+  bool written = !ferror(fp);
+  return fclose(fp) == 0 && written;
+}
+
+std::vector<ManifestShard> split_manifests(
+  const std::vector<std::string>& paths, int parts) {
+  std::vector<ManifestShard> shards;
+  for (const std::string& path : paths) {
+    FILE* fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "Cannot open manifest %s\n", path.c_str());
+      return std::vector<ManifestShard>();
+    }
+    // Binary manifests are split by record, text ones by byte
+    ManifestHeader header;
+    size_t header_size = fread(&header, 1, sizeof(header), fp);
+    fseek(fp, 0, SEEK_END);
+    uint64_t size = ftell(fp);
+    fclose(fp);
+    if (header_size == sizeof(header) && is_binary_manifest(header)) {
+      size = header.count;
+    }
+    for (int i = 0; i < parts; ++i) {
+      ManifestShard shard;
+      shard.path = path;
+      shard.begin = size * i / parts;
+      shard.end = size * (i + 1) / parts;
+      shards.push_back(shard);
+    }
+  }
+  return shards;
+}
+
+std::vector<ManifestEntry> read_manifest_shard(const ManifestShard& shard,
+                                               bool* sizes_missing,
+                                               const EntryFilter& keep) {
+  MappedFile file(shard.path);
+  std::vector<ManifestEntry> entries;
+
+  const ManifestHeader* header = binary_header(file.data(), file.size());
+  if (header) {
+    const ManifestRecord* records = (const ManifestRecord*)(header + 1);
+    const char* paths = (const char*)(records + header->count);
+    uint64_t paths_size = file.data() + file.size() - paths;
+    uint64_t end = std::min<uint64_t>(shard.end, header->count);
+    for (uint64_t i = shard.begin; i < end; ++i) {
+      const ManifestRecord& record = records[i];
+      if (record.path_offset > paths_size ||
+          record.path_length > paths_size - record.path_offset) {
+        fprintf(stderr, "Binary manifest is truncated\n");
+        exit(1);
+      }
+      ManifestEntry entry;
+      entry.path.assign(paths + record.path_offset, record.path_length);
+      entry.width = record.width;
+      entry.height = record.height;
+      entry.bytes = record.bytes;
+      entry.hash = record.hash;
+      if (keep && !keep(entry)) continue;
+      entries.push_back(entry);
+    }
+    return entries;
+  }
+
+  for_each_shard_line(file, shard, [&](const char* begin, const char* end) {
+      ManifestEntry entry;
+      if (!parse_entry(std::string(begin, end), &entry)) return;
+      if (keep && !keep(entry)) return;
+      if (needs_probe(entry)) {
+        *sizes_missing = true;
+      }
+      entries.push_back(entry);
+    });
+  return entries;
+}
+
+size_t count_manifest_shard(const ManifestShard& shard,
+                            const EntryFilter& keep) {
+  // Filtered counts have to look at every entry
+  if (keep) {
+    bool sizes_missing = false;
+    return read_manifest_shard(shard, &sizes_missing, keep).size();
+  }
+
+  MappedFile file(shard.path);
+  const ManifestHeader* header = binary_header(file.data(), file.size());
+  if (header) {
+    uint64_t end = std::min<uint64_t>(shard.end, header->count);
+    return shard.begin < end ? end - shard.begin : 0;
+  }
+
+  size_t count = 0;
+  for_each_shard_line(file, shard, [&](const char* begin, const char* end) {
+      // Any non-blank line has a path
+      if (std::find_if(begin, end, [](char c) {
+            return !isspace((unsigned char)c);
+          }) != end) {
+        count++;
+      }
+    });
+  return count;
+}
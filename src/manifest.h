@@ -0,0 +1,120 @@
+#ifndef MANIFEST_H_
+#define MANIFEST_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+
+// A manifest lists the images to process, one per line:
+//
+//   <uri> [<width> <height> <bytes>]
+//
+// The optional fields give the source size and encoded length of the image
+// so they do not have to be probed. They are read from the end of the line,
+// so a URI may contain spaces; a line that does not end with all three is
+// taken to be a URI alone.
+//
+// A binary manifest holds the same entries, every one with its size, length
+// and content hash, in a form that is memory mapped rather than parsed.
+// Layout, little endian:
+//
+//   ManifestHeader             magic, version, number of entries
+//   ManifestRecord[count]      fixed-width entries, in manifest order
+//   path data                  the entries' paths back to back
+//
+// build_manifest writes one from a text manifest. Either form can be passed
+// to -manifest, and is recognized by its first bytes.
+
+const char manifest_magic[8] = {'V', 'D', 'B', 'M', 'A', 'N', 'I', 'F'};
+const uint32_t manifest_version = 1;
+
+struct ManifestHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t count;
+};
+
+struct ManifestRecord {
+  // Offset of the path from the start of the path data
+  uint64_t path_offset;
+  uint32_t path_length;
+  uint32_t bytes;
+  int32_t width;
+  int32_t height;
+  uint64_t hash;
+};
+
+struct ManifestEntry {
+  std::string path;
+  // Source image size, or zero if the manifest did not list it
+  int width;
+  int height;
+  // Encoded length, or zero if the manifest did not list it
+  int bytes;
+  // content_hash of the encoded image, or zero if the manifest did not list
+  // it; only binary manifests do
+  uint64_t hash;
+};
+
+// 64-bit FNV-1a hash of an encoded image
+uint64_t content_hash(const char* data, size_t size);
+
+// Reads the source size from the header of an encoded JPEG. Returns false if
+// data is not a JPEG the reader accepts.
+bool read_jpeg_size(const char* data, size_t size, int* width, int* height);
+
+// Writes entries to path as a binary manifest. Returns false if the file
+// cannot be written.
+bool write_binary_manifest(const std::string& path,
+                           const std::vector<ManifestEntry>& entries);
+
+// Chooses the entries a reader keeps; an empty filter keeps every entry
+typedef std::function<bool(const ManifestEntry&)> EntryFilter;
+
+// Reads manifest entries from stream until max_entries have been kept, the
+// stream ends or a line has no path. Sets *sizes_missing if any kept entry
+// needs to be probed.
+std::vector<ManifestEntry> read_manifest(std::istream& stream,
+                                         size_t max_entries,
+                                         bool* sizes_missing,
+                                         const EntryFilter& keep =
+                                           EntryFilter());
+
+// Returns the number of entries read_manifest would keep from the rest of
+// stream, without keeping them
+size_t count_manifest(std::istream& stream,
+                      const EntryFilter& keep = EntryFilter());
+
+// Part of a manifest file: the lines that start in bytes [begin, end) of a
+// text manifest, or records [begin, end) of a binary one. Shards of one file
+// can be read independently, each on the node that uses it.
+struct ManifestShard {
+  std::string path;
+  uint64_t begin;
+  uint64_t end;
+};
+
+// Splits each file into parts shards of roughly equal size. Returns an empty
+// list if a file cannot be opened.
+std::vector<ManifestShard> split_manifests(
+  const std::vector<std::string>& paths, int parts);
+
+// Memory maps the shard's file and reads the entries of the shard. Unlike
+// read_manifest, blank lines are skipped rather than ending the manifest,
+// since a shard cannot tell whether an earlier shard ended early. Exits if
+// the file cannot be mapped. Entries of binary manifests never need probing;
+// entries the builder could not read have a zero size and are not loaded.
+std::vector<ManifestEntry> read_manifest_shard(const ManifestShard& shard,
+                                               bool* sizes_missing,
+                                               const EntryFilter& keep =
+                                                 EntryFilter());
+
+// Returns the number of entries read_manifest_shard would return
+size_t count_manifest_shard(const ManifestShard& shard,
+                            const EntryFilter& keep = EntryFilter());
+
+#endif // MANIFEST_H_
@@ -0,0 +1,138 @@
+#include "options.h"
+#include "common.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+Options options;
+
+Options::Options()
+  : cache_dir(),
+    cache_size(16UL * 1024 * 1024 * 1024),
+    gcs_timeout_ms(30000),
+    gcs_retries(3),
+    gcs_hedge_percentile(0.0),
+    gcs_range_threshold(8UL * 1024 * 1024),
+    gcs_range_parts(8),
+    scaled_decode(false),
+    fused_decode(false),
+    decode_tradeoff(JPEG::DEFAULT),
+    compressed_regions(false),
+    filters(),
+    prefilters(),
+    dedup_distance(-1),
+    dedup_window(8),
+    manifest_chunk(0),
+    manifest_files(),
+    manifest_shards(0),
+    feature_store(),
+    knn_only(false),
+    incremental(false),
+    feature_type(FEATURE_FLOAT32) {}
+
+bool parse_decode_profile(const char* name,
+                          JPEG::TimeQualityTradeoff* tradeoff) {
+  if (!strcmp(name, "fast")) {
+    *tradeoff = JPEG::FASTER;
+  } else if (!strcmp(name, "default")) {
+    *tradeoff = JPEG::DEFAULT;
+  } else if (!strcmp(name, "accurate")) {
+    *tradeoff = JPEG::BETTER;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+namespace {
+
+// Exits on a malformed predicate, like other bad option values
+void add_filter(const char* spec, std::vector<FilterPredicate>* filters) {
+  FilterPredicate predicate;
+  if (!parse_filter_predicate(spec, &predicate)) {
+    fprintf(stderr, "Bad filter %s\n", spec);
+    exit(1);
+  }
+  if (filters->size() == MAX_FILTER_PREDICATES) {
+    fprintf(stderr, "At most %d filters are supported\n",
+            MAX_FILTER_PREDICATES);
+    exit(1);
+  }
+  filters->push_back(predicate);
+}
+
+}
+
+void parse_options(int argc, char** argv) {
+  for (int i = 1; i < argc; ++i) {
+    bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "-cache-dir") && has_value) {
+      options.cache_dir = argv[++i];
+    } else if (!strcmp(argv[i], "-cache-size") && has_value) {
+      options.cache_size = strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+    } else if (!strcmp(argv[i], "-gcs-timeout") && has_value) {
+      options.gcs_timeout_ms = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-gcs-retries") && has_value) {
+      options.gcs_retries = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-gcs-hedge") && has_value) {
+      options.gcs_hedge_percentile = atof(argv[++i]);
+      if (options.gcs_hedge_percentile < 0 ||
+          options.gcs_hedge_percentile >= 1) {
+        fprintf(stderr, "-gcs-hedge must be in [0, 1), not %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (!strcmp(argv[i], "-gcs-range-threshold") && has_value) {
+      options.gcs_range_threshold =
+        strtoull(argv[++i], NULL, 10) * 1024 * 1024;
+    } else if (!strcmp(argv[i], "-gcs-range-parts") && has_value) {
+      options.gcs_range_parts = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-scaled-decode")) {
+      options.scaled_decode = true;
+    } else if (!strcmp(argv[i], "-fused-decode")) {
+      options.fused_decode = true;
+    } else if (!strcmp(argv[i], "-compressed-regions")) {
+      options.compressed_regions = true;
+    } else if (!strcmp(argv[i], "-filter") && has_value) {
+      add_filter(argv[++i], &options.filters);
+    } else if (!strcmp(argv[i], "-prefilter") && has_value) {
+      add_filter(argv[++i], &options.prefilters);
+    } else if (!strcmp(argv[i], "-dedup") && has_value) {
+      options.dedup_distance = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-dedup-window") && has_value) {
+      options.dedup_window = atoi(argv[++i]);
+      if (options.dedup_window < 1 || options.dedup_window > BATCH_SIZE) {
+        fprintf(stderr, "-dedup-window must be in [1, %d], not %s\n",
+                BATCH_SIZE, argv[i]);
+        exit(1);
+      }
+    } else if (!strcmp(argv[i], "-manifest-chunk") && has_value) {
+      options.manifest_chunk = strtoull(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-manifest") && has_value) {
+      options.manifest_files.push_back(argv[++i]);
+    } else if (!strcmp(argv[i], "-manifest-shards") && has_value) {
+      options.manifest_shards = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-feature-store") && has_value) {
+      options.feature_store = argv[++i];
+    } else if (!strcmp(argv[i], "-knn-only")) {
+      options.knn_only = true;
+    } else if (!strcmp(argv[i], "-incremental")) {
+      options.incremental = true;
+    } else if (!strcmp(argv[i], "-feature-precision") && has_value) {
+      if (!parse_feature_type(argv[++i], &options.feature_type)) {
+        fprintf(stderr, "Unknown feature precision %s\n", argv[i]);
+        exit(1);
+      }
+    } else if (!strcmp(argv[i], "-decode-profile") && has_value) {
+      if (!parse_decode_profile(argv[++i], &options.decode_tradeoff)) {
+        fprintf(stderr, "Unknown decode profile %s\n", argv[i]);
+        exit(1);
+      }
+    }
+  }
+  if ((options.knn_only || options.incremental) &&
+      options.feature_store.empty()) {
+    fprintf(stderr, "-knn-only and -incremental need a -feature-store\n");
+    exit(1);
+  }
+}
@@ -0,0 +1,131 @@
+#ifndef OPTIONS_H_
+#define OPTIONS_H_
+
+#include <string>
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+
+#include "feature_precision.h"
+#include "frame_filters.h"
+#include "jpeg/JPEG.h"
+
+// Settings chosen on the command line. Every process parses argv in main()
+// before starting the runtime, so tasks on any node see the same values.
+struct Options {
+  Options();
+
+  // Directory for the on-disk object cache; empty disables the cache
+  std::string cache_dir;
+  // Soft cap on the bytes kept in cache_dir
+  size_t cache_size;
+
+  // Deadline for a single GCS read attempt
+  int gcs_timeout_ms;
+  // Attempts after a failed GCS read before the image is dropped
+  int gcs_retries;
+  // Latency percentile after which a duplicate GCS read is issued; zero
+  // disables hedging
+  double gcs_hedge_percentile;
+  // GCS objects larger than this are fetched as concurrent byte ranges; zero
+  // reads every object as a single stream
+  size_t gcs_range_threshold;
+  // Number of concurrent byte ranges per large object
+  int gcs_range_parts;
+
+  // Decode JPEGs at the smallest DCT scale that still covers the network's
+  // input resolution instead of at full size
+  bool scaled_decode;
+  // Stream decoded scanlines through the horizontal resample and channel
+  // flip of to_conv_patch instead of storing 8-bit frames. Rows are stored
+  // as 16-bit samples DECODE_TARGET_WIDTH wide, so frames narrower than
+  // twice that take more region memory than 8-bit ones, and wider frames
+  // less.
+  bool fused_decode;
+  // libjpeg IDCT and upsampling settings used by the load task
+  JPEG::TimeQualityTradeoff decode_tradeoff;
+  // Keep images JPEG compressed in their regions and decode them in the
+  // tasks that consume them, so regions moved between nodes stay small
+  bool compressed_regions;
+
+  // Content predicates a frame must pass before features are computed; none
+  // keeps every frame that loads. Like prefilters, and like the hashes
+  // -dedup compares, they are measured on the frame's eighth-scale
+  // thumbnail, so thresholds do not depend on the decode options.
+  std::vector<FilterPredicate> filters;
+  // Predicates checked on a thumbnail built from each JPEG's DC coefficients
+  // before it is decoded; frames that fail are never decoded
+  std::vector<FilterPredicate> prefilters;
+
+  // Frames whose perceptual hash is within this many bits of a recent kept
+  // frame from the same capture are dropped as near-duplicates; negative
+  // keeps every frame
+  int dedup_distance;
+  // Number of recent kept frames of its own capture each frame is compared
+  // against. Frames are only compared within their load batch of BATCH_SIZE,
+  // so the first frame of a capture in each batch is always kept and the
+  // window is at most the batch size.
+  int dedup_window;
+
+  // Manifest entries read and launched at a time, so reading images.txt
+  // overlaps with processing; zero reads the whole manifest first
+  size_t manifest_chunk;
+  // Text or binary manifests read in shards instead of images.txt; empty
+  // reads images.txt
+  std::vector<std::string> manifest_files;
+  // Byte ranges each manifest is split into. With either option set, every
+  // shard is read and processed by its own first-level task instead of by the
+  // main task, and -manifest-chunk is ignored.
+  int manifest_shards;
+
+  // URI of the feature store each batch's vectors are added to; empty keeps
+  // vectors only for the run. Stores read back must be file:// URIs.
+  std::string feature_store;
+  // Run KNN on the vectors already in feature_store instead of computing any
+  bool knn_only;
+  // Only process manifest entries feature_store has no record of, and run
+  // KNN on their vectors together with the store's
+  bool incremental;
+  // Element type of the vector regions and of the vectors written to
+  // feature_store; a store is only read with the type it was written with
+  FeatureType feature_type;
+};
+
+extern Options options;
+
+// Maps "fast", "default" and "accurate" to a libjpeg tradeoff. Returns false
+// for any other name.
+bool parse_decode_profile(const char* name,
+                          JPEG::TimeQualityTradeoff* tradeoff);
+
+// Recognizes:
+//   -cache-dir <dir>     cache objects read from GCS under <dir>
+//   -cache-size <MB>     evict least recently used entries above <MB>
+//   -gcs-timeout <ms>    give up on a GCS read attempt after <ms>
+//   -gcs-retries <n>     retry failed GCS reads <n> times with backoff
+//   -gcs-hedge <p>       hedge GCS reads slower than percentile <p> (0-1)
+//   -gcs-range-threshold <MB>  split GCS objects above <MB> into ranges
+//   -gcs-range-parts <n>       fetch <n> ranges of a large object at once
+//   -scaled-decode             decode at a reduced DCT scale when possible
+//   -fused-decode              resample rows as they are decoded; stores
+//                              16-bit rows 256 wide
+//   -decode-profile <name>     fast, default or accurate JPEG decoding
+//   -compressed-regions        store JPEGs in regions, decode where used
+//   -filter <measure:min:max>  drop frames whose measure is out of range;
+//                              may be repeated
+//   -prefilter <measure:min:max>  the same, checked before decoding
+//   -dedup <bits>              drop frames within <bits> of a recent frame
+//   -dedup-window <n>          compare against the last <n> kept frames
+//                              of the same load batch (at most 32)
+//   -manifest-chunk <n>        stream images.txt <n> entries at a time
+//   -manifest <file>           read entries from <file>, a text or binary
+//                              manifest; may be repeated
+//   -manifest-shards <n>       split each manifest into <n> shards
+//   -feature-store <uri>       add computed vectors to the store at <uri>
+//   -knn-only                  run KNN on the feature store's vectors
+//   -incremental               skip entries already in the feature store
+//   -feature-precision <type>  keep vectors as fp32, fp16 or int8
+// Arguments it does not recognize are left for Legion.
+void parse_options(int argc, char** argv);
+
+#endif // OPTIONS_H_
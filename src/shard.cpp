@@ -0,0 +1,408 @@
+#include "shard.h"
+#include "storage.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace {
+
+// Bytes fetched when a shard's index is first needed. Covers the index of a
+// shard with a few thousand frames in one request.
+const size_t index_prefetch = 64 * 1024;
+
+// Reading the whole shard is preferred to a range once the range covers this
+// fraction of it, since whole objects are cached and fetched in parallel parts
+const double whole_shard_fraction = 0.75;
+
+// Frames are fetched in runs rather than as one range when less than this
+// fraction of the range spanning them would be used
+const double dense_fraction = 0.5;
+
+// Frames of a run may be this far apart. Pulling in a gap this small costs
+// less than a request of its own.
+const size_t merge_gap = 16 * 1024;
+
+// Number of shard indices kept in memory. Least recently used ones are
+// dropped first.
+const size_t max_cached_indices = 1024;
+
+struct ShardIndex {
+  std::vector<ShardEntry> entries;
+  // End of the last frame, i.e. the size of the shard
+  size_t size;
+};
+
+// Indices of the shards this process has read from most recently, with the
+// most recently used at the front of indices_lru. Shards are immutable once
+// written, so entries are never invalidated.
+std::mutex indices_mutex;
+std::list<std::string> indices_lru;
+std::map<std::string,
+         std::pair<std::shared_ptr<const ShardIndex>,
+                   std::list<std::string>::iterator>> indices;
+
+std::shared_ptr<const ShardIndex> cached_index(const std::string& shard_uri) {
+  std::lock_guard<std::mutex> lock(indices_mutex);
+  auto it = indices.find(shard_uri);
+  if (it == indices.end()) return nullptr;
+  indices_lru.splice(indices_lru.begin(), indices_lru, it->second.second);
+  return it->second.first;
+}
+
+std::shared_ptr<const ShardIndex> cache_index(
+    const std::string& shard_uri,
+    std::shared_ptr<const ShardIndex> index) {
+  std::lock_guard<std::mutex> lock(indices_mutex);
+  auto it = indices.find(shard_uri);
+  if (it != indices.end()) return it->second.first;
+
+  indices_lru.push_front(shard_uri);
+  indices.emplace(shard_uri, std::make_pair(index, indices_lru.begin()));
+  while (indices.size() > max_cached_indices) {
+    indices.erase(indices_lru.back());
+    indices_lru.pop_back();
+  }
+  return index;
+}
+
+// Checks the header at the start of a shard and stores the end of its index
+// in *index_end. Returns false if head is not the start of a shard.
+bool parse_header(const std::string& shard_uri,
+                  const char* head,
+                  size_t size,
+                  size_t* index_end) {
+  ShardHeader header;
+  if (size < sizeof(header)) {
+    fprintf(stderr, "Shard %s is truncated\n", shard_uri.c_str());
+    return false;
+  }
+  memcpy(&header, head, sizeof(header));
+  if (memcmp(header.magic, shard_magic, sizeof(shard_magic)) != 0 ||
+      header.version != shard_version) {
+    fprintf(stderr, "%s is not a shard\n", shard_uri.c_str());
+    return false;
+  }
+  *index_end = sizeof(header) + (size_t)header.count * sizeof(ShardEntry);
+  return true;
+}
+
+// head holds at least the first index_end bytes of the shard
+std::shared_ptr<const ShardIndex> parse_index(const char* head,
+                                              size_t index_end) {
+  std::shared_ptr<ShardIndex> index(new ShardIndex);
+  index->entries.resize((index_end - sizeof(ShardHeader)) /
+                        sizeof(ShardEntry));
+  memcpy(index->entries.data(), head + sizeof(ShardHeader),
+         index->entries.size() * sizeof(ShardEntry));
+  index->size = index_end;
+  for (const ShardEntry& entry : index->entries) {
+    index->size = std::max(index->size, (size_t)(entry.offset + entry.size));
+  }
+  return index;
+}
+
+// Returns the index of every shard in shard_uris, or NULL for shards that
+// could not be read. Indices that are not cached are fetched in one batch,
+// plus a second one for indices larger than index_prefetch.
+std::vector<std::shared_ptr<const ShardIndex>> load_indices(
+    const std::vector<std::string>& shard_uris) {
+  std::vector<std::shared_ptr<const ShardIndex>> result(shard_uris.size());
+  std::vector<size_t> misses;
+  std::vector<std::string> miss_uris;
+  for (size_t i = 0; i < shard_uris.size(); ++i) {
+    result[i] = cached_index(shard_uris[i]);
+    if (result[i] == nullptr) {
+      misses.push_back(i);
+      miss_uris.push_back(shard_uris[i]);
+    }
+  }
+  if (misses.empty()) return result;
+
+  std::vector<char*> heads;
+  std::vector<size_t> sizes;
+  read_object_ranges(miss_uris,
+                     std::vector<size_t>(misses.size(), 0),
+                     std::vector<size_t>(misses.size(), index_prefetch),
+                     heads, sizes);
+
+  std::vector<size_t> large;
+  std::vector<std::string> large_uris;
+  std::vector<size_t> large_ends;
+  for (size_t j = 0; j < misses.size(); ++j) {
+    if (heads[j] == nullptr) continue;
+    size_t index_end;
+    if (parse_header(miss_uris[j], heads[j], sizes[j], &index_end)) {
+      if (index_end <= sizes[j]) {
+        result[misses[j]] =
+          cache_index(miss_uris[j], parse_index(heads[j], index_end));
+      } else {
+        large.push_back(misses[j]);
+        large_uris.push_back(miss_uris[j]);
+        large_ends.push_back(index_end);
+      }
+    }
+    free(heads[j]);
+  }
+  if (large.empty()) return result;
+
+  read_object_ranges(large_uris, std::vector<size_t>(large.size(), 0),
+                     large_ends, heads, sizes);
+  for (size_t j = 0; j < large.size(); ++j) {
+    if (heads[j] == nullptr) continue;
+    if (sizes[j] < large_ends[j]) {
+      fprintf(stderr, "Shard %s is truncated\n", large_uris[j].c_str());
+    } else {
+      result[large[j]] =
+        cache_index(large_uris[j], parse_index(heads[j], large_ends[j]));
+    }
+    free(heads[j]);
+  }
+  return result;
+}
+
+// One read that frames of a batch are sliced out of
+struct Fetch {
+  std::string uri;
+  size_t offset;
+  size_t length;
+  // Batch slot and shard entry of each frame in [offset, offset + length)
+  std::vector<std::pair<size_t, ShardEntry>> frames;
+};
+
+bool by_offset(const std::pair<size_t, ShardEntry>& a,
+               const std::pair<size_t, ShardEntry>& b) {
+  return a.second.offset < b.second.offset;
+}
+
+// Decides how the members of one shard are read. Frames that cover most of
+// the shard are sliced out of the whole object, which is added to objects.
+// Otherwise they are read as ranges: one spanning all of them if they are
+// dense, or else one per run of frames at most merge_gap apart.
+void plan_shard(const std::string& shard_uri,
+                const ShardIndex& index,
+                const std::vector<std::pair<size_t, int>>& members,
+                std::vector<Fetch>* ranges,
+                std::vector<Fetch>* objects) {
+  std::vector<std::pair<size_t, ShardEntry>> frames;
+  size_t begin = index.size;
+  size_t end = 0;
+  size_t wanted = 0;
+  for (const auto& member : members) {
+    if (member.second >= (int)index.entries.size()) {
+      fprintf(stderr, "Shard %s has no frame %d\n",
+              shard_uri.c_str(), member.second);
+      continue;
+    }
+    const ShardEntry& entry = index.entries[member.second];
+    frames.push_back(std::make_pair(member.first, entry));
+    begin = std::min(begin, (size_t)entry.offset);
+    end = std::max(end, (size_t)(entry.offset + entry.size));
+    wanted += entry.size;
+  }
+  if (frames.empty()) return;
+
+  Fetch fetch;
+  fetch.uri = shard_uri;
+  if (wanted >= dense_fraction * (end - begin)) {
+    if (end - begin >= whole_shard_fraction * index.size) {
+      fetch.offset = 0;
+      fetch.length = index.size;
+      fetch.frames = frames;
+      objects->push_back(fetch);
+    } else {
+      fetch.offset = begin;
+      fetch.length = end - begin;
+      fetch.frames = frames;
+      ranges->push_back(fetch);
+    }
+    return;
+  }
+
+  // Scattered frames are cheaper to fetch in runs than to pull in everything
+  // between them
+  std::sort(frames.begin(), frames.end(), by_offset);
+  for (const auto& frame : frames) {
+    size_t frame_end = frame.second.offset + frame.second.size;
+    if (!fetch.frames.empty() &&
+        frame.second.offset <= fetch.offset + fetch.length + merge_gap) {
+      fetch.length = std::max(fetch.length, frame_end - fetch.offset);
+    } else {
+      if (!fetch.frames.empty()) ranges->push_back(fetch);
+      fetch.frames.clear();
+      fetch.offset = frame.second.offset;
+      fetch.length = frame.second.size;
+    }
+    fetch.frames.push_back(frame);
+  }
+  ranges->push_back(fetch);
+}
+
+}
+
+int ShardWriter::add(const char* data, size_t size) {
+  ShardEntry entry;
+  entry.offset = data_.size();
+  entry.size = size;
+  entries_.push_back(entry);
+  data_.insert(data_.end(), data, data + size);
+  return entries_.size() - 1;
+}
+
+size_t ShardWriter::size() const {
+  return sizeof(ShardHeader) + entries_.size() * sizeof(ShardEntry) +
+    data_.size();
+}
+
+std::vector<char> ShardWriter::finish() const {
+  ShardHeader header;
+  memcpy(header.magic, shard_magic, sizeof(shard_magic));
+  header.version = shard_version;
+  header.count = entries_.size();
+
+  size_t data_start = sizeof(header) + entries_.size() * sizeof(ShardEntry);
+  std::vector<char> shard(data_start);
+  memcpy(shard.data(), &header, sizeof(header));
+
+  // Entries are kept relative to the data section until the index size is
+  // known
+  ShardEntry* index = (ShardEntry*)(shard.data() + sizeof(header));
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    index[i].offset = data_start + entries_[i].offset;
+    index[i].size = entries_[i].size;
+  }
+
+  shard.insert(shard.end(), data_.begin(), data_.end());
+  return shard;
+}
+
+void ShardWriter::clear() {
+  entries_.clear();
+  data_.clear();
+}
+
+bool parse_shard_uri(const std::string& uri,
+                     std::string* shard_uri,
+                     int* index) {
+  size_t hash = uri.rfind('#');
+  if (hash == std::string::npos || hash + 1 == uri.size()) return false;
+
+  char* end;
+  long value = strtol(uri.c_str() + hash + 1, &end, 10);
+  if (*end != '\0' || value < 0) return false;
+
+  *shard_uri = uri.substr(0, hash);
+  *index = value;
+  return true;
+}
+
+std::string shard_member_uri(const std::string& shard_uri, int index) {
+  return shard_uri + "#" + std::to_string(index);
+}
+
+FrameBatch::~FrameBatch() {
+  for (char* buffer : buffers_) {
+    free(buffer);
+  }
+}
+
+int FrameBatch::read(const std::vector<std::string>& uris) {
+  data_.assign(uris.size(), nullptr);
+  sizes_.assign(uris.size(), 0);
+
+  // Frames grouped by the shard holding them, as (batch slot, shard index)
+  std::map<std::string, std::vector<std::pair<size_t, int>>> shards;
+  std::vector<size_t> loose;
+  std::vector<std::string> loose_uris;
+  for (size_t i = 0; i < uris.size(); ++i) {
+    std::string shard_uri;
+    int index;
+    if (parse_shard_uri(uris[i], &shard_uri, &index)) {
+      shards[shard_uri].push_back(std::make_pair(i, index));
+    } else {
+      loose.push_back(i);
+      loose_uris.push_back(uris[i]);
+    }
+  }
+
+  std::vector<std::string> shard_uris;
+  for (const auto& shard : shards) {
+    shard_uris.push_back(shard.first);
+  }
+  std::vector<std::shared_ptr<const ShardIndex>> shard_indices =
+    load_indices(shard_uris);
+
+  std::vector<Fetch> ranges;
+  std::vector<Fetch> objects;
+  size_t s = 0;
+  for (const auto& shard : shards) {
+    const std::shared_ptr<const ShardIndex>& index = shard_indices[s++];
+    if (index == nullptr) continue;
+    plan_shard(shard.first, *index, shard.second, &ranges, &objects);
+  }
+
+  auto slice = [this](const Fetch& fetch, char* data, size_t size) {
+    if (data == nullptr) return;
+    buffers_.push_back(data);
+    for (const auto& frame : fetch.frames) {
+      if (frame.second.offset + frame.second.size > fetch.offset + size)
+        continue;
+      data_[frame.first] = data + (frame.second.offset - fetch.offset);
+      sizes_[frame.first] = frame.second.size;
+    }
+  };
+
+  // Whole shards and loose objects are read in one batch, and all ranges
+  // across shards in another
+  if (!objects.empty() || !loose.empty()) {
+    std::vector<std::string> object_uris;
+    for (const Fetch& fetch : objects) {
+      object_uris.push_back(fetch.uri);
+    }
+    object_uris.insert(object_uris.end(), loose_uris.begin(), loose_uris.end());
+
+    std::vector<char*> object_buffers;
+    std::vector<size_t> object_sizes;
+    read_objects(object_uris, object_buffers, object_sizes);
+    for (size_t j = 0; j < objects.size(); ++j) {
+      slice(objects[j], object_buffers[j], object_sizes[j]);
+    }
+    for (size_t j = 0; j < loose.size(); ++j) {
+      char* buffer = object_buffers[objects.size() + j];
+      if (buffer == nullptr) continue;
+      buffers_.push_back(buffer);
+      data_[loose[j]] = buffer;
+      sizes_[loose[j]] = object_sizes[objects.size() + j];
+    }
+  }
+
+  if (!ranges.empty()) {
+    std::vector<std::string> range_uris;
+    std::vector<size_t> offsets;
+    std::vector<size_t> lengths;
+    for (const Fetch& fetch : ranges) {
+      range_uris.push_back(fetch.uri);
+      offsets.push_back(fetch.offset);
+      lengths.push_back(fetch.length);
+    }
+
+    std::vector<char*> range_buffers;
+    std::vector<size_t> range_sizes;
+    read_object_ranges(range_uris, offsets, lengths,
+                       range_buffers, range_sizes);
+    for (size_t j = 0; j < ranges.size(); ++j) {
+      slice(ranges[j], range_buffers[j], range_sizes[j]);
+    }
+  }
+
+  int failed = 0;
+  for (const char* data : data_) {
+    if (data == nullptr) failed++;
+  }
+  return failed;
+}
@@ -0,0 +1,90 @@
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A shard packs many encoded frames into one object so that fetching a batch
+// costs one request instead of one per frame. Layout, little endian:
+//
+//   ShardHeader            magic, version, number of frames
+//   ShardEntry[count]      byte offset and size of each frame in the shard
+//   frame data             encoded frames back to back, in index order
+//
+// Manifest entries name a frame inside a shard as "<shard-uri>#<index>".
+
+const char shard_magic[8] = {'V', 'D', 'B', 'S', 'H', 'A', 'R', 'D'};
+const uint32_t shard_version = 1;
+
+struct ShardHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+};
+
+struct ShardEntry {
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Accumulates frames in memory and serializes them as one shard.
+class ShardWriter {
+public:
+  // Copies size bytes from data and returns the frame's index in the shard
+  int add(const char* data, size_t size);
+
+  int count() const { return entries_.size(); }
+
+  // Bytes the serialized shard will occupy
+  size_t size() const;
+
+  // Lays out header, index and frames in one contiguous buffer
+  std::vector<char> finish() const;
+
+  void clear();
+
+private:
+  std::vector<ShardEntry> entries_;
+  std::vector<char> data_;
+};
+
+// Splits "<shard-uri>#<index>" into its parts. Returns false for URIs that do
+// not name a frame in a shard.
+bool parse_shard_uri(const std::string& uri,
+                     std::string* shard_uri,
+                     int* index);
+
+std::string shard_member_uri(const std::string& shard_uri, int index);
+
+// Encoded frames of a batch, read with as few requests as possible. Frames
+// that live in the same shard are sliced out of the whole object, the byte
+// range spanning them, or, when they are scattered, ranges covering runs of
+// nearby frames, and are decoded in place. Other URIs are read with
+// read_objects. The reads for all shards of a batch are issued together so
+// they run concurrently. Frame pointers stay valid until the batch is
+// destroyed.
+class FrameBatch {
+public:
+  FrameBatch() {}
+  ~FrameBatch();
+
+  // Returns the number of frames that could not be read
+  int read(const std::vector<std::string>& uris);
+
+  // NULL if frame i could not be read
+  const char* data(size_t i) const { return data_[i]; }
+
+  size_t size(size_t i) const { return sizes_[i]; }
+
+private:
+  FrameBatch(const FrameBatch&);
+  FrameBatch& operator=(const FrameBatch&);
+
+  std::vector<char*> buffers_;
+  std::vector<const char*> data_;
+  std::vector<size_t> sizes_;
+};
+
+#endif // SHARD_H_
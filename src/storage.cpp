@@ -0,0 +1,370 @@
+#include "storage.h"
+#include "cached_storage.h"
+#include "options.h"
+#include "util.h"
+#include "libgcs.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+const std::string gcs_scheme = "gs://";
+const std::string file_scheme = "file://";
+
+std::mutex backends_mutex;
+std::map<std::string, std::unique_ptr<Storage>> backends;
+
+Storage* get_backend(const std::string& name,
+                     std::function<Storage*()> create) {
+  std::lock_guard<std::mutex> lock(backends_mutex);
+  auto it = backends.find(name);
+  if (it == backends.end()) {
+    it = backends.emplace(name, std::unique_ptr<Storage>(create())).first;
+  }
+  return it->second.get();
+}
+
+bool starts_with(const std::string& str, const std::string& prefix) {
+  return str.compare(0, prefix.size(), prefix) == 0;
+}
+
+}
+
+int Storage::read_many(const std::vector<std::string>& paths,
+                       std::vector<char*>& buffers,
+                       std::vector<size_t>& sizes) {
+  buffers.assign(paths.size(), nullptr);
+  sizes.assign(paths.size(), 0);
+
+  int failed = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    buffers[i] = read(paths[i], &sizes[i]);
+    if (buffers[i] == nullptr) failed++;
+  }
+  return failed;
+}
+
+int Storage::read_ranges(const std::vector<std::string>& paths,
+                         const std::vector<size_t>& offsets,
+                         const std::vector<size_t>& lengths,
+                         std::vector<char*>& buffers,
+                         std::vector<size_t>& sizes) {
+  buffers.assign(paths.size(), nullptr);
+  sizes.assign(paths.size(), 0);
+
+  int failed = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    buffers[i] = read_range(paths[i], offsets[i], lengths[i], &sizes[i]);
+    if (buffers[i] == nullptr) failed++;
+  }
+  return failed;
+}
+
+GCSStorage::GCSStorage(const std::string& key, const std::string& bucket)
+  : key_(key), bucket_(bucket) {
+  gcs_set_read_policy(options.gcs_timeout_ms,
+                      options.gcs_retries,
+                      options.gcs_hedge_percentile);
+  gcs_set_range_policy(options.gcs_range_threshold, options.gcs_range_parts);
+}
+
+char* GCSStorage::read(const std::string& path, size_t* size) {
+  return read_gcs_buffer(key_, bucket_, path, size);
+}
+
+char* GCSStorage::read_range(const std::string& path,
+                             size_t offset,
+                             size_t length,
+                             size_t* size) {
+  return read_gcs_range(key_, bucket_, path, offset, length, size);
+}
+
+int GCSStorage::read_many(const std::vector<std::string>& paths,
+                          std::vector<char*>& buffers,
+                          std::vector<size_t>& sizes) {
+  return read_gcs_buffers(key_, bucket_, paths, buffers, sizes);
+}
+
+int GCSStorage::read_ranges(const std::vector<std::string>& paths,
+                            const std::vector<size_t>& offsets,
+                            const std::vector<size_t>& lengths,
+                            std::vector<char*>& buffers,
+                            std::vector<size_t>& sizes) {
+  return read_gcs_ranges(key_, bucket_, paths, offsets, lengths,
+                         buffers, sizes);
+}
+
+FILE* GCSStorage::write(const std::string& path) {
+  return write_gcs_file(key_, bucket_, path);
+}
+
+void GCSStorage::close_write(FILE* fp, const std::string& path) {
+  close_gcs_write_file(fp, path);
+}
+
+void GCSStorage::write_buffer(const std::string& path,
+                              const char* data,
+                              size_t size) {
+  write_gcs_buffer(key_, bucket_, path, data, size);
+}
+
+bool GCSStorage::exists(const std::string& path) {
+  GoString key_str;
+  key_str.p = (char*)key_.c_str();
+  key_str.n = key_.size();
+
+  GoString bucket_str;
+  bucket_str.p = (char*)bucket_.c_str();
+  bucket_str.n = bucket_.size();
+
+  GoString path_str;
+  path_str.p = (char*)path.c_str();
+  path_str.n = path.size();
+
+  return gcs_object_exists(key_str, bucket_str, path_str);
+}
+
+char* FileStorage::read(const std::string& path, size_t* size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return nullptr;
+  }
+
+  // Allocate at least one byte so an empty file is not mistaken for an error
+  char* data = (char*)malloc(st.st_size > 0 ? st.st_size : 1);
+  size_t total = 0;
+  while (total < (size_t)st.st_size) {
+    ssize_t num_read = pread(fd, data + total, st.st_size - total, total);
+    if (num_read <= 0) {
+      free(data);
+      close(fd);
+      return nullptr;
+    }
+    total += num_read;
+  }
+  close(fd);
+
+  *size = total;
+  return data;
+}
+
+char* FileStorage::read_range(const std::string& path,
+                              size_t offset,
+                              size_t length,
+                              size_t* size) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) return nullptr;
+
+  char* data = (char*)malloc(length > 0 ? length : 1);
+  size_t total = 0;
+  while (total < length) {
+    ssize_t num_read = pread(fd, data + total, length - total, offset + total);
+    if (num_read == 0) break;
+    if (num_read < 0) {
+      free(data);
+      close(fd);
+      return nullptr;
+    }
+    total += num_read;
+  }
+  close(fd);
+
+  *size = total;
+  return data;
+}
+
+FILE* FileStorage::write(const std::string& path) {
+  FILE* fp = fopen(path.c_str(), "wb");
+  if (fp == NULL)
+    throw std::runtime_error("Cannot open " + path);
+  return fp;
+}
+
+void FileStorage::close_write(FILE* fp, const std::string& path) {
+  fclose(fp);
+}
+
+void FileStorage::write_buffer(const std::string& path,
+                               const char* data,
+                               size_t size) {
+  // Written to a temporary file that is renamed into place, so readers never
+  // see a partial object and a failed write leaves the old one intact. The
+  // name is unique per process and thread like the cache's temporary files.
+  std::stringstream temp;
+  temp << path << ".tmp." << getpid() << "."
+       << std::hash<std::thread::id>()(std::this_thread::get_id());
+
+  int fd = open(temp.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    throw std::runtime_error("Cannot open " + temp.str());
+
+  size_t total = 0;
+  while (total < size) {
+    ssize_t num_written = pwrite(fd, data + total, size - total, total);
+    if (num_written <= 0) {
+      close(fd);
+      unlink(temp.str().c_str());
+      throw std::runtime_error("Cannot write " + path);
+    }
+    total += num_written;
+  }
+  if (close(fd) == -1 || rename(temp.str().c_str(), path.c_str()) == -1) {
+    unlink(temp.str().c_str());
+    throw std::runtime_error("Cannot write " + path);
+  }
+}
+
+bool FileStorage::exists(const std::string& path) {
+  return access(path.c_str(), F_OK) == 0;
+}
+
+Storage* storage_for_uri(const std::string& uri, std::string* path) {
+  if (starts_with(uri, file_scheme)) {
+    *path = uri.substr(file_scheme.size());
+    return get_backend(file_scheme, []() { return new FileStorage(); });
+  }
+
+  std::string bucket = gcs_bucket;
+  if (starts_with(uri, gcs_scheme)) {
+    size_t slash = uri.find('/', gcs_scheme.size());
+    if (slash == std::string::npos)
+      throw std::runtime_error("Missing object path in " + uri);
+    bucket = uri.substr(gcs_scheme.size(), slash - gcs_scheme.size());
+    *path = uri.substr(slash + 1);
+  } else {
+    *path = uri;
+  }
+  std::string name = gcs_scheme + bucket;
+  return get_backend(name, [&]() -> Storage* {
+    Storage* gcs = new GCSStorage(gcs_key, bucket);
+    if (options.cache_dir.empty()) return gcs;
+    return new CachedStorage(name, gcs, options.cache_dir, options.cache_size);
+  });
+}
+
+char* read_object(const std::string& uri, size_t* size) {
+  std::string path;
+  Storage* storage = storage_for_uri(uri, &path);
+  return storage->read(path, size);
+}
+
+char* read_object_range(const std::string& uri,
+                        size_t offset,
+                        size_t length,
+                        size_t* size) {
+  std::string path;
+  Storage* storage = storage_for_uri(uri, &path);
+  return storage->read_range(path, offset, length, size);
+}
+
+int read_objects(const std::vector<std::string>& uris,
+                 std::vector<char*>& buffers,
+                 std::vector<size_t>& sizes) {
+  buffers.assign(uris.size(), nullptr);
+  sizes.assign(uris.size(), 0);
+
+  // Group requests by backend so each backend sees a single batch
+  std::map<Storage*, std::vector<size_t>> groups;
+  std::vector<std::string> paths(uris.size());
+  for (size_t i = 0; i < uris.size(); ++i) {
+    groups[storage_for_uri(uris[i], &paths[i])].push_back(i);
+  }
+
+  int failed = 0;
+  for (auto& group : groups) {
+    std::vector<std::string> group_paths;
+    for (size_t i : group.second) {
+      group_paths.push_back(paths[i]);
+    }
+
+    std::vector<char*> group_buffers;
+    std::vector<size_t> group_sizes;
+    failed += group.first->read_many(group_paths, group_buffers, group_sizes);
+
+    for (size_t j = 0; j < group.second.size(); ++j) {
+      buffers[group.second[j]] = group_buffers[j];
+      sizes[group.second[j]] = group_sizes[j];
+    }
+  }
+  return failed;
+}
+
+int read_object_ranges(const std::vector<std::string>& uris,
+                       const std::vector<size_t>& offsets,
+                       const std::vector<size_t>& lengths,
+                       std::vector<char*>& buffers,
+                       std::vector<size_t>& sizes) {
+  buffers.assign(uris.size(), nullptr);
+  sizes.assign(uris.size(), 0);
+
+  std::map<Storage*, std::vector<size_t>> groups;
+  std::vector<std::string> paths(uris.size());
+  for (size_t i = 0; i < uris.size(); ++i) {
+    groups[storage_for_uri(uris[i], &paths[i])].push_back(i);
+  }
+
+  int failed = 0;
+  for (auto& group : groups) {
+    std::vector<std::string> group_paths;
+    std::vector<size_t> group_offsets;
+    std::vector<size_t> group_lengths;
+    for (size_t i : group.second) {
+      group_paths.push_back(paths[i]);
+      group_offsets.push_back(offsets[i]);
+      group_lengths.push_back(lengths[i]);
+    }
+
+    std::vector<char*> group_buffers;
+    std::vector<size_t> group_sizes;
+    failed += group.first->read_ranges(group_paths, group_offsets,
+                                       group_lengths, group_buffers,
+                                       group_sizes);
+
+    for (size_t j = 0; j < group.second.size(); ++j) {
+      buffers[group.second[j]] = group_buffers[j];
+      sizes[group.second[j]] = group_sizes[j];
+    }
+  }
+  return failed;
+}
+
+FILE* write_object(const std::string& uri) {
+  std::string path;
+  Storage* storage = storage_for_uri(uri, &path);
+  return storage->write(path);
+}
+
+void close_write_object(FILE* fp, const std::string& uri) {
+  std::string path;
+  Storage* storage = storage_for_uri(uri, &path);
+  storage->close_write(fp, path);
+}
+
+void write_object_buffer(const std::string& uri,
+                         const char* data,
+                         size_t size) {
+  std::string path;
+  Storage* storage = storage_for_uri(uri, &path);
+  storage->write_buffer(path, data, size);
+}
+
+bool object_exists(const std::string& uri) {
+  std::string path;
+  Storage* storage = storage_for_uri(uri, &path);
+  return storage->exists(path);
+}
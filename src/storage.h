@@ -0,0 +1,152 @@
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+// A place objects can be read from and written to. Manifest entries name
+// objects with a URI whose scheme selects the backend:
+//
+//   gs://bucket/path    object in a GCS bucket
+//   file:///abs/path    file on a POSIX filesystem (local disk, NFS, ...)
+//   path                object in the default gcs_bucket
+class Storage {
+public:
+  virtual ~Storage() {}
+
+  // Returns the whole object in a malloc'd buffer of *size bytes, or NULL if
+  // it could not be read. The caller owns the buffer and must free() it.
+  virtual char* read(const std::string& path, size_t* size) = 0;
+
+  // Returns up to length bytes starting at offset in a malloc'd buffer, or
+  // NULL if the range could not be read. *size is less than length if the
+  // object ends first.
+  virtual char* read_range(const std::string& path,
+                           size_t offset,
+                           size_t length,
+                           size_t* size) = 0;
+
+  // Reads all of paths. buffers[i] receives a malloc'd buffer of sizes[i]
+  // bytes, or NULL if that read failed. Returns the number of failed reads.
+  virtual int read_many(const std::vector<std::string>& paths,
+                        std::vector<char*>& buffers,
+                        std::vector<size_t>& sizes);
+
+  // Reads lengths[i] bytes at offsets[i] of every paths[i], with the
+  // contract of read_range for each range and of read_many for the batch.
+  virtual int read_ranges(const std::vector<std::string>& paths,
+                          const std::vector<size_t>& offsets,
+                          const std::vector<size_t>& lengths,
+                          std::vector<char*>& buffers,
+                          std::vector<size_t>& sizes);
+
+  // Streams an object of unknown size; the object is complete once
+  // close_write returns
+  virtual FILE* write(const std::string& path) = 0;
+
+  virtual void close_write(FILE* fp, const std::string& path) = 0;
+
+  // Writes an object that is already in memory without staging it through a
+  // FILE*. Returns once the object is complete.
+  virtual void write_buffer(const std::string& path,
+                            const char* data,
+                            size_t size) = 0;
+
+  virtual bool exists(const std::string& path) = 0;
+};
+
+class GCSStorage : public Storage {
+public:
+  GCSStorage(const std::string& key, const std::string& bucket);
+
+  char* read(const std::string& path, size_t* size) override;
+
+  char* read_range(const std::string& path,
+                   size_t offset,
+                   size_t length,
+                   size_t* size) override;
+
+  int read_many(const std::vector<std::string>& paths,
+                std::vector<char*>& buffers,
+                std::vector<size_t>& sizes) override;
+
+  int read_ranges(const std::vector<std::string>& paths,
+                  const std::vector<size_t>& offsets,
+                  const std::vector<size_t>& lengths,
+                  std::vector<char*>& buffers,
+                  std::vector<size_t>& sizes) override;
+
+  FILE* write(const std::string& path) override;
+
+  void close_write(FILE* fp, const std::string& path) override;
+
+  void write_buffer(const std::string& path,
+                    const char* data,
+                    size_t size) override;
+
+  bool exists(const std::string& path) override;
+
+private:
+  std::string key_;
+  std::string bucket_;
+};
+
+// Paths are absolute filesystem paths. Reads size the buffer with fstat and
+// fill it with pread, so each byte is copied once from the page cache.
+// write_buffer goes through a temporary file and rename(), so a crashed or
+// concurrent writer never leaves a partial object behind.
+class FileStorage : public Storage {
+public:
+  char* read(const std::string& path, size_t* size) override;
+
+  char* read_range(const std::string& path,
+                   size_t offset,
+                   size_t length,
+                   size_t* size) override;
+
+  FILE* write(const std::string& path) override;
+
+  void close_write(FILE* fp, const std::string& path) override;
+
+  void write_buffer(const std::string& path,
+                    const char* data,
+                    size_t size) override;
+
+  bool exists(const std::string& path) override;
+};
+
+// Returns the backend serving uri and stores the object path within that
+// backend in *path. Backends live for the lifetime of the process.
+Storage* storage_for_uri(const std::string& uri, std::string* path);
+
+char* read_object(const std::string& uri, size_t* size);
+
+char* read_object_range(const std::string& uri,
+                        size_t offset,
+                        size_t length,
+                        size_t* size);
+
+// Reads all of uris, batching the requests that go to the same backend.
+// Same contract as Storage::read_many.
+int read_objects(const std::vector<std::string>& uris,
+                 std::vector<char*>& buffers,
+                 std::vector<size_t>& sizes);
+
+// Reads lengths[i] bytes at offsets[i] of every uris[i], batching the
+// requests that go to the same backend. Same contract as Storage::read_ranges.
+int read_object_ranges(const std::vector<std::string>& uris,
+                       const std::vector<size_t>& offsets,
+                       const std::vector<size_t>& lengths,
+                       std::vector<char*>& buffers,
+                       std::vector<size_t>& sizes);
+
+FILE* write_object(const std::string& uri);
+
+void close_write_object(FILE* fp, const std::string& uri);
+
+void write_object_buffer(const std::string& uri, const char* data, size_t size);
+
+bool object_exists(const std::string& uri);
+
+#endif // STORAGE_H_
@@ -0,0 +1,159 @@
+// Checks near-duplicate tracking across interleaved captures, and that
+// frames kept at different scales and layouts are measured alike.
+//
+//   frame_filters_test
+//
+// Exits with a nonzero status on the first failed check.
+
+#include "../frame_filters.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void expect(bool condition, const char* what) {
+  if (!condition) {
+    fprintf(stderr, "FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+const int sequence_a = 0;
+const int sequence_b = 1;
+
+// Frames of two captures alternate, and each capture's second frame is near
+// the other capture's first, which is earlier in a window shared by both.
+void test_interleaved_sequences() {
+  const uint64_t a = 0x00000000ffffffffULL;
+  const uint64_t b = a ^ 0x3;
+  DuplicateTracker tracker(4, 8);
+  expect(tracker.check(sequence_a, a, 0) == -1, "first frame of A is kept");
+  expect(tracker.check(sequence_b, b, 1) == -1,
+         "first frame of B is kept though it is near A");
+  expect(tracker.check(sequence_a, b, 2) == 0,
+         "frame of A near both matches A's frame, not B's");
+  expect(tracker.check(sequence_b, a, 3) == 1,
+         "frame of B near both matches B's frame, not A's");
+}
+
+// Kept frames of one capture do not take window slots from another
+void test_window_per_sequence() {
+  const uint64_t a = 0x0123456789abcdefULL;
+  DuplicateTracker tracker(2, 1);
+  expect(tracker.check(sequence_a, a, 0) == -1, "A's frame is kept");
+  expect(tracker.check(sequence_b, ~a, 1) == -1, "B's frame is kept");
+  expect(tracker.check(sequence_b, ~a ^ 0xff00ULL, 2) == -1,
+         "distinct frame of B is kept");
+  expect(tracker.check(sequence_a, a ^ 0x1, 3) == 0,
+         "A's window still holds A's frame");
+}
+
+// Only the last window kept frames of a capture are compared
+void test_window_expires() {
+  const uint64_t a = 0;
+  DuplicateTracker tracker(1, 2);
+  expect(tracker.check(sequence_a, a, 0) == -1, "frame 0 is kept");
+  expect(tracker.check(sequence_a, ~0ULL, 1) == -1, "frame 1 is kept");
+  expect(tracker.check(sequence_a, 0xff00ULL, 2) == -1, "frame 2 is kept");
+  expect(tracker.check(sequence_a, a, 3) == -1,
+         "frame 0 has left the window");
+}
+
+}
+
+// Red ramps across the image and green down it; blue is constant
+void source_pixel(int x, int y, int* r, int* g, int* b) {
+  *r = x * 4;
+  *g = y * 5;
+  *b = 100;
+}
+
+// A 64x48 source decoded at full size, at half size, and as 16-bit BGR rows
+// resampled to 32 wide all reduce to the same 8x6 thumbnail
+void test_eighth_scale_layouts() {
+  const int width = 64;
+  const int height = 48;
+
+  std::vector<uint8_t> full(width * height * 3);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      int r, g, b;
+      source_pixel(x, y, &r, &g, &b);
+      uint8_t* pixel = &full[(y * width + x) * 3];
+      pixel[0] = r;
+      pixel[1] = g;
+      pixel[2] = b;
+    }
+  }
+
+  std::vector<uint8_t> half(width / 2 * height / 2 * 3);
+  std::vector<uint16_t> rows(width / 2 * height * 3);
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width / 2; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        int sum = full[(y * width + 2 * x) * 3 + c] +
+          full[(y * width + 2 * x + 1) * 3 + c];
+        rows[(y * width / 2 + x) * 3 + (2 - c)] = sum * 128;
+        if (y % 2 == 0) {
+          sum += full[((y + 1) * width + 2 * x) * 3 + c] +
+            full[((y + 1) * width + 2 * x + 1) * 3 + c];
+          half[(y / 2 * width / 2 + x) * 3 + c] = (sum + 2) / 4;
+        }
+      }
+    }
+  }
+
+  Frame frames[3];
+  frames[0] = Frame();
+  frames[0].width = width;
+  frames[0].height = height;
+  frames[0].channels = 3;
+  frames[0].element_size = sizeof(uint8_t);
+  frames[0].data = (char*)full.data();
+  frames[1] = frames[0];
+  frames[1].width = width / 2;
+  frames[1].height = height / 2;
+  frames[1].data = (char*)half.data();
+  frames[2] = frames[0];
+  frames[2].width = width / 2;
+  frames[2].element_size = sizeof(uint16_t);
+  frames[2].data = (char*)rows.data();
+
+  FrameStats stats[3];
+  uint64_t hashes[3];
+  for (int i = 0; i < 3; ++i) {
+    std::vector<uint8_t> pixels;
+    Frame thumbnail = eighth_scale_frame(frames[i], width, height, &pixels);
+    expect(thumbnail.width == 8 && thumbnail.height == 6,
+           "thumbnail is an eighth of the source size");
+    // The first block averages x and y over 0 to 7
+    expect(std::abs(pixels[0] - 14) <= 1 && std::abs(pixels[1] - 18) <= 1 &&
+           pixels[2] == 100, "thumbnail pixel is its block's RGB mean");
+    compute_frame_stats(thumbnail, &stats[i]);
+    hashes[i] = perceptual_hash(thumbnail);
+  }
+  for (int i = 1; i < 3; ++i) {
+    for (int m = 0; m < FILTER_MEASURE_COUNT; ++m) {
+      expect(std::fabs(stats[i].values[m] - stats[0].values[m]) <=
+             0.02f * std::fabs(stats[0].values[m]) + 0.5f,
+             "measures agree across layouts");
+    }
+    expect(find_near_hash(hashes[i], &hashes[0], 1, 4) == 0,
+           "hashes agree across layouts");
+  }
+}
+
+int main() {
+  test_interleaved_sequences();
+  test_window_per_sequence();
+  test_window_expires();
+  test_eighth_scale_layouts();
+  if (failures > 0) return 1;
+  printf("frame_filters_test passed\n");
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Converts a text manifest into a binary manifest.
+//
+//   build_manifest <manifest> <output>
+//
+// Every frame is read once with the storage layer to record its encoded
+// length, content hash and source size, so runs over the binary manifest
+// never probe frames. Frames that cannot be read or are not valid JPEGs are
+// kept with a zero size, which the pipeline drops without fetching them.
+// Entries are written grouped by shape, the order the pipeline batches them
+// in. Storage flags such as -cache-dir are accepted after the positional
+// arguments.
+
+#include "../manifest.h"
+#include "../options.h"
+#include "../shard.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+namespace {
+
+// Frames requested from storage at once
+const size_t read_batch_size = 256;
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " <manifest> <output>" << std::endl;
+    return 1;
+  }
+  std::string manifest_path = argv[1];
+  std::string output_path = argv[2];
+  parse_options(argc, argv);
+
+  std::vector<ManifestEntry> entries;
+  {
+    std::ifstream manifest(manifest_path);
+    bool sizes_missing = false;
+    // Size columns after the path are recomputed from the frame
+    entries = read_manifest(manifest, std::numeric_limits<size_t>::max(),
+                            &sizes_missing);
+  }
+
+  int skipped = 0;
+  for (size_t start = 0; start < entries.size(); start += read_batch_size) {
+    size_t end = std::min(start + read_batch_size, entries.size());
+    std::vector<std::string> batch;
+    for (size_t i = start; i < end; ++i) {
+      batch.push_back(entries[i].path);
+    }
+
+    FrameBatch frames;
+    frames.read(batch);
+    for (size_t i = 0; i < batch.size(); ++i) {
+      ManifestEntry& entry = entries[start + i];
+      entry.width = 0;
+      entry.height = 0;
+      entry.bytes = 0;
+      entry.hash = 0;
+      if (frames.data(i) == nullptr) {
+        fprintf(stderr, "Skipping %s: could not be read\n", batch[i].c_str());
+        skipped++;
+        continue;
+      }
+      if (!read_jpeg_size(frames.data(i), frames.size(i),
+                          &entry.width, &entry.height)) {
+        fprintf(stderr, "Skipping %s: not a valid JPEG\n", batch[i].c_str());
+        entry.width = 0;
+        entry.height = 0;
+        skipped++;
+        continue;
+      }
+      entry.bytes = frames.size(i);
+      entry.hash = content_hash(frames.data(i), frames.size(i));
+    }
+  }
+
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const ManifestEntry& a, const ManifestEntry& b) {
+                     if (a.height != b.height) return a.height < b.height;
+                     return a.width < b.width;
+                   });
+
+  if (!write_binary_manifest(output_path, entries)) {
+    std::cerr << "Cannot write " << output_path << std::endl;
+    return 1;
+  }
+  printf("Wrote %lu entries, %d unreadable\n", entries.size(), skipped);
+  return 0;
+}
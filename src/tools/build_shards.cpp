@@ -0,0 +1,133 @@
+// Packs the frames listed in a manifest into shards.
+//
+//   build_shards <manifest> <shard-prefix> <output-manifest> [frames-per-shard]
+//
+// Frames are read with the storage layer, so manifest entries and the shard
+// prefix may use any URI scheme it understands. Every frame is checked with
+// the JPEG reader and frames that cannot be decoded are left out. Shards are
+// written as <shard-prefix>-NNNNN.shard, and <output-manifest> lists every
+// packed frame as "<shard-uri>#<index> <width> <height> <bytes>" in the order
+// of the input manifest, so the pipeline does not have to probe image sizes.
+// Storage flags such as -cache-dir are accepted after the positional
+// arguments.
+
+#include "../manifest.h"
+#include "../options.h"
+#include "../shard.h"
+#include "../storage.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+const int default_frames_per_shard = 1024;
+
+// Frames requested from storage at once
+const size_t read_batch_size = 256;
+
+std::string shard_name(const std::string& prefix, int shard) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "-%05d.shard", shard);
+  return prefix + suffix;
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    std::cerr << "usage: " << argv[0] << " <manifest> <shard-prefix> "
+              << "<output-manifest> [frames-per-shard]" << std::endl;
+    return 1;
+  }
+  std::string manifest_path = argv[1];
+  std::string prefix = argv[2];
+  std::string output_path = argv[3];
+  int frames_per_shard = default_frames_per_shard;
+  if (argc > 4 && argv[4][0] != '-') {
+    frames_per_shard = atoi(argv[4]);
+  }
+  parse_options(argc, argv);
+
+  std::vector<std::string> paths;
+  {
+    std::ifstream manifest(manifest_path);
+    std::string line;
+    while (std::getline(manifest, line)) {
+      // Size columns after the path are recomputed from the frame
+      std::string path;
+      std::istringstream(line) >> path;
+      if (!path.empty()) paths.push_back(path);
+    }
+  }
+
+  std::ofstream output(output_path);
+  if (!output.good()) {
+    std::cerr << "Cannot open " << output_path << std::endl;
+    return 1;
+  }
+
+  ShardWriter writer;
+  int shard = 0;
+  int skipped = 0;
+  // Dimensions and encoded length of each frame in the shard being built
+  struct FrameSize {
+    int width;
+    int height;
+    size_t bytes;
+  };
+  std::vector<FrameSize> sizes;
+  auto flush = [&]() {
+    if (writer.count() == 0) return;
+    std::string shard_uri = shard_name(prefix, shard++);
+    std::vector<char> data = writer.finish();
+    write_object_buffer(shard_uri, data.data(), data.size());
+    for (int i = 0; i < writer.count(); ++i) {
+      output << shard_member_uri(shard_uri, i) << " "
+             << sizes[i].width << " " << sizes[i].height << " "
+             << sizes[i].bytes << "\n";
+    }
+    printf("Wrote %s: %d frames, %lu bytes\n",
+           shard_uri.c_str(), writer.count(), data.size());
+    writer.clear();
+    sizes.clear();
+  };
+
+  for (size_t start = 0; start < paths.size(); start += read_batch_size) {
+    size_t end = std::min(start + read_batch_size, paths.size());
+    std::vector<std::string> batch(paths.begin() + start, paths.begin() + end);
+
+    std::vector<char*> buffers;
+    std::vector<size_t> buffer_sizes;
+    read_objects(batch, buffers, buffer_sizes);
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (buffers[i] == nullptr) {
+        fprintf(stderr, "Skipping %s: could not be read\n", batch[i].c_str());
+        skipped++;
+        continue;
+      }
+      int width;
+      int height;
+      if (read_jpeg_size(buffers[i], buffer_sizes[i], &width, &height)) {
+        writer.add(buffers[i], buffer_sizes[i]);
+        sizes.push_back(FrameSize{width, height, buffer_sizes[i]});
+      } else {
+        fprintf(stderr, "Skipping %s: not a valid JPEG\n", batch[i].c_str());
+        skipped++;
+      }
+      free(buffers[i]);
+
+      if (writer.count() == frames_per_shard) flush();
+    }
+  }
+  flush();
+
+  printf("Packed %lu frames into %d shards, skipped %d\n",
+         paths.size() - skipped, shard, skipped);
+  return 0;
+}
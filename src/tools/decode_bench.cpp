@@ -0,0 +1,167 @@
+// Measures JPEG decode throughput for each decode profile.
+//
+//   decode_bench <manifest> [max-frames] [repeats]
+//
+// Frames are fetched once through the storage layer and kept in memory, so
+// only decoding is timed. Each profile is run at full size and at the scale
+// -scaled-decode would pick. Next to frames/second the benchmark reports the
+// mean absolute pixel difference from the default full size decode, a cheap
+// proxy for how far features computed from the faster output can drift.
+
+#include "../options.h"
+#include "../shard.h"
+#include "../jpeg/JPEGReader.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// Matches the load task's target for scaled decodes
+const int target_width = 256;
+const int target_height = 256;
+
+struct Profile {
+  const char* name;
+  JPEG::TimeQualityTradeoff tradeoff;
+};
+
+const Profile profiles[] = {
+  {"accurate", JPEG::BETTER},
+  {"default", JPEG::DEFAULT},
+  {"fast", JPEG::FASTER},
+};
+
+struct Decoded {
+  unsigned width;
+  unsigned height;
+  std::vector<uint8_t> pixels;
+};
+
+// Reused across frames like the load task's per-thread reader
+JPEGReader reader;
+std::vector<uint8_t*> rows;
+
+void decode(const char* data, size_t size,
+            JPEG::TimeQualityTradeoff tradeoff, bool scaled,
+            Decoded* out) {
+  reader.header_mem((uint8_t*)data, size);
+  reader.setColorSpace(JPEG::COLOR_RGB);
+  reader.setTradeoff(tradeoff);
+  if (scaled) {
+    reader.chooseGoodScale(target_width, target_height);
+  }
+
+  out->width = reader.width();
+  out->height = reader.height();
+  size_t row_size = reader.width() * reader.components();
+  out->pixels.resize(row_size * reader.height());
+  rows.resize(reader.height());
+  for (size_t j = 0; j < reader.height(); ++j) {
+    rows[j] = out->pixels.data() + row_size * j;
+  }
+  reader.load(rows.begin());
+}
+
+// Compares against the reference by sampling it at the decoded size, since
+// scaled decodes are smaller than the reference
+double mean_abs_diff(const Decoded& reference, const Decoded& decoded) {
+  double total = 0;
+  for (unsigned y = 0; y < decoded.height; ++y) {
+    unsigned ry = y * reference.height / decoded.height;
+    for (unsigned x = 0; x < decoded.width; ++x) {
+      unsigned rx = x * reference.width / decoded.width;
+      for (int c = 0; c < 3; ++c) {
+        int a = reference.pixels[(ry * reference.width + rx) * 3 + c];
+        int b = decoded.pixels[(y * decoded.width + x) * 3 + c];
+        total += std::abs(a - b);
+      }
+    }
+  }
+  return total / (decoded.width * decoded.height * 3);
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " <manifest> [max-frames] [repeats]" << std::endl;
+    return 1;
+  }
+  size_t max_frames = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000;
+  int repeats = argc > 3 ? atoi(argv[3]) : 3;
+  parse_options(argc, argv);
+
+#ifdef LIBJPEG_TURBO_VERSION
+  printf("libjpeg-turbo, JPEG_LIB_VERSION %d\n", JPEG_LIB_VERSION);
+#else
+  printf("libjpeg, JPEG_LIB_VERSION %d\n", JPEG_LIB_VERSION);
+#endif
+
+  std::vector<std::string> paths;
+  {
+    std::ifstream manifest(argv[1]);
+    std::string line;
+    while (paths.size() < max_frames && std::getline(manifest, line)) {
+      std::string path;
+      std::istringstream(line) >> path;
+      if (!path.empty()) paths.push_back(path);
+    }
+  }
+
+  FrameBatch frames;
+  frames.read(paths);
+
+  // Reference decodes, dropping frames the reader rejects
+  std::vector<size_t> valid;
+  std::vector<Decoded> reference;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (frames.data(i) == nullptr) continue;
+    Decoded decoded;
+    try {
+      decode(frames.data(i), frames.size(i), JPEG::DEFAULT, false, &decoded);
+    } catch (const std::runtime_error& e) {
+      fprintf(stderr, "Skipping %s: %s\n", paths[i].c_str(), e.what());
+      continue;
+    }
+    valid.push_back(i);
+    reference.push_back(decoded);
+  }
+  printf("%lu frames, %d repeats\n\n", valid.size(), repeats);
+  if (valid.empty()) return 1;
+
+  printf("%-10s %-7s %12s %10s\n", "profile", "scale", "frames/s", "abs diff");
+  for (const Profile& profile : profiles) {
+    for (bool scaled : {false, true}) {
+      Decoded decoded;
+      auto start = std::chrono::steady_clock::now();
+      for (int r = 0; r < repeats; ++r) {
+        for (size_t i : valid) {
+          decode(frames.data(i), frames.size(i), profile.tradeoff, scaled,
+                 &decoded);
+        }
+      }
+      double seconds = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+
+      double diff = 0;
+      for (size_t j = 0; j < valid.size(); ++j) {
+        decode(frames.data(valid[j]), frames.size(valid[j]), profile.tradeoff,
+               scaled, &decoded);
+        diff += mean_abs_diff(reference[j], decoded);
+      }
+
+      printf("%-10s %-7s %12.1f %10.3f\n",
+             profile.name, scaled ? "scaled" : "full",
+             valid.size() * repeats / seconds, diff / valid.size());
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Measures KNN throughput and recall for each -feature-precision type.
+//
+//   knn_bench <store-uri> [max-vectors] [queries] [k]
+//
+// The vectors of a feature store written with the default fp32 precision are
+// loaded once and converted to every type. For each type, the first queries
+// vectors are searched against all of them with the same brute force kernels
+// as the KNN task. Recall is the fraction of the fp32 K nearest neighbours
+// the narrower type also returns.
+
+#include "../common.h"
+#include "../feature_precision.h"
+#include "../feature_store.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+const FeatureType types[] = {
+  FEATURE_FLOAT32,
+  FEATURE_FLOAT16,
+  FEATURE_INT8,
+};
+
+// Neighbours of the first queries rows, k per query
+std::vector<int> search(FeatureType type, const std::vector<char>& rows,
+                        size_t count, size_t queries, int k) {
+  std::vector<int> indices(queries * k);
+  std::vector<float> distances(k);
+  for (size_t q = 0; q < queries; ++q) {
+    nearest_rows(type, VEC_DIM, rows.data(), count, q, k, distances.data(),
+                 indices.data() + q * k);
+  }
+  return indices;
+}
+
+double recall(const std::vector<int>& reference,
+              const std::vector<int>& found, size_t queries, int k) {
+  size_t hits = 0;
+  size_t total = 0;
+  for (size_t q = 0; q < queries; ++q) {
+    const int* expected = reference.data() + q * k;
+    const int* actual = found.data() + q * k;
+    for (int j = 0; j < k; ++j) {
+      if (expected[j] < 0) continue;
+      total++;
+      if (std::find(actual, actual + k, expected[j]) != actual + k) hits++;
+    }
+  }
+  return total == 0 ? 1.0 : (double)hits / total;
+}
+
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0]
+              << " <store-uri> [max-vectors] [queries] [k]" << std::endl;
+    return 1;
+  }
+  size_t max_vectors = argc > 2 ? strtoul(argv[2], NULL, 10) : 10000;
+  size_t queries = argc > 3 ? strtoul(argv[3], NULL, 10) : 100;
+  int k = argc > 4 ? atoi(argv[4]) : 5;
+
+  std::vector<float> vectors;
+  size_t count;
+  {
+    FeatureStore store(argv[1], FEATURE_FLOAT32, VEC_DIM);
+    vectors.resize(store.rows() * VEC_DIM);
+    store.copy_rows((char*)vectors.data());
+    count = std::min(store.rows(), max_vectors);
+  }
+  queries = std::min(queries, count);
+  printf("%lu vectors, %lu queries, k = %d\n\n", count, queries, k);
+  if (queries == 0 || k <= 0) return 1;
+
+  std::vector<int> reference;
+  printf("%-6s %14s %12s %8s\n", "type", "bytes/vector", "queries/s",
+         "recall");
+  for (FeatureType type : types) {
+    std::vector<char> rows(count * feature_row_size(type, VEC_DIM));
+    encode_features(type, VEC_DIM, vectors.data(), count, rows.data());
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int> found = search(type, rows, count, queries, k);
+    double seconds = std::chrono::duration<double>
+      (std::chrono::steady_clock::now() - start).count();
+
+    if (type == FEATURE_FLOAT32) reference = found;
+    printf("%-6s %14lu %12.1f %8.4f\n", feature_type_name(type),
+           feature_row_size(type, VEC_DIM), queries / seconds,
+           recall(reference, found, queries, k));
+  }
+  return 0;
+}
@@ -12,9 +12,10 @@ using namespace LegionRuntime::HighLevel;
 using namespace LegionRuntime::Accessor;
 using namespace LegionRuntime::Arrays;
 
-FILE* read_gcs_file(std::string key,
-                    std::string bucket,
-                    std::string path) {
+char* read_gcs_buffer(std::string key,
+                      std::string bucket,
+                      std::string path,
+                      size_t* size) {
   // Setup in value
   GoString key_str;
   key_str.p = (char*)key.c_str();
@@ -28,13 +29,87 @@ FILE* read_gcs_file(std::string key,
   path_str.p = (char*)path.c_str();
   path_str.n = path.size();
 
-  char *fifo = (char*) gcs_read(key_str, bucket_str, path_str).data;
+  return (char*) gcs_read_buffer(key_str, bucket_str, path_str, size);
+}
 
-  FILE *fp = NULL;
-  if ((fp = fopen(fifo, "rb")) == NULL)
-    throw std::runtime_error("Cannot open " + path);
+char* read_gcs_range(std::string key,
+                     std::string bucket,
+                     std::string path,
+                     size_t offset,
+                     size_t length,
+                     size_t* size) {
+  GoString key_str;
+  key_str.p = (char*)key.c_str();
+  key_str.n = key.size();
 
-  return fp;
+  GoString bucket_str;
+  bucket_str.p = (char*)bucket.c_str();
+  bucket_str.n = bucket.size();
+
+  GoString path_str;
+  path_str.p = (char*)path.c_str();
+  path_str.n = path.size();
+
+  return (char*) gcs_read_range(key_str, bucket_str, path_str,
+                                offset, length, size);
+}
+
+int read_gcs_buffers(std::string key,
+                     std::string bucket,
+                     const std::vector<std::string>& paths,
+                     std::vector<char*>& buffers,
+                     std::vector<size_t>& sizes) {
+  // Setup in value
+  GoString key_str;
+  key_str.p = (char*)key.c_str();
+  key_str.n = key.size();
+
+  GoString bucket_str;
+  bucket_str.p = (char*)bucket.c_str();
+  bucket_str.n = bucket.size();
+
+  std::vector<char*> path_ptrs(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    path_ptrs[i] = (char*)paths[i].c_str();
+  }
+
+  buffers.assign(paths.size(), nullptr);
+  sizes.assign(paths.size(), 0);
+  std::vector<int> status(paths.size(), 0);
+
+  return gcs_read_many(key_str, bucket_str,
+                       path_ptrs.data(), paths.size(), gcs_read_workers,
+                       (void**)buffers.data(), sizes.data(), status.data());
+}
+
+int read_gcs_ranges(std::string key,
+                    std::string bucket,
+                    const std::vector<std::string>& paths,
+                    const std::vector<size_t>& offsets,
+                    const std::vector<size_t>& lengths,
+                    std::vector<char*>& buffers,
+                    std::vector<size_t>& sizes) {
+  GoString key_str;
+  key_str.p = (char*)key.c_str();
+  key_str.n = key.size();
+
+  GoString bucket_str;
+  bucket_str.p = (char*)bucket.c_str();
+  bucket_str.n = bucket.size();
+
+  std::vector<char*> path_ptrs(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    path_ptrs[i] = (char*)paths[i].c_str();
+  }
+
+  buffers.assign(paths.size(), nullptr);
+  sizes.assign(paths.size(), 0);
+  std::vector<int> status(paths.size(), 0);
+
+  return gcs_read_ranges(key_str, bucket_str, path_ptrs.data(),
+                         (size_t*)offsets.data(), (size_t*)lengths.data(),
+                         paths.size(), gcs_read_workers,
+                         (void**)buffers.data(), sizes.data(), status.data());
 }
 
 FILE* write_gcs_file(std::string key,
@@ -71,6 +146,27 @@ void close_gcs_write_file(FILE* fp, std::string path) {
   gcs_ensure_writes_are_done(path_str);
 }
 
+void write_gcs_buffer(std::string key,
+                      std::string bucket,
+                      std::string path,
+                      const char* data,
+                      size_t size) {
+  // Setup in value
+  GoString key_str;
+  key_str.p = (char*)key.c_str();
+  key_str.n = key.size();
+
+  GoString bucket_str;
+  bucket_str.p = (char*)bucket.c_str();
+  bucket_str.n = bucket.size();
+
+  GoString path_str;
+  path_str.p = (char*)path.c_str();
+  path_str.n = path.size();
+
+  gcs_write_buffer(key_str, bucket_str, path_str, (void*)data, size);
+}
+
 bool read_line(std::string &line, FILE *fp) {
   static char *line_buf = NULL;
   static size_t line_len = 0;
@@ -236,6 +332,8 @@ IndexPartition create_batched_partition(HighLevelRuntime* rt,
     DomainPointColoring coloring;
     size_t elements_allocated = 0;
     size_t i = 0;
+    Realm::Domain::DomainPointIterator is_itr(index_domain);
+    int index_lower_bound = is_itr.p[0];
     for (Realm::Domain::DomainPointIterator itr(color_dom); itr; itr++) {
       DomainPoint color = itr.p;
 
@@ -245,8 +343,8 @@ IndexPartition create_batched_partition(HighLevelRuntime* rt,
 
       coloring[color] =
         Domain::from_rect<1>
-        (Rect<1>(Point<1>(elements_allocated),
-                 Point<1>(elements_allocated + elements - 1)));
+        (Rect<1>(Point<1>(index_lower_bound + elements_allocated),
+                 Point<1>(index_lower_bound + elements_allocated + elements - 1)));
       elements_allocated += elements;
       i++;
     }
@@ -254,6 +352,52 @@ IndexPartition create_batched_partition(HighLevelRuntime* rt,
   }
 }
 
+IndexPartition create_sized_partition(HighLevelRuntime* rt,
+                                      Context ctx,
+                                      IndexSpace is,
+                                      const std::vector<size_t>& sizes,
+                                      Domain& color_dom) {
+  Domain index_domain = rt->get_index_space_domain(ctx, is);
+
+  Rect<1> color_rect = Rect<1>(Point<1>(0), Point<1>(sizes.size() - 1));
+  color_dom = Domain::from_rect<1>(color_rect);
+
+  if (index_domain.get_dim() == 0) {
+    PointColoring coloring;
+    IndexIterator is_itr(rt, ctx, is);
+    size_t i = 0;
+    for (Realm::Domain::DomainPointIterator itr(color_dom); itr; itr++, i++) {
+      DomainPoint color = itr.p;
+      // Colors with no elements still need an entry
+      coloring[color];
+      for (size_t j = 0; j < sizes[i]; ++j) {
+        if (is_itr.has_next()) {
+          coloring[color].points.insert(is_itr.next());
+        } else {
+          assert(false);
+        }
+      }
+    }
+    return rt->create_index_partition(ctx, is, color_dom, coloring);
+  } else {
+    DomainPointColoring coloring;
+    size_t elements_allocated = 0;
+    size_t i = 0;
+    Realm::Domain::DomainPointIterator is_itr(index_domain);
+    int index_lower_bound = is_itr.p[0];
+    for (Realm::Domain::DomainPointIterator itr(color_dom); itr; itr++, i++) {
+      DomainPoint color = itr.p;
+      coloring[color] =
+        Domain::from_rect<1>
+        (Rect<1>(Point<1>(index_lower_bound + elements_allocated),
+                 Point<1>(index_lower_bound + elements_allocated +
+                          sizes[i] - 1)));
+      elements_allocated += sizes[i];
+    }
+    return rt->create_index_partition(ctx, is, color_dom, coloring);
+  }
+}
+
 double vec_sum(float* data, int size) {
   double sum = 0.0f;
   for (int i = 0; i < size; i += 1024) {
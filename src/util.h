@@ -1,7 +1,9 @@
 #ifndef UTIL_H_
 #define UTIL_H_
 
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <cstdio>
 
 #include "legion.h"
@@ -21,12 +23,56 @@ using ImageAccessor =
 const std::string gcs_key = "keys/visualdb-12f1f722b05e.json";
 const std::string gcs_bucket = "vdb-imagenet";
 
-FILE* read_gcs_file(std::string key, std::string bucket, std::string path);
+// Returns the whole object in a malloc'd buffer of *size bytes, or NULL if it
+// could not be read. The caller owns the buffer and must free() it.
+char* read_gcs_buffer(std::string key,
+                      std::string bucket,
+                      std::string path,
+                      size_t* size);
+
+// Returns up to length bytes starting at offset in a malloc'd buffer, or NULL
+// if the range could not be read. *size is short if the object ends first.
+char* read_gcs_range(std::string key,
+                     std::string bucket,
+                     std::string path,
+                     size_t offset,
+                     size_t length,
+                     size_t* size);
+
+// Number of requests read_gcs_buffers and read_gcs_ranges keep in flight at
+// once.
+const int gcs_read_workers = 16;
+
+// Reads all of paths with a single call into the GCS bindings. buffers[i]
+// receives a malloc'd buffer of sizes[i] bytes owned by the caller, or NULL if
+// that read failed. Returns the number of failed reads.
+int read_gcs_buffers(std::string key,
+                     std::string bucket,
+                     const std::vector<std::string>& paths,
+                     std::vector<char*>& buffers,
+                     std::vector<size_t>& sizes);
+
+// Reads lengths[i] bytes at offsets[i] of every paths[i] with a single call
+// into the GCS bindings. Same contract as read_gcs_buffers.
+int read_gcs_ranges(std::string key,
+                    std::string bucket,
+                    const std::vector<std::string>& paths,
+                    const std::vector<size_t>& offsets,
+                    const std::vector<size_t>& lengths,
+                    std::vector<char*>& buffers,
+                    std::vector<size_t>& sizes);
 
 FILE* write_gcs_file(std::string key, std::string bucket, std::string path);
 
 void close_gcs_write_file(FILE* fp, std::string path);
 
+// Uploads size bytes from data in chunks, returning once the object exists.
+void write_gcs_buffer(std::string key,
+                      std::string bucket,
+                      std::string path,
+                      const char* data,
+                      size_t size);
+
 bool read_line(std::string &line, FILE *fp);
 
 template<unsigned DIM>
@@ -61,6 +107,22 @@ bool get_raw_pointer(UntypedAccessor acc,
                      size_t size,
                      char **ptr);
 
+// Non-owning view of characters in a mapped region, for reading strings
+// without copying them out
+struct StringRef {
+  StringRef() : data(nullptr), size(0) {}
+  StringRef(const char* data, size_t size) : data(data), size(size) {}
+
+  std::string str() const { return std::string(data, size); }
+
+  const char* data;
+  size_t size;
+};
+
+inline bool operator==(const StringRef& a, const StringRef& b) {
+  return a.size == b.size && std::equal(a.data, a.data + a.size, b.data);
+}
+
 template <int LENGTH>
 std::string read_string(StringAccessor accessor,
                         LegionRuntime::HighLevel::DomainPoint point) {
@@ -103,6 +165,15 @@ LegionRuntime::HighLevel::IndexPartition create_batched_partition
  int batch_size,
  LegionRuntime::HighLevel::Domain& color_domain);
 
+// Partitions is into consecutive runs of sizes[i] elements, colored 0 to
+// sizes.size() - 1. The sizes must add up to the volume of is.
+LegionRuntime::HighLevel::IndexPartition create_sized_partition
+(LegionRuntime::HighLevel::HighLevelRuntime* rt,
+ LegionRuntime::HighLevel::Context ctx,
+ LegionRuntime::HighLevel::IndexSpace is,
+ const std::vector<size_t>& sizes,
+ LegionRuntime::HighLevel::Domain& color_domain);
+
 double vec_sum(float* data, int size);
 
 #endif // UTIL_H_